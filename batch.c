@@ -0,0 +1,473 @@
+/*
+ * Batch runner for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batch.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "cpu.h"
+#include "loader.h"
+
+#include "core.h"
+
+#define MAX_LINE    1024
+
+typedef struct {
+    char *path;
+    Flash *flash;
+} Image;
+
+typedef struct {
+    // from the manifest
+    int image;                  // index into Images
+    char *input;                // or NULL for none
+    char *expected;             // or NULL to not check the output
+    u64 limit;                  // cycles, or 0 for none
+    // filled in by the worker that runs it
+    const char *result;
+    u64 cycles;
+    u64 wallus;
+    u64 digest;
+    // while it runs
+    Cpu *cpu;
+    int inf;
+    FILE *out;
+    u64 start;
+    u64 key;                    // in the cache, if there is one
+} Job;
+
+// Work is handed out in units: one job, or with lockstep a run of up to
+// LOCKSTEP_LANES jobs on the same image. Each worker pops units off the
+// front of its own range and, once that runs dry, steals the back half of
+// the fullest range it can find.
+typedef struct {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+} Queue;
+
+static Image *Images;
+static int ImageCount;
+static Job *Jobs;
+static int JobCount;
+static Queue *Queues;
+static int QueueCount;
+static int Engine;
+static bool Lockstep;
+static int *Units;              // first job of each unit, and JobCount
+static int UnitCount;
+static bool Caching;
+static int CacheHits;
+static int CacheMisses;
+
+static int find_image(const char *path)
+{
+    int i;
+    for (i = 0; i < ImageCount; i++) {
+        if (strcmp(Images[i].path, path) == 0) {
+            return i;
+        }
+    }
+    Images = realloc(Images, (ImageCount + 1) * sizeof(Image));
+    if (Images == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    Image *im = &Images[ImageCount];
+    im->path = strdup(path);
+    im->flash = load_flash(path);
+    return ImageCount++;
+}
+
+// image input expected [cycles], one job per line; - for no input or no
+// expected output, and # starts a comment
+static void read_manifest(const char *fn)
+{
+    FILE *f = fopen(fn, "r");
+    if (f == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    char s[MAX_LINE];
+    int line = 0;
+    while (fgets(s, sizeof(s), f)) {
+        line++;
+        char *hash = strchr(s, '#');
+        if (hash != NULL) {
+            *hash = 0;
+        }
+        char image[MAX_LINE], input[MAX_LINE], expected[MAX_LINE];
+        unsigned long long limit = 0;
+        int n = sscanf(s, "%s %s %s %llu", image, input, expected, &limit);
+        if (n <= 0) {
+            continue;
+        }
+        if (n < 3) {
+            fprintf(stderr, "%s:%d: expected image input expected [cycles]\n", fn, line);
+            exit(1);
+        }
+        Jobs = realloc(Jobs, (JobCount + 1) * sizeof(Job));
+        if (Jobs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        Job *job = &Jobs[JobCount++];
+        memset(job, 0, sizeof(Job));
+        job->image = find_image(image);
+        job->input = strcmp(input, "-") != 0 ? strdup(input) : NULL;
+        job->expected = strcmp(expected, "-") != 0 ? strdup(expected) : NULL;
+        job->limit = limit;
+    }
+    fclose(f);
+}
+
+// Reads a whole file into memory, returning NULL if it can't.
+static u8 *slurp(FILE *f, long *size)
+{
+    if (fseek(f, 0, SEEK_END) != 0 || (*size = ftell(f)) < 0) {
+        return NULL;
+    }
+    rewind(f);
+    u8 *buf = malloc(*size + 1);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (fread(buf, 1, *size, f) != (size_t)*size) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static u64 now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Checks the output of a job that ended in state, and fills in its result.
+static void check_job(Job *job, int state, const u8 *output, long size)
+{
+    // FNV-1a, as for flash images
+    job->digest = 0xcbf29ce484222325ULL;
+    long i;
+    for (i = 0; i < size; i++) {
+        job->digest = (job->digest ^ output[i]) * 0x100000001b3ULL;
+    }
+    if (state == CPU_STOP) {
+        job->result = "timeout";
+    } else if (state == CPU_FAULT) {
+        job->result = "fault";
+    } else if (job->expected == NULL) {
+        job->result = "pass";
+    } else {
+        FILE *f = fopen(job->expected, "rb");
+        long expsize;
+        u8 *expected = f != NULL ? slurp(f, &expsize) : NULL;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (expected == NULL) {
+            job->result = "error";
+        } else {
+            job->result = expsize == size && memcmp(expected, output, size) == 0 ? "pass" : "fail";
+        }
+        free(expected);
+    }
+}
+
+// Looks the job up in the cache, finishing it from there on a hit.
+static bool cached_job(Job *job)
+{
+    long inputsize = 0;
+    u8 *input = NULL;
+    if (job->input != NULL) {
+        FILE *f = fopen(job->input, "rb");
+        input = f != NULL ? slurp(f, &inputsize) : NULL;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (input == NULL) {
+            // start_job() reports it
+            return false;
+        }
+    }
+    job->key = cache_key(job->cpu, input, inputsize, job->limit, Engine, Lockstep);
+    free(input);
+    int state;
+    long size;
+    u8 *output = cache_lookup(job->key, &state, &job->cycles, &size);
+    if (output == NULL) {
+        __sync_fetch_and_add(&CacheMisses, 1);
+        return false;
+    }
+    __sync_fetch_and_add(&CacheHits, 1);
+    check_job(job, state, output, size);
+    free(output);
+    cpu_free(job->cpu);
+    job->cpu = NULL;
+    job->wallus = now_us() - job->start;
+    return true;
+}
+
+// Sets up a board for the job, or fails it if its files can't be opened,
+// or finishes it at once if its result is in the cache.
+static bool start_job(Job *job)
+{
+    job->start = now_us();
+    job->cpu = cpu_new(Images[job->image].flash);
+    if (Caching && cached_job(job)) {
+        return false;
+    }
+    job->inf = open(job->input != NULL ? job->input : "/dev/null", O_RDONLY);
+    job->out = tmpfile();
+    if (job->inf < 0 || job->out == NULL) {
+        job->result = "error";
+        if (job->inf >= 0) {
+            close(job->inf);
+        }
+        if (job->out != NULL) {
+            fclose(job->out);
+        }
+        cpu_free(job->cpu);
+        job->cpu = NULL;
+        return false;
+    }
+    cpu_set_engine(job->cpu, Engine);
+    cpu_usart_set_input(job->cpu, job->inf);
+    cpu_usart_set_output(job->cpu, fileno(job->out));
+    if (job->limit > 0) {
+        cpu_stop_at(job->cpu, job->limit);
+    }
+    return true;
+}
+
+// Runs the job's board to the end, wherever it got to, and checks it.
+static void finish_job(Job *job)
+{
+    Cpu *cpu = job->cpu;
+    int state = cpu_get_state(cpu);
+    while (state != CPU_HALT && state != CPU_STOP && state != CPU_FAULT) {
+        state = cpu_run(cpu);
+    }
+    job->cycles = cpu_get_cycles(cpu);
+    cpu_free(cpu);
+    close(job->inf);
+
+    long size;
+    u8 *output = slurp(job->out, &size);
+    fclose(job->out);
+    job->wallus = now_us() - job->start;
+    if (output == NULL) {
+        job->result = "error";
+        return;
+    }
+    if (Caching) {
+        cache_store(job->key, state, job->cycles, output, size);
+    }
+    check_job(job, state, output, size);
+    free(output);
+}
+
+// Runs the jobs of a unit together in lockstep for as long as they keep
+// to the same path, then each on its own.
+static void run_unit(int u)
+{
+    Cpu *cpus[LOCKSTEP_LANES];
+    int n = 0;
+    int j;
+    for (j = Units[u]; j < Units[u+1]; j++) {
+        if (start_job(&Jobs[j])) {
+            cpus[n++] = Jobs[j].cpu;
+        }
+    }
+    if (n >= 2) {
+        cpu_lockstep(cpus, n);
+    }
+    for (j = Units[u]; j < Units[u+1]; j++) {
+        if (Jobs[j].cpu != NULL) {
+            finish_job(&Jobs[j]);
+        }
+    }
+}
+
+static int take_unit(int w)
+{
+    Queue *q = &Queues[w];
+    pthread_mutex_lock(&q->lock);
+    int j = q->next < q->end ? q->next++ : -1;
+    pthread_mutex_unlock(&q->lock);
+    while (j < 0) {
+        int victim = -1;
+        int most = 0;
+        int i;
+        for (i = 0; i < QueueCount; i++) {
+            pthread_mutex_lock(&Queues[i].lock);
+            int left = Queues[i].end - Queues[i].next;
+            pthread_mutex_unlock(&Queues[i].lock);
+            if (i != w && left > most) {
+                victim = i;
+                most = left;
+            }
+        }
+        if (victim < 0) {
+            return -1;
+        }
+        Queue *v = &Queues[victim];
+        int next = 0, end = 0;
+        pthread_mutex_lock(&v->lock);
+        if (v->next < v->end) {
+            end = v->end;
+            next = v->end - (v->end - v->next + 1) / 2;
+            v->end = next;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (next < end) {
+            j = next++;
+            pthread_mutex_lock(&q->lock);
+            q->next = next;
+            q->end = end;
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    return j;
+}
+
+static void *worker(void *arg)
+{
+    int w = (int)(long)arg;
+    int j;
+    while ((j = take_unit(w)) >= 0) {
+        run_unit(j);
+    }
+    return NULL;
+}
+
+// Runs every job in the manifest on threads workers (0 for one per CPU)
+// with the given engine, optionally in lockstep groups, and writes a tab
+// separated report of the results. With a cache directory, jobs whose
+// results are already there aren't run again. Returns the number of jobs
+// that did not pass.
+int batch_run(const char *manifest, const char *report, int threads, int engine, bool lockstep, const char *cache)
+{
+    if (engine != CPU_ENGINE_INTERP && !jit_available()) {
+        fprintf(stderr, "JIT engine not available on this platform\n");
+        exit(1);
+    }
+    Engine = engine;
+    Lockstep = lockstep;
+    if (cache != NULL) {
+        cache_open(cache);
+        Caching = true;
+    }
+    read_manifest(manifest);
+    Units = malloc((JobCount + 1) * sizeof(int));
+    if (Units == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < JobCount; i++) {
+        if (!lockstep || i == 0 || Jobs[i].image != Jobs[i-1].image
+         || i - Units[UnitCount-1] == LOCKSTEP_LANES) {
+            Units[UnitCount++] = i;
+        }
+    }
+    Units[UnitCount] = JobCount;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > UnitCount) {
+        threads = UnitCount > 0 ? UnitCount : 1;
+    }
+
+    u64 start = now_us();
+    Queues = calloc(threads, sizeof(Queue));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (Queues == NULL || tids == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    QueueCount = threads;
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&Queues[i].lock, NULL);
+        Queues[i].next = (long)UnitCount * i / threads;
+        Queues[i].end = (long)UnitCount * (i + 1) / threads;
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, worker, (void *)(long)i) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    u64 wallus = now_us() - start;
+
+    FILE *f = report != NULL ? fopen(report, "w") : stdout;
+    if (f == NULL) {
+        perror(report);
+        exit(1);
+    }
+    fprintf(f, "job\timage\tinput\tresult\tcycles\twall_us\tdigest\n");
+    int failed = 0;
+    for (i = 0; i < JobCount; i++) {
+        Job *job = &Jobs[i];
+        fprintf(f, "%d\t%s\t%s\t%s\t%llu\t%llu\t%016llx\n", i, Images[job->image].path,
+            job->input != NULL ? job->input : "-", job->result, job->cycles, job->wallus, job->digest);
+        if (strcmp(job->result, "pass") != 0) {
+            failed++;
+        }
+    }
+    if (f != stdout) {
+        fclose(f);
+    }
+    fprintf(stderr, "batch: %d jobs, %d failed, %d threads, %.3f s", JobCount, failed, threads, wallus / 1e6);
+    if (Caching) {
+        fprintf(stderr, ", cache %d hits, %d misses", CacheHits, CacheMisses);
+    }
+    fprintf(stderr, "\n");
+
+    for (i = 0; i < ImageCount; i++) {
+        flash_release(Images[i].flash);
+        free(Images[i].path);
+    }
+    for (i = 0; i < JobCount; i++) {
+        free(Jobs[i].input);
+        free(Jobs[i].expected);
+    }
+    free(Images);
+    free(Jobs);
+    free(Queues);
+    free(Units);
+    free(tids);
+    return failed;
+}
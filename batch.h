@@ -0,0 +1,28 @@
+/*
+ * Batch runner for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include "util.h"
+
+int batch_run(const char *manifest, const char *report, int threads, int engine, bool lockstep, const char *cache);
+
+#endif // __BATCH_H
@@ -0,0 +1,145 @@
+/*
+ * Result cache for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core.h"
+
+// A run's result is a function of the program, the EEPROM it starts with,
+// its input, its cycle limit and the emulator itself, so the cache keys a
+// result by a hash of all of those. The emulator is identified by hashing
+// its own executable, so any rebuild starts a fresh cache rather than
+// trusting results from code that may behave differently. Each entry is a
+// file named by its key holding a header line and then the output:
+//
+//     emulino-cache <key> <state> <cycles> <output size>
+
+static const char *Dir;
+static u64 Build;
+static int Sequence;            // numbers entries being written
+
+static u64 fnv(u64 h, const void *buf, long size)
+{
+    const u8 *p = buf;
+    long i;
+    for (i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void entry_path(char *fn, int size, u64 key)
+{
+    snprintf(fn, size, "%s/%016llx", Dir, key);
+}
+
+// Uses dir for the cache, creating it if need be.
+void cache_open(const char *dir)
+{
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror(dir);
+        exit(1);
+    }
+    Dir = dir;
+    Build = 0xcbf29ce484222325ULL;
+    FILE *f = fopen("/proc/self/exe", "rb");
+    if (f != NULL) {
+        u8 buf[65536];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            Build = fnv(Build, buf, n);
+        }
+        fclose(f);
+    } else {
+        const char *stamp = __DATE__ " " __TIME__;
+        Build = fnv(Build, stamp, strlen(stamp));
+    }
+}
+
+// The key for running the board as it is now, fresh from cpu_new() and
+// any EEPROM load, on input until limit cycles (0 for no limit), with
+// engine and maybe in lockstep. The engines are meant to agree to the
+// cycle, but an entry from one is never taken on trust for another.
+u64 cache_key(const Cpu *cpu, const u8 *input, long inputsize, u64 limit, int engine, bool lockstep)
+{
+    u64 h = fnv(Build, &cpu->flash->hash, sizeof(cpu->flash->hash));
+    h = fnv(h, cpu->eeprom.eeprom, EEPROM_SIZE);
+    h = fnv(h, &limit, sizeof(limit));
+    h = fnv(h, &engine, sizeof(engine));
+    h = fnv(h, &lockstep, sizeof(lockstep));
+    h = fnv(h, &inputsize, sizeof(inputsize));
+    return fnv(h, input, inputsize);
+}
+
+// Returns the output stored for key, with the final state and cycle
+// count, or NULL if there isn't one.
+u8 *cache_lookup(u64 key, int *state, u64 *cycles, long *size)
+{
+    char fn[1024];
+    entry_path(fn, sizeof(fn), key);
+    FILE *f = fopen(fn, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    unsigned long long k, c;
+    u8 *output = NULL;
+    if (fscanf(f, "emulino-cache %llx %d %llu %ld", &k, state, &c, size) == 4 && fgetc(f) == '\n'
+     && k == key && *size >= 0) {
+        output = malloc(*size + 1);
+        if (output == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (fread(output, 1, *size, f) != (size_t)*size) {
+            free(output);
+            output = NULL;
+        }
+        *cycles = c;
+    }
+    fclose(f);
+    return output;
+}
+
+// Stores a result under key. The entry is written to one side and renamed
+// into place, so other processes sharing the cache never see half of it.
+void cache_store(u64 key, int state, u64 cycles, const u8 *output, long size)
+{
+    char fn[1024], tmp[1100];
+    entry_path(fn, sizeof(fn), key);
+    snprintf(tmp, sizeof(tmp), "%s.%d.%d", fn, getpid(), __sync_fetch_and_add(&Sequence, 1));
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror(tmp);
+        return;
+    }
+    fprintf(f, "emulino-cache %016llx %d %llu %ld\n", key, state, cycles, size);
+    bool ok = fwrite(output, 1, size, f) == (size_t)size;
+    if (fclose(f) != 0 || !ok || rename(tmp, fn) != 0) {
+        perror(tmp);
+        unlink(tmp);
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * Result cache for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "cpu.h"
+
+void cache_open(const char *dir);
+u64 cache_key(const Cpu *cpu, const u8 *input, long inputsize, u64 limit, int engine, bool lockstep);
+u8 *cache_lookup(u64 key, int *state, u64 *cycles, long *size);
+void cache_store(u64 key, int state, u64 cycles, const u8 *output, long size);
+
+#endif // __CACHE_H
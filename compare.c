@@ -0,0 +1,401 @@
+/*
+ * Differential runs of two images for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compare.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "loader.h"
+
+#include "core.h"
+
+#define MAX_DIFFS   16      // differing bytes of a region to list
+
+// Two builds of the same firmware seldom take the same number of cycles
+// to do anything, so their outputs are matched in the order they happen
+// rather than by cycle. Each board runs on its own thread for sync
+// cycles at a time, and in between the outputs both have made so far
+// are compared one by one, along with the chosen regions of data memory
+// as they were at each output. The first that differs ends the run.
+// How a board stops is its last output, so halting early, faulting or
+// waiting for input that isn't coming differ like anything else, except
+// that running out of cycles ends the comparison there.
+//
+// Both boards get the whole input, each as fast as it reads it, and stop
+// idle when they have read all of it.
+
+#define OUT_SERIAL  0   // a byte from the USART
+#define OUT_PIN     1   // an output pin changing
+#define OUT_END     2   // the board stopped, how in value
+
+#define END_HALT    0
+#define END_FAULT   1
+#define END_INPUT   2   // waiting for more input
+#define END_LIMIT   3   // ran out of cycles
+
+typedef struct {
+    u8 kind;            // OUT_*
+    u8 pin;
+    u8 value;           // byte, pin state, or END_*
+    u8 sreg;
+    u16 pc;             // word address of the instruction making it
+    u16 sp;
+    u64 cycle;
+    u8 reg[32];
+} Output;
+
+typedef struct {
+    const char *image;
+    Cpu *cpu;
+    int inputpos;
+    int end;            // END_* once it has stopped, or -1
+    Output *outs;       // not yet compared
+    u8 *data;           // the regions at each of outs
+    int count;
+    int size;
+} Side;
+
+static Side Sides[2];
+static const u8 *Input;
+static int InputLen;
+static const Region *Regions;
+static int RegionCount;
+static int RegionBytes;
+static u64 Sync;
+static u64 Limit;
+static pthread_barrier_t Barrier;
+static bool Finished;
+static int Result;
+static u64 Compared;
+static u64 Bytes;
+static u64 PinChanges;
+
+static const char *EndNames[] = {"halted", "faulted", "waiting for input", "out of cycles"};
+
+static Output *add_output(Side *s, int kind, int pin, int value, bool executing)
+{
+    if (s->count >= s->size) {
+        s->size = s->size > 0 ? 2 * s->size : 256;
+        s->outs = realloc(s->outs, s->size * sizeof(Output));
+        s->data = realloc(s->data, s->size * RegionBytes + 1);
+        if (s->outs == NULL || s->data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Cpu *cpu = s->cpu;
+    Output *o = &s->outs[s->count];
+    o->kind = kind;
+    o->pin = pin;
+    o->value = value;
+    // in the middle of an instruction PC is already past it, which is one
+    // word long unless it is one of the two word ones
+    u16 pc = cpu->pc;
+    if (executing) {
+        pc = pc >= 2 && cpu->decoded[(u16)(pc-2)].length == 2 ? pc - 2 : pc - 1;
+    }
+    o->pc = pc;
+    o->cycle = cpu->cycle;
+    sreg_sync(cpu);
+    o->sreg = cpu->data.SREG.bits;
+    o->sp = cpu->data.SP;
+    memcpy(o->reg, cpu->data.Reg, sizeof(o->reg));
+    u8 *d = s->data + s->count * RegionBytes;
+    int i;
+    for (i = 0; i < RegionCount; i++) {
+        memcpy(d, &cpu->data._Bytes[Regions[i].addr], Regions[i].len);
+        d += Regions[i].len;
+    }
+    s->count++;
+    return o;
+}
+
+static void serial_out(Cpu *cpu, u8 c)
+{
+    add_output(cpu_get_context(cpu), OUT_SERIAL, 0, c, true);
+}
+
+static void pin_out(Cpu *cpu, int pin, bool state)
+{
+    add_output(cpu_get_context(cpu), OUT_PIN, pin, state, true);
+}
+
+static void finish(Side *s, int how)
+{
+    add_output(s, OUT_END, 0, how, false);
+    s->end = how;
+}
+
+// Runs the board on to cycle end, or until it stops for good.
+static void run_until(Side *s, u64 end)
+{
+    Cpu *cpu = s->cpu;
+    while (s->end < 0) {
+        if (Limit > 0 && cpu_get_cycles(cpu) >= Limit) {
+            finish(s, END_LIMIT);
+            break;
+        }
+        if (cpu_get_cycles(cpu) >= end) {
+            break;
+        }
+        s->inputpos += cpu_usart_receive(cpu, Input + s->inputpos, InputLen - s->inputpos);
+        cpu_stop_at(cpu, Limit > 0 && Limit < end ? Limit : end);
+        int state;
+        do {
+            state = cpu_run(cpu);
+        } while (state == CPU_RUN || state == CPU_SLEEP);
+        if (state == CPU_HALT) {
+            finish(s, END_HALT);
+        } else if (state == CPU_FAULT) {
+            finish(s, END_FAULT);
+        } else if (cpu_get_cycles(cpu) < end && s->inputpos >= InputLen && cpu_usart_pending(cpu) == 0) {
+            // stopped early polling for input, and there is no more
+            finish(s, END_INPUT);
+        }
+    }
+}
+
+static void describe(const Side *s, const Output *o)
+{
+    fprintf(stderr, "  %s: cycle %llu pc %04x ", s->image, o->cycle, o->pc*2);
+    switch (o->kind) {
+    case OUT_SERIAL:
+        fprintf(stderr, "serial %02x\n", o->value);
+        break;
+    case OUT_PIN:
+        fprintf(stderr, "pin %d %d\n", o->pin, o->value);
+        break;
+    case OUT_END:
+        fprintf(stderr, "%s", EndNames[o->value]);
+        if (o->value == END_FAULT) {
+            fprintf(stderr, ": %s", cpu_get_fault(s->cpu));
+        }
+        fprintf(stderr, "\n");
+        break;
+    }
+}
+
+// Reports where the boards were at the outputs that differ, and what
+// differed between them then.
+static void report(int n)
+{
+    const Output *a = &Sides[0].outs[n];
+    const Output *b = &Sides[1].outs[n];
+    describe(&Sides[0], a);
+    describe(&Sides[1], b);
+    int i;
+    for (i = 0; i < 32; i++) {
+        if (a->reg[i] != b->reg[i]) {
+            fprintf(stderr, "  r%d: %02x %02x\n", i, a->reg[i], b->reg[i]);
+        }
+    }
+    if (a->sreg != b->sreg) {
+        fprintf(stderr, "  SREG: %02x %02x\n", a->sreg, b->sreg);
+    }
+    if (a->sp != b->sp) {
+        fprintf(stderr, "  SP: %04x %04x\n", a->sp, b->sp);
+    }
+    const u8 *da = Sides[0].data + n * RegionBytes;
+    const u8 *db = Sides[1].data + n * RegionBytes;
+    int diffs = 0;
+    int r;
+    for (r = 0; r < RegionCount; r++) {
+        for (i = 0; i < Regions[r].len; i++, da++, db++) {
+            if (*da != *db && diffs++ < MAX_DIFFS) {
+                fprintf(stderr, "  %04x: %02x %02x\n", Regions[r].addr + i, *da, *db);
+            }
+        }
+    }
+    if (diffs > MAX_DIFFS) {
+        fprintf(stderr, "  and %d more bytes\n", diffs - MAX_DIFFS);
+    }
+}
+
+// Matches up the outputs both boards have made, and sets Finished at the
+// first difference or once both have stopped the same way.
+static void compare()
+{
+    Side *a = &Sides[0];
+    Side *b = &Sides[1];
+    int n = a->count < b->count ? a->count : b->count;
+    int i;
+    for (i = 0; i < n; i++) {
+        const Output *oa = &a->outs[i];
+        const Output *ob = &b->outs[i];
+        if ((oa->kind == OUT_END && oa->value == END_LIMIT) || (ob->kind == OUT_END && ob->value == END_LIMIT)) {
+            // nothing is known about what either does after that
+            Compared += i;
+            Finished = true;
+            return;
+        }
+        const char *what = NULL;
+        if (oa->kind != ob->kind || oa->pin != ob->pin || oa->value != ob->value) {
+            what = "output";
+        } else if (memcmp(a->data + i * RegionBytes, b->data + i * RegionBytes, RegionBytes) != 0) {
+            what = "data memory";
+        }
+        if (what != NULL) {
+            fprintf(stderr, "compare: %s differs at output %llu\n", what, Compared + i);
+            report(i);
+            Result = 1;
+            Finished = true;
+            return;
+        }
+        if (oa->kind == OUT_SERIAL) {
+            Bytes++;
+        } else if (oa->kind == OUT_PIN) {
+            PinChanges++;
+        } else {
+            // both stopped, leaving the last outputs for the summary
+            Compared += i;
+            Finished = true;
+            return;
+        }
+    }
+    Compared += n;
+    for (i = 0; i < 2; i++) {
+        Side *s = &Sides[i];
+        s->count -= n;
+        memmove(s->outs, s->outs + n, s->count * sizeof(Output));
+        memmove(s->data, s->data + n * RegionBytes, s->count * RegionBytes);
+    }
+}
+
+static void *worker(void *arg)
+{
+    Side *s = arg;
+    u64 end = 0;
+    for (;;) {
+        end += Sync;
+        run_until(s, end);
+        if (pthread_barrier_wait(&Barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            compare();
+        }
+        pthread_barrier_wait(&Barrier);
+        if (Finished) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void read_input(int inf)
+{
+    u8 *buf = NULL;
+    int size = 0;
+    for (;;) {
+        if (InputLen >= size) {
+            size = size > 0 ? 2 * size : 4096;
+            buf = realloc(buf, size);
+            if (buf == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        int n = read(inf, buf + InputLen, size - InputLen);
+        if (n < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) {
+            break;
+        }
+        InputLen += n;
+    }
+    Input = buf;
+}
+
+int compare_run(const char *image1, const char *image2, int inf, const Region *regions, int regioncount,
+                u64 sync, u64 limit, int engine)
+{
+    if (engine != CPU_ENGINE_INTERP && !jit_available()) {
+        fprintf(stderr, "JIT engine not available on this platform\n");
+        exit(1);
+    }
+    Regions = regions;
+    RegionCount = regioncount;
+    int i;
+    for (i = 0; i < regioncount; i++) {
+        if (regions[i].addr + regions[i].len > DATA_SIZE_BYTES) {
+            fprintf(stderr, "Region past the end of data memory: %04x\n", regions[i].addr);
+            exit(1);
+        }
+        RegionBytes += regions[i].len;
+    }
+    Sync = sync;
+    Limit = limit;
+    read_input(inf);
+
+    u8 eeprom[512];
+    u32 eepromsize = load_file("emulino.eeprom", eeprom, sizeof(eeprom));
+    const char *images[2] = {image1, image2};
+    for (i = 0; i < 2; i++) {
+        Side *s = &Sides[i];
+        s->image = images[i];
+        s->end = -1;
+        Flash *flash = load_flash(images[i]);
+        s->cpu = cpu_new(flash);
+        flash_release(flash);
+        cpu_set_engine(s->cpu, engine);
+        cpu_load_eeprom(s->cpu, eeprom, eepromsize);
+        cpu_set_context(s->cpu, s);
+        cpu_usart_set_input(s->cpu, -1);
+        cpu_usart_stop_idle(s->cpu, true);
+        cpu_usart_callback(s->cpu, serial_out);
+        int pin;
+        for (pin = 0; pin < PIN_COUNT; pin++) {
+            cpu_pin_callback(s->cpu, pin, pin_out);
+        }
+    }
+
+    pthread_barrier_init(&Barrier, NULL, 2);
+    pthread_t tids[2];
+    for (i = 0; i < 2; i++) {
+        if (pthread_create(&tids[i], NULL, worker, &Sides[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&Barrier);
+
+    if (Result == 0) {
+        fprintf(stderr, "compare: same over %llu bytes and %llu pin changes\n", Bytes, PinChanges);
+        for (i = 0; i < 2; i++) {
+            Side *s = &Sides[i];
+            fprintf(stderr, "  %s: %s at cycle %llu\n", s->image, s->end >= 0 ? EndNames[s->end] : "running",
+                cpu_get_cycles(s->cpu));
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        cpu_free(Sides[i].cpu);
+        free(Sides[i].outs);
+        free(Sides[i].data);
+    }
+    free((u8 *)Input);
+    return Result;
+}
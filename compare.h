@@ -0,0 +1,37 @@
+/*
+ * Differential runs of two images for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COMPARE_H
+#define __COMPARE_H
+
+#include "util.h"
+
+#define MAX_REGIONS 16
+
+// data memory to compare at every output
+typedef struct {
+    u16 addr;
+    u16 len;
+} Region;
+
+int compare_run(const char *image1, const char *image2, int inf, const Region *regions, int regioncount,
+                u64 sync, u64 limit, int engine);
+
+#endif // __COMPARE_H
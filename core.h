@@ -0,0 +1,272 @@
+/*
+ * CPU core internals shared by the emulino execution engines
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CORE_H
+#define __CORE_H
+
+#include "cpu.h"
+#include "eeprom.h"
+#include "port.h"
+#include "usart.h"
+
+// instruction classes from instructions.h
+#define CLASS_ALU   0   // touches only registers, SREG and flash
+#define CLASS_MEM   1   // reads or writes data memory or I/O
+#define CLASS_FLOW  2   // may transfer control somewhere other than the next instruction
+#define CLASS_SYS   3   // everything else
+
+// superinstructions, numbered from InstructionCount in Op.id
+#define FUSE_LDI_LDI        0
+#define FUSE_SUBI_SBCI      1
+#define FUSE_ADD_ADC        2   // Op.b is the number of ADCs
+#define FUSE_CP_CPC_BRNE    3   // Op.b is the number of CPCs
+#define FUSE_PUSH_PUSH      4   // Op.b is the number of further PUSHes
+#define FUSE_POP_POP        5   // Op.b is the number of further POPs
+#define FUSE_DELAY_SBIW     6   // busy-wait loops that are skipped over
+#define FUSE_DELAY_SUBI     7
+#define FUSE_DELAY_DEC      8
+#define FUSION_COUNT        9
+
+typedef struct Op Op;
+typedef void (*Handler)(Cpu *cpu, const Op *op);
+typedef void (*Decoder)(u16 instr, u16 next, Op *op);
+
+// A predecoded instruction. Operand fields are extracted once when the
+// flash is loaded so that handlers never have to pick apart the opcode.
+struct Op {
+    Handler handler;
+    u8 d;       // destination register
+    u8 r;       // source register
+    u8 b;       // bit number (also the SREG bit for BCLR/BSET/BRBC/BRBS)
+    u8 cycles;  // base cycle count, extra cycles are added by the handler
+    u8 length;  // instruction length in words
+    u8 id;      // index into Instructions[], or InstructionCount + FUSE_*
+    u16 k;      // immediate, displacement, I/O address or second word
+};
+
+// kinds of flag computation pending in Lazy
+#define LAZY_NONE   0   // Data.SREG is up to date
+#define LAZY_ADD    1   // ADD, ADC: H S V N Z C
+#define LAZY_SUB    2   // SUB, SUBI, CP, CPI: H S V N Z C
+#define LAZY_SUBC   3   // SBC, SBCI, CPC: as LAZY_SUB but Z can only be cleared
+#define LAZY_LOGIC  4   // AND, ANDI, OR, ORI, EOR: S V N Z
+
+typedef struct {
+    u8 kind;
+    u8 d;       // first operand
+    u8 r;       // second operand
+    u8 x;       // result
+} LazyFlags;
+
+typedef struct {
+    const char *name;
+    Handler handler;
+    Decoder decode;
+    u8 cycles;
+    u8 class;
+    const char *encoding;
+} Instruction;
+
+typedef struct {
+    union {
+        struct {
+            // 0x00 - 0x1f
+            union {
+                u8 Reg[32];
+                struct {
+                    u8 dummy1[24];
+                    union {
+                        u16 RegW[4];
+                        struct {
+                            u16 r24;
+                            u16 X;
+                            u16 Y;
+                            u16 Z;
+                        };
+                    };
+                };
+            };
+            u8 dummy2[0x5d-0x20]; // 0x20 - 0x5c
+            u16 SP __attribute__((packed)); // 0x5d - 0x5e
+            // 0x5f
+            union {
+                struct {
+                    char C: 1;
+                    char Z: 1;
+                    char N: 1;
+                    char V: 1;
+                    char S: 1;
+                    char H: 1;
+                    char T: 1;
+                    char I: 1;
+                };
+                u8 bits;
+            } SREG;
+        };
+        u8 _Bytes[DATA_SIZE_BYTES];
+        //u16 _Words[DATA_SIZE_BYTES/2];
+    };
+} TData;
+
+// Straight-line run of ops starting at some pc: only the last one may
+// branch, skip or stop the cpu, so the static cycle cost of the whole run
+// can be added when it is entered.
+typedef struct {
+    u16 cycles;
+    u16 count;
+} Block;
+
+#define MAX_BLOCK_COUNT 64
+
+// Access[] bits for data addresses that must take the slow path through
+// cpu.c: hooked I/O locations, SREG and addresses past the end of data
+// memory, and the WATCH_* bits from cpu.h. Everything else is plain memory
+// in Cpu.data.
+#define IO_READ     BIT(0)
+#define IO_WRITE    BIT(1)
+#define SLOW_READ   (IO_READ|WATCH_READ)
+#define SLOW_WRITE  (IO_WRITE|WATCH_WRITE)
+
+#define MAX_EVENTS  16
+#define NEVER       (~(u64)0)   // Cpu.nextevent with no events
+
+// the two decodings of a flash image in Flash.decoded[]
+#define DECODE_PLAIN    0   // one Op per instruction, for the JIT
+#define DECODE_FUSED    1   // with superinstructions, for the interpreters
+
+typedef struct {
+    u64 when;
+    EventFunction f;
+} Event;
+
+// A flash image and everything derived from it. Built once by
+// flash_load() and never written again, so any number of boards on any
+// number of threads can share it. flash_save() writes it out as it sits
+// in memory for flash_map() to share between processes; the fields past
+// hash are the only ones written after that.
+struct Flash {
+    u16 program[PROGRAM_SIZE_WORDS];
+    Op decoded[2][PROGRAM_SIZE_WORDS];      // by DECODE_*
+    Block blocks[2][PROGRAM_SIZE_WORDS];    // for decoded[] with no watchpoints set
+    u32 fusionsites[FUSION_COUNT];
+    u64 hash;                               // of program[]
+    void *image;                            // mapping from flash_map(), or NULL
+    int refs;
+};
+
+// Data memory written since the last cpu_snapshot() or cpu_restore(), in
+// pages of 1 << DIRTY_SHIFT bytes, so that a restore only has to copy
+// those back. Registers and I/O (below DIRTY_BASE) are always copied.
+#define DIRTY_SHIFT     6
+#define DIRTY_BASE      0x100
+#define DIRTY_EEPROM    (1ULL << 63)
+COMPILE_ASSERT((DATA_SIZE_BYTES >> DIRTY_SHIFT) < 63);
+
+// Everything that belongs to one board. Data comes first so that JIT code
+// can reach registers and SREG at small offsets from the context pointer,
+// followed by what the dispatch loops touch on every instruction. Boards
+// are allocated on cache line boundaries and padded to a whole number of
+// lines, so boards on different threads never share a line.
+struct Cpu {
+    TData data;
+    u16 pc;
+    int state;
+    int resume;                 // state to carry on in after CPU_STOP
+    u64 cycle;
+    u64 nextevent;
+    LazyFlags lazy;
+    u64 dirty;                  // DIRTY_* pages written since snapshot was taken or restored
+    u32 snapshot;               // Snapshot.serial, or 0
+    const Op *decoded;          // one of flash->decoded[]
+    const Block *blocks;        // flash->blocks[] or a private copy while watching
+    const u8 *access;           // Access or a private copy while watching
+    Flash *flash;
+    int engine;
+
+    Event events[MAX_EVENTS];
+    int eventcount;
+    u32 pendingirq;             // by vector number
+    u32 fusionexecuted[FUSION_COUNT];
+    u64 skippedcycles;
+    u64 sleepcycles;
+
+    int breakpoint;             // word address for cpu_break(), or -1
+    char fault[40];             // why the state is CPU_FAULT
+    u8 *coverage;               // cpu_coverage() map, or NULL
+    u16 prevloc;                // hash of the last block entered, for coverage
+    int watchcount;
+    u8 *watchaccess;
+    Block *watchblocks;
+    WatchHit watchhit;
+    WatchFunction watchcallback;
+    PinFunction pincallback[PIN_COUNT];
+    void *context;              // cpu_set_context(), for the callbacks
+
+    PortState port;
+    EepromState eeprom;
+    UsartState usart;
+
+    struct Jit *jit;            // allocated by the first jit_run()
+} __attribute__((aligned(64)));
+
+// Machine state saved by cpu_snapshot(): everything a board carries from
+// one cycle to the next, but not its host-side setup (engine, callbacks,
+// watchpoints, file descriptors) or input queued by cpu_usart_receive(),
+// which cpu_restore() drops.
+struct Snapshot {
+    u32 serial;                 // unique to this snapshot
+    const Flash *flash;
+    TData data;
+    u16 pc;
+    int state;
+    u64 cycle;
+    LazyFlags lazy;
+    Event events[MAX_EVENTS];
+    int eventcount;
+    u32 pendingirq;
+    u64 skippedcycles;
+    u64 sleepcycles;
+    PortState port;
+    EepromState eeprom;
+    u8 ucsra;
+    u8 ucsrb;
+};
+
+extern const Instruction Instructions[];
+extern const int InstructionCount;
+
+int event_id(EventFunction f);
+EventFunction event_function(int id);
+
+void cpu_step(Cpu *cpu);
+bool cpu_poll(Cpu *cpu);
+void cpu_block_refund(Cpu *cpu, int remaining);
+void sreg_sync(Cpu *cpu);
+
+int threaded_run(Cpu *cpu);
+
+void jit_init();
+void lockstep_init();
+bool jit_available();
+void jit_flush(Cpu *cpu);
+void jit_free(Cpu *cpu);
+int jit_run(Cpu *cpu, bool diff);
+
+#endif // __CORE_H
@@ -22,12 +22,15 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "util.h"
 
+#include "core.h"
 #include "eeprom.h"
 #include "port.h"
 #include "timer.h"
@@ -35,88 +38,147 @@
 
 //#define TRACE
 
-typedef void (*Handler)(u16 instr);
-
 #define MAX_POLL_FUNCTIONS  16
-#define MAX_IRQ             27
+#define MAX_EVENT_FUNCTIONS 16
+
+#define IMAGE_MAGIC         "emuflash"
+#define IMAGE_VERSION       1
+#define IMAGE_HEADER_SIZE   4096    // so the Flash in an image is page aligned
 
 typedef struct {
-    union {
-        struct {
-            // 0x00 - 0x1f
-            union {
-                u8 Reg[32];
-                struct {
-                    u8 dummy1[24];
-                    union {
-                        u16 RegW[4];
-                        struct {
-                            u16 r24;
-                            u16 X;
-                            u16 Y;
-                            u16 Z;
-                        };
-                    };
-                };
-            };
-            u8 dummy2[0x5d-0x20]; // 0x20 - 0x5c
-            u16 SP __attribute__((packed)); // 0x5d - 0x5e
-            // 0x5f
-            union {
-                struct {
-                    char C: 1;
-                    char Z: 1;
-                    char N: 1;
-                    char V: 1;
-                    char S: 1;
-                    char H: 1;
-                    char T: 1;
-                    char I: 1;
-                };
-                u8 bits;
-            } SREG;
-        };
-        u8 _Bytes[DATA_SIZE_BYTES];
-        //u16 _Words[DATA_SIZE_BYTES/2];
-    };
-} TData;
-
-static u8 ioread(u16 addr);
-static void iowrite(u16 addr, u8 value);
-
-u16 Program[PROGRAM_SIZE_WORDS];
-TData Data;
-ReadFunction IORead[0x100];
-WriteFunction IOWrite[0x100];
-PollFunction PollFunctions[MAX_POLL_FUNCTIONS];
-int PollFunctionCount;
-int PendingIRQ[MAX_IRQ];
-int PendingIRQCount;
-int State;
-u16 PC;
-u32 Cycle;
-u32 LastPoll;
-PinFunction PinCallback[PIN_COUNT];
-
-COMPILE_ASSERT(sizeof(Data.SREG) == 1);
-COMPILE_ASSERT(((u8 *)&Data.SP) - Data._Bytes == 0x5d);
-COMPILE_ASSERT(((u8 *)&Data.SREG) - Data._Bytes == 0x5f);
-
-static u8 read(u16 addr)
-{
-    if ((addr & 0xff00) == 0) {
-        return ioread(addr);
+    char magic[8];
+    u64 version;
+    u64 size;                       // sizeof(Flash)
+    u64 layout;                     // handler_layout()
+    u64 anchor;                     // address of cpu_step() where it was written
+} ImageHeader;
+
+#define MAX_IRQ             27
+#define POLL_CYCLES         10000   // between calls to the registered poll functions
+#define SRAM_START          0x100   // the stack below this is over the I/O registers
+
+#define SMCR                0x53
+#define SMCR_SE             BIT(0)
+
+// interrupts (by vector number) that can wake the core in each sleep mode
+#define WAKE_EXT    (BIT(2)|BIT(3)|BIT(4)|BIT(5)|BIT(6)|BIT(7)|BIT(25)) // INT0/1, PCINT0-2, WDT, TWI
+#define WAKE_TIMER2 (BIT(8)|BIT(9)|BIT(10))
+static const u32 WakeSources[8] = {
+    ~0,                                         // idle
+    WAKE_EXT|WAKE_TIMER2|BIT(22)|BIT(23)|BIT(26), // ADC noise reduction
+    WAKE_EXT,                                   // power-down
+    WAKE_EXT|WAKE_TIMER2,                       // power-save
+    WAKE_EXT,                                   // reserved
+    WAKE_EXT,                                   // reserved
+    WAKE_EXT,                                   // standby
+    WAKE_EXT|WAKE_TIMER2,                       // extended standby
+};
+
+static u8 slow_read(Cpu *cpu, u16 addr);
+static void slow_write(Cpu *cpu, u16 addr, u8 value);
+
+// Tables common to every board, filled in by cpu_init() and read-only
+// after that. Peripherals hook the same I/O locations on all boards and
+// keep their state in the Cpu.
+static ReadFunction IORead[0x100];
+static WriteFunction IOWrite[0x100];
+static u8 Access[0x10000];
+static PollFunction PollFunctions[MAX_POLL_FUNCTIONS];
+static int PollFunctionCount;
+static EventFunction EventFunctions[MAX_EVENT_FUNCTIONS];
+static int EventFunctionCount;
+
+COMPILE_ASSERT(sizeof(((TData *)0)->SREG) == 1);
+COMPILE_ASSERT(offsetof(TData, SP) == 0x5d);
+COMPILE_ASSERT(offsetof(TData, SREG) == 0x5f);
+COMPILE_ASSERT(offsetof(Cpu, data) == 0);
+COMPILE_ASSERT(MAX_IRQ <= 32);
+
+static inline u8 read(Cpu *cpu, u16 addr)
+{
+    if (cpu->access[addr] & SLOW_READ) {
+        return slow_read(cpu, addr);
     } else {
-        return Data._Bytes[addr];
+        return cpu->data._Bytes[addr];
     }
 }
 
-static void write(u16 addr, u8 value)
+static inline void write(Cpu *cpu, u16 addr, u8 value)
 {
-    if ((addr & 0xff00) == 0) {
-        iowrite(addr, value);
+    if (cpu->access[addr] & SLOW_WRITE) {
+        slow_write(cpu, addr, value);
     } else {
-        Data._Bytes[addr] = value;
+        cpu->data._Bytes[addr] = value;
+        cpu->dirty |= 1ULL << (addr >> DIRTY_SHIFT);
+    }
+}
+
+// Lazily evaluated flags. The common arithmetic and logic instructions
+// only record their operands and result in Cpu.lazy; the SREG bits they
+// own are worked out by sreg_sync() when something actually looks at them.
+// Handlers that read flags or set only some of them sync first.
+
+static inline void lazy(Cpu *cpu, u8 kind, u8 d, u8 r, u8 x)
+{
+    cpu->lazy.kind = kind;
+    cpu->lazy.d = d;
+    cpu->lazy.r = r;
+    cpu->lazy.x = x;
+}
+
+void sreg_sync(Cpu *cpu)
+{
+    u8 d = cpu->lazy.d;
+    u8 r = cpu->lazy.r;
+    u8 x = cpu->lazy.x;
+    switch (cpu->lazy.kind) {
+    case LAZY_NONE:
+        return;
+    case LAZY_ADD:
+        cpu->data.SREG.H = (((d & r) | (r & ~x) | (~x & d)) & 0x08) != 0;
+        cpu->data.SREG.V = (((d & r & ~x) | (~d & ~r & x)) & 0x80) != 0;
+        cpu->data.SREG.N = (x & 0x80) != 0;
+        cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+        cpu->data.SREG.Z = x == 0;
+        cpu->data.SREG.C = (((d & r) | (r & ~x) | (~x & d)) & 0x80) != 0;
+        break;
+    case LAZY_SUB:
+    case LAZY_SUBC:
+        cpu->data.SREG.H = (((~d & r) | (r & x) | (x & ~d)) & 0x08) != 0;
+        cpu->data.SREG.V = (((d & ~r & ~x) | (~d & r & x)) & 0x80) != 0;
+        cpu->data.SREG.N = (x & 0x80) != 0;
+        cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+        if (cpu->lazy.kind == LAZY_SUB) {
+            cpu->data.SREG.Z = x == 0;
+        } else {
+            cpu->data.SREG.Z &= x == 0;
+        }
+        cpu->data.SREG.C = (((~d & r) | (r & x) | (x & ~d)) & 0x80) != 0;
+        break;
+    case LAZY_LOGIC:
+        cpu->data.SREG.S = (x & 0x80) != 0;
+        cpu->data.SREG.V = 0;
+        cpu->data.SREG.N = (x & 0x80) != 0;
+        cpu->data.SREG.Z = x == 0;
+        break;
+    }
+    cpu->lazy.kind = LAZY_NONE;
+}
+
+// the carry flag alone, for ADC following ADD
+static inline u8 carry(Cpu *cpu)
+{
+    u8 d = cpu->lazy.d;
+    u8 r = cpu->lazy.r;
+    u8 x = cpu->lazy.x;
+    switch (cpu->lazy.kind) {
+    case LAZY_ADD:
+        return (((d & r) | (r & ~x) | (~x & d)) & 0x80) != 0;
+    case LAZY_SUB:
+    case LAZY_SUBC:
+        return (((~d & r) | (r & x) | (x & ~d)) & 0x80) != 0;
+    default:
+        return cpu->data.SREG.C ? 1 : 0;
     }
 }
 
@@ -135,1069 +197,1301 @@ static void trace(const char *s)
     #endif
 }
 
-static void unimplemented(const char *s)
+static void fault(Cpu *cpu, const char *s)
 {
-    fprintf(stderr, "unimplemented: %s\n", s);
-    exit(1);
+    snprintf(cpu->fault, sizeof(cpu->fault), "%s", s);
+    cpu->state = CPU_FAULT;
 }
 
-static void do_ADC(u16 instr)
+static void unimplemented(Cpu *cpu, const char *s)
+{
+    snprintf(cpu->fault, sizeof(cpu->fault), "unimplemented: %s", s);
+    cpu->state = CPU_FAULT;
+}
+
+static void decode_none(u16 instr, u16 next, Op *op)
+{
+}
+
+static void decode_rd(u16 instr, u16 next, Op *op)
 {
-    trace(__FUNCTION__);
     // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] + Data.Reg[r] + (Data.SREG.C ? 1 : 0);
-    Data.SREG.H = (((Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & ~x) | (~x & Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & Data.Reg[r] & ~x) | (~Data.Reg[d] & ~Data.Reg[r] & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = (((Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & ~x) | (~x & Data.Reg[d])) & 0x80) != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    op->r = (instr & 0xf) | ((instr >> 5) & 0x10);
+    op->d = ((instr >> 4) & 0x1f);
+}
+
+static void decode_rdw(u16 instr, u16 next, Op *op)
+{
+    // --------ddddrrrr
+    op->d = ((instr >> 4) & 0xf) * 2;
+    op->r = (instr & 0xf) * 2;
+}
+
+static void decode_rdh(u16 instr, u16 next, Op *op)
+{
+    // --------ddddrrrr
+    op->d = 16 + ((instr >> 4) & 0xf);
+    op->r = 16 + (instr & 0xf);
+}
+
+static void decode_rdh3(u16 instr, u16 next, Op *op)
+{
+    // ---------ddd-rrr
+    op->d = 16 + ((instr >> 4) & 0x7);
+    op->r = 16 + (instr & 0x7);
+}
+
+static void decode_d(u16 instr, u16 next, Op *op)
+{
+    // -------ddddd----
+    op->d = ((instr >> 4) & 0x1f);
+}
+
+static void decode_r(u16 instr, u16 next, Op *op)
+{
+    // -------rrrrr----
+    op->r = ((instr >> 4) & 0x1f);
+}
+
+static void decode_Kd(u16 instr, u16 next, Op *op)
+{
+    // ----KKKKddddKKKK
+    op->k = (instr & 0xf) | ((instr >> 4) & 0xf0);
+    op->d = 16 + ((instr >> 4) & 0xf);
+}
+
+static void decode_Kw(u16 instr, u16 next, Op *op)
+{
+    // --------KKddKKKK
+    op->k = (instr & 0xf) | ((instr >> 2) & 0x30);
+    op->d = ((instr >> 4) & 0x3);
+}
+
+static void decode_s(u16 instr, u16 next, Op *op)
+{
+    // ---------sss----
+    op->b = ((instr >> 4) & 0x7);
+}
+
+static void decode_db(u16 instr, u16 next, Op *op)
+{
+    // -------ddddd-bbb
+    op->d = ((instr >> 4) & 0x1f);
+    op->b = (instr & 0x7);
+}
+
+static void decode_rb(u16 instr, u16 next, Op *op)
+{
+    // -------rrrrr-bbb
+    op->r = ((instr >> 4) & 0x1f);
+    op->b = (instr & 0x7);
+}
+
+static void decode_ks(u16 instr, u16 next, Op *op)
+{
+    // ------kkkkkkksss
+    u16 k = ((instr >> 3) & 0x7f);
+    op->k = (s8)(k << 1) >> 1;
+    op->b = (instr & 0x7);
 }
 
-static void do_ADD(u16 instr)
+static void decode_k12(u16 instr, u16 next, Op *op)
+{
+    // ----kkkkkkkkkkkk
+    u16 k = (instr & 0xfff);
+    op->k = (s16)(k << 4) >> 4;
+}
+
+static void decode_k22(u16 instr, u16 next, Op *op)
+{
+    // -------kkkkk---k kkkkkkkkkkkkkkkk
+    u16 k = (instr & 0x1) | ((instr >> 3) & 0x3e);
+    op->k = k << 16 | next;
+}
+
+static void decode_dk16(u16 instr, u16 next, Op *op)
+{
+    // -------ddddd---- kkkkkkkkkkkkkkkk
+    op->d = ((instr >> 4) & 0x1f);
+    op->k = next;
+}
+
+static void decode_Ab(u16 instr, u16 next, Op *op)
+{
+    // --------AAAAAbbb
+    op->k = 0x20 + ((instr >> 3) & 0x1f);
+    op->b = (instr & 0x7);
+}
+
+static void decode_Ad(u16 instr, u16 next, Op *op)
+{
+    // -----AAdddddAAAA
+    op->k = 0x20 + ((instr & 0xf) | ((instr >> 5) & 0x30));
+    op->d = ((instr >> 4) & 0x1f);
+}
+
+static void decode_Ar(u16 instr, u16 next, Op *op)
+{
+    // -----AArrrrrAAAA
+    op->k = 0x20 + ((instr & 0xf) | ((instr >> 5) & 0x30));
+    op->r = ((instr >> 4) & 0x1f);
+}
+
+static void decode_qd(u16 instr, u16 next, Op *op)
+{
+    // --q-qq-ddddd-qqq
+    op->k = (instr & 0x7) | ((instr >> 7) & 0x18) | ((instr >> 8) & 0x20);
+    op->d = ((instr >> 4) & 0x1f);
+}
+
+static void decode_qr(u16 instr, u16 next, Op *op)
+{
+    // --q-qq-rrrrr-qqq
+    op->k = (instr & 0x7) | ((instr >> 7) & 0x18) | ((instr >> 8) & 0x20);
+    op->r = ((instr >> 4) & 0x1f);
+}
+
+static inline void do_ADC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] + Data.Reg[r];
-    Data.SREG.H = (((Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & ~x) | (~x & Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & Data.Reg[r] & ~x) | (~Data.Reg[d] & ~Data.Reg[r] & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = (((Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & ~x) | (~x & Data.Reg[d])) & 0x80) != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    u8 x = cpu->data.Reg[op->d] + cpu->data.Reg[op->r] + carry(cpu);
+    lazy(cpu, LAZY_ADD, cpu->data.Reg[op->d], cpu->data.Reg[op->r], x);
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_ADIW(u16 instr)
+static inline void do_ADD(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------KKddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 2) & 0x30);
-    u16 d = ((instr >> 4) & 0x3);
-    u16 x = Data.RegW[d] + K;
-    Data.SREG.V = ((~Data.RegW[d] & x) & 0x8000) != 0;
-    Data.SREG.N = (x & 0x8000) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = ((~x & Data.RegW[d]) & 0x8000) != 0;
-    Data.RegW[d] = x;
-    Cycle += 2;
+    u8 x = cpu->data.Reg[op->d] + cpu->data.Reg[op->r];
+    lazy(cpu, LAZY_ADD, cpu->data.Reg[op->d], cpu->data.Reg[op->r], x);
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_AND(u16 instr)
+static void do_ADIW(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] &= Data.Reg[r];
-    Data.SREG.V = 0;
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Cycle++;
+    sreg_sync(cpu);
+    u16 x = cpu->data.RegW[op->d] + op->k;
+    cpu->data.SREG.V = ((~cpu->data.RegW[op->d] & x) & 0x8000) != 0;
+    cpu->data.SREG.N = (x & 0x8000) != 0;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = x == 0;
+    cpu->data.SREG.C = ((~x & cpu->data.RegW[op->d]) & 0x8000) != 0;
+    cpu->data.RegW[op->d] = x;
 }
 
-static void do_ANDI(u16 instr)
+static void do_AND(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----KKKKddddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 4) & 0xf0);
-    u16 d = 16 + ((instr >> 4) & 0xf);
-    u8 x = Data.Reg[d] &= K;
-    Data.SREG.S = (x & 0x80) != 0;
-    Data.SREG.V = 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.Z = x == 0;
-    Cycle++;
+    if (cpu->lazy.kind != LAZY_LOGIC) {
+        sreg_sync(cpu);
+    }
+    u8 x = cpu->data.Reg[op->d] = cpu->data.Reg[op->d] & cpu->data.Reg[op->r];
+    lazy(cpu, LAZY_LOGIC, 0, 0, x);
 }
 
-static void do_ASR(u16 instr)
+static void do_ANDI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.SREG.C = Data.Reg[d] & 0x01;
-    Data.Reg[d] = (s8)Data.Reg[d] >> 1;
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.V = Data.SREG.N ^ Data.SREG.C;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Cycle++;
+    if (cpu->lazy.kind != LAZY_LOGIC) {
+        sreg_sync(cpu);
+    }
+    u8 x = cpu->data.Reg[op->d] = cpu->data.Reg[op->d] & op->k;
+    lazy(cpu, LAZY_LOGIC, 0, 0, x);
 }
 
-static void do_BCLR(u16 instr)
+static void do_ASR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ---------sss----
-    u16 s = ((instr >> 4) & 0x7);
-    Data.SREG.bits &= ~(1 << s);
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.SREG.C = cpu->data.Reg[op->d] & 0x01;
+    cpu->data.Reg[op->d] = (s8)cpu->data.Reg[op->d] >> 1;
+    cpu->data.SREG.N = (cpu->data.Reg[op->d] & 0x80) != 0;
+    cpu->data.SREG.V = cpu->data.SREG.N ^ cpu->data.SREG.C;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = cpu->data.Reg[op->d] == 0;
 }
 
-static void do_BLD(u16 instr)
+static void do_BCLR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd-bbb
-    u16 d = ((instr >> 4) & 0x1f);
-    u16 b = (instr & 0x7);
-    Data.Reg[d] = (Data.Reg[d] & ~(1 << b)) | ((Data.SREG.T ? 1 : 0) << b);
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.SREG.bits &= ~(1 << op->b);
 }
 
-static void do_BRBC(u16 instr)
+static void do_BLD(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------kkkkkkksss
-    u16 k = ((instr >> 3) & 0x7f);
-    u16 s = (instr & 0x7);
-    if ((Data.SREG.bits & (1 << s)) == 0) {
-        PC += (s8)(k << 1) >> 1;
-        Cycle++;
+    cpu->data.Reg[op->d] = (cpu->data.Reg[op->d] & ~(1 << op->b)) | ((cpu->data.SREG.T ? 1 : 0) << op->b);
+}
+
+static inline void do_BRBC(Cpu *cpu, const Op *op)
+{
+    trace(__FUNCTION__);
+    sreg_sync(cpu);
+    if ((cpu->data.SREG.bits & (1 << op->b)) == 0) {
+        cpu->pc += op->k;
+        cpu->cycle++;
     }
-    Cycle++;
 }
 
-static void do_BRBS(u16 instr)
+static void do_BRBS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------kkkkkkksss
-    u16 k = ((instr >> 3) & 0x7f);
-    u16 s = (instr & 0x7);
-    if (Data.SREG.bits & (1 << s)) {
-        PC += (s8)(k << 1) >> 1;
-        Cycle++;
+    sreg_sync(cpu);
+    if (cpu->data.SREG.bits & (1 << op->b)) {
+        cpu->pc += op->k;
+        cpu->cycle++;
     }
-    Cycle++;
 }
 
-static void do_BREAK(u16 instr)
+static void do_BREAK(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
-    Cycle++;
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_BSET(u16 instr)
+static void do_BSET(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ---------sss----
-    u16 s = ((instr >> 4) & 0x7);
-    Data.SREG.bits |= 1 << s;
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.SREG.bits |= 1 << op->b;
 }
 
-static void do_BST(u16 instr)
+static void do_BST(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd-bbb
-    u16 d = ((instr >> 4) & 0x1f);
-    u16 b = (instr & 0x7);
-    Data.SREG.T = ((Data.Reg[d] & (1 << b)) != 0);
-    Cycle++;
+    cpu->data.SREG.T = ((cpu->data.Reg[op->d] & (1 << op->b)) != 0);
 }
 
-static void do_CALL(u16 instr)
+static void do_CALL(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------kkkkk---k
-    u16 k = (instr & 0x1) | ((instr >> 3) & 0x3e);
-    k = k << 16 | Program[PC++];
-    write(Data.SP--, PC >> 8);
-    write(Data.SP--, PC & 0xff);
-    PC = k;
-    Cycle += 4;
+    write(cpu, cpu->data.SP--, cpu->pc >> 8);
+    write(cpu, cpu->data.SP--, cpu->pc & 0xff);
+    cpu->pc = op->k;
 }
 
-static void do_CBI(u16 instr)
+static void do_CBI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------AAAAAbbb
-    u16 A = ((instr >> 3) & 0x1f);
-    u16 b = (instr & 0x7);
-    write(0x20+A, read(0x20+A) & ~(1 << b));
-    Cycle += 2;
+    write(cpu, op->k, read(cpu, op->k) & ~(1 << op->b));
 }
 
-static void do_COM(u16 instr)
+static void do_COM(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = ~Data.Reg[d];
-    Data.SREG.V = 0;
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Data.SREG.C = 1;
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.Reg[op->d] = ~cpu->data.Reg[op->d];
+    cpu->data.SREG.V = 0;
+    cpu->data.SREG.N = (cpu->data.Reg[op->d] & 0x80) != 0;
+    cpu->data.SREG.S = cpu->data.SREG.N;
+    cpu->data.SREG.Z = cpu->data.Reg[op->d] == 0;
+    cpu->data.SREG.C = 1;
 }
 
-static void do_CP(u16 instr)
+static inline void do_CP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] - Data.Reg[r];
-    Data.SREG.H = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~Data.Reg[r] & ~x) | (~Data.Reg[d] & Data.Reg[r] & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Cycle++;
+    u8 x = cpu->data.Reg[op->d] - cpu->data.Reg[op->r];
+    lazy(cpu, LAZY_SUB, cpu->data.Reg[op->d], cpu->data.Reg[op->r], x);
 }
 
-static void do_CPC(u16 instr)
+static inline void do_CPC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] - Data.Reg[r] - (Data.SREG.C ? 1 : 0);
-    Data.SREG.H = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~Data.Reg[r] & ~x) | (~Data.Reg[d] & Data.Reg[r] & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z &= x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Cycle++;
+    sreg_sync(cpu);
+    u8 x = cpu->data.Reg[op->d] - cpu->data.Reg[op->r] - (cpu->data.SREG.C ? 1 : 0);
+    lazy(cpu, LAZY_SUBC, cpu->data.Reg[op->d], cpu->data.Reg[op->r], x);
 }
 
-static void do_CPI(u16 instr)
+static void do_CPI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----KKKKddddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 4) & 0xf0);
-    u16 d = 16 + ((instr >> 4) & 0xf);
-    u8 x = Data.Reg[d] - K;
-    Data.SREG.H = (((~Data.Reg[d] & K) | (K & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~K & ~x) | (~Data.Reg[d] & K & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & K) | (K & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Cycle++;
+    u8 x = cpu->data.Reg[op->d] - op->k;
+    lazy(cpu, LAZY_SUB, cpu->data.Reg[op->d], op->k, x);
 }
 
-static void do_CPSE(u16 instr)
+static void do_CPSE(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    if (Data.Reg[d] == Data.Reg[r]) {
-        if (doubleWordInstruction(Program[PC])) {
-            PC++;
-            Cycle++;
-        }
-        PC++;
-        Cycle++;
+    if (cpu->data.Reg[op->d] == cpu->data.Reg[op->r]) {
+        u8 n = cpu->decoded[cpu->pc].length;
+        cpu->pc += n;
+        cpu->cycle += n;
     }
-    Cycle++;
 }
 
-static void do_DEC(u16 instr)
+static void do_DEC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d]--;
-    Data.SREG.V = Data.Reg[d] == 0x7f;
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.Reg[op->d]--;
+    cpu->data.SREG.V = cpu->data.Reg[op->d] == 0x7f;
+    cpu->data.SREG.N = (cpu->data.Reg[op->d] & 0x80) != 0;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = cpu->data.Reg[op->d] == 0;
 }
 
-static void do_DES(u16 instr)
+static void do_DES(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_EICALL(u16 instr)
+static void do_EICALL(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_EIJMP(u16 instr)
+static void do_EIJMP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_ELPM_1(u16 instr)
+static void do_ELPM_1(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    Data.Reg[0] = ((u8 *)Program)[Data.Z];
-    Cycle += 3;
+    cpu->data.Reg[0] = ((const u8 *)cpu->flash->program)[cpu->data.Z];
 }
 
-static void do_ELPM_2(u16 instr)
+static void do_ELPM_2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_ELPM_3(u16 instr)
+static void do_ELPM_3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_EOR(u16 instr)
+static void do_EOR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] ^= Data.Reg[r];
-    Data.SREG.S = (x & 0x80) != 0;
-    Data.SREG.V = 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.Z = x == 0;
-    Cycle++;
+    if (cpu->lazy.kind != LAZY_LOGIC) {
+        sreg_sync(cpu);
+    }
+    u8 x = cpu->data.Reg[op->d] = cpu->data.Reg[op->d] ^ cpu->data.Reg[op->r];
+    lazy(cpu, LAZY_LOGIC, 0, 0, x);
 }
 
-static void do_FMUL(u16 instr)
+static void do_FMUL(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_FMULS(u16 instr)
+static void do_FMULS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_FMULSU(u16 instr)
+static void do_FMULSU(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
 }
 
-static void do_ICALL(u16 instr)
+static void do_ICALL(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    write(Data.SP--, PC >> 8);
-    write(Data.SP--, PC & 0xff);
-    PC = Data.Z;
-    Cycle += 3;
+    write(cpu, cpu->data.SP--, cpu->pc >> 8);
+    write(cpu, cpu->data.SP--, cpu->pc & 0xff);
+    cpu->pc = cpu->data.Z;
 }
 
-static void do_IJMP(u16 instr)
+static void do_IJMP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    PC = Data.Z;
-    Cycle += 2;
+    cpu->pc = cpu->data.Z;
 }
 
-static void do_IN(u16 instr)
+static void do_IN(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -----AAdddddAAAA
-    u16 A = (instr & 0xf) | ((instr >> 5) & 0x30);
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(0x20 + A);
-    Cycle++;
+    cpu->data.Reg[op->d] = read(cpu, op->k);
 }
 
-static void do_INC(u16 instr)
+static void do_INC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d]++;
-    Data.SREG.V = Data.Reg[d] == 0x80;
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.Reg[op->d]++;
+    cpu->data.SREG.V = cpu->data.Reg[op->d] == 0x80;
+    cpu->data.SREG.N = (cpu->data.Reg[op->d] & 0x80) != 0;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = cpu->data.Reg[op->d] == 0;
 }
 
-static void do_JMP(u16 instr)
+static void do_JMP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------kkkkk---k
-    u16 k = (instr & 0x1) | ((instr >> 3) & 0x3e);
-    k = k << 16 | Program[PC++];
-    PC = k;
-    Cycle += 3;
+    cpu->pc = op->k;
 }
 
-static void do_LD_X1(u16 instr)
+static void do_LD_X1(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Data.X);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, cpu->data.X);
 }
 
-static void do_LD_X2(u16 instr)
+static void do_LD_X2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Data.X++);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, cpu->data.X++);
 }
 
-static void do_LD_X3(u16 instr)
+static void do_LD_X3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(--Data.X);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, --cpu->data.X);
 }
 
-static void do_LD_Y2(u16 instr)
+static void do_LD_Y2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Data.Y++);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, cpu->data.Y++);
 }
 
-static void do_LD_Y3(u16 instr)
+static void do_LD_Y3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(--Data.Y);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, --cpu->data.Y);
 }
 
-static void do_LD_Y4(u16 instr)
+static void do_LD_Y4(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --q-qq-ddddd-qqq
-    u16 q = (instr & 0x7) | ((instr >> 7) & 0x18) | ((instr >> 8) & 0x20);
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Data.Y+q);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, cpu->data.Y+op->k);
 }
 
-static void do_LD_Z2(u16 instr)
+static void do_LD_Z2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Data.Z++);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, cpu->data.Z++);
 }
 
-static void do_LD_Z3(u16 instr)
+static void do_LD_Z3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(--Data.Z);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, --cpu->data.Z);
 }
 
-static void do_LD_Z4(u16 instr)
+static void do_LD_Z4(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --q-qq-ddddd-qqq
-    u16 q = (instr & 0x7) | ((instr >> 7) & 0x18) | ((instr >> 8) & 0x20);
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Data.Z+q);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, cpu->data.Z+op->k);
 }
 
-static void do_LDI(u16 instr)
+static inline void do_LDI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----KKKKddddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 4) & 0xf0);
-    u16 d = 16 + ((instr >> 4) & 0xf);
-    Data.Reg[d] = K;
-    Cycle++;
+    cpu->data.Reg[op->d] = op->k;
 }
 
-static void do_LDS(u16 instr)
+static void do_LDS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(Program[PC++]);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, op->k);
 }
 
-static void do_LPM_1(u16 instr)
+static void do_LPM_1(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    Data.Reg[0] = ((u8 *)Program)[Data.Z];
-    Cycle += 3;
+    cpu->data.Reg[0] = ((const u8 *)cpu->flash->program)[cpu->data.Z];
 }
 
-static void do_LPM_2(u16 instr)
+static void do_LPM_2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = ((u8 *)Program)[Data.Z];
-    Cycle += 3;
+    cpu->data.Reg[op->d] = ((const u8 *)cpu->flash->program)[cpu->data.Z];
 }
 
-static void do_LPM_3(u16 instr)
+static void do_LPM_3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = ((u8 *)Program)[Data.Z++];
-    Cycle += 3;
+    cpu->data.Reg[op->d] = ((const u8 *)cpu->flash->program)[cpu->data.Z++];
 }
 
-static void do_LSR(u16 instr)
+static void do_LSR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.SREG.C = Data.Reg[d] & 0x01;
-    Data.Reg[d] >>= 1;
-    Data.SREG.N = 0;
-    Data.SREG.V = Data.SREG.N ^ Data.SREG.C;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Cycle++;
+    sreg_sync(cpu);
+    cpu->data.SREG.C = cpu->data.Reg[op->d] & 0x01;
+    cpu->data.Reg[op->d] >>= 1;
+    cpu->data.SREG.N = 0;
+    cpu->data.SREG.V = cpu->data.SREG.N ^ cpu->data.SREG.C;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = cpu->data.Reg[op->d] == 0;
 }
 
-static void do_MOV(u16 instr)
+static void do_MOV(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = Data.Reg[r];
-    Cycle++;
+    cpu->data.Reg[op->d] = cpu->data.Reg[op->r];
 }
 
-static void do_MOVW(u16 instr)
+static void do_MOVW(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------ddddrrrr
-    u16 d = ((instr >> 4) & 0xf);
-    u16 r = (instr & 0xf);
-    Data.Reg[d*2] = Data.Reg[r*2];
-    Data.Reg[d*2+1] = Data.Reg[r*2+1];
-    Cycle++;
+    cpu->data.Reg[op->d] = cpu->data.Reg[op->r];
+    cpu->data.Reg[op->d+1] = cpu->data.Reg[op->r+1];
 }
 
-static void do_MUL(u16 instr)
+static void do_MUL(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u16 x = Data.Reg[d] * Data.Reg[r];
-    Data.Reg[1] = x >> 8;
-    Data.Reg[0] = x & 0xff;
-    Data.SREG.C = (x & 0x8000) != 0;
-    Data.SREG.Z = x == 0;
-    Cycle += 2;
+    sreg_sync(cpu);
+    u16 x = cpu->data.Reg[op->d] * cpu->data.Reg[op->r];
+    cpu->data.Reg[1] = x >> 8;
+    cpu->data.Reg[0] = x & 0xff;
+    cpu->data.SREG.C = (x & 0x8000) != 0;
+    cpu->data.SREG.Z = x == 0;
 }
 
-static void do_MULS(u16 instr)
+static void do_MULS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------ddddrrrr
-    u16 d = ((instr >> 4) & 0xf);
-    u16 r = (instr & 0xf);
-    s16 x = (s8)Data.Reg[16+d] * (s8)Data.Reg[16+r];
-    Data.Reg[1] = x >> 8;
-    Data.Reg[0] = x & 0xff;
-    Data.SREG.C = (x & 0x8000) != 0;
-    Data.SREG.Z = x == 0;
-    Cycle += 2;
+    sreg_sync(cpu);
+    s16 x = (s8)cpu->data.Reg[op->d] * (s8)cpu->data.Reg[op->r];
+    cpu->data.Reg[1] = x >> 8;
+    cpu->data.Reg[0] = x & 0xff;
+    cpu->data.SREG.C = (x & 0x8000) != 0;
+    cpu->data.SREG.Z = x == 0;
 }
 
-static void do_MULSU(u16 instr)
+static void do_MULSU(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ---------ddd-rrr
-    u16 d = ((instr >> 4) & 0x7);
-    u16 r = (instr & 0x7);
-    s16 x = (s8)Data.Reg[16+d] * Data.Reg[16+r];
-    Data.Reg[1] = x >> 8;
-    Data.Reg[0] = x & 0xff;
-    Data.SREG.C = (x & 0x8000) != 0;
-    Data.SREG.Z = x == 0;
-    Cycle += 2;
+    sreg_sync(cpu);
+    s16 x = (s8)cpu->data.Reg[op->d] * cpu->data.Reg[op->r];
+    cpu->data.Reg[1] = x >> 8;
+    cpu->data.Reg[0] = x & 0xff;
+    cpu->data.SREG.C = (x & 0x8000) != 0;
+    cpu->data.SREG.Z = x == 0;
 }
 
-static void do_NEG(u16 instr)
+static void do_NEG(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = -Data.Reg[d];
-    Data.SREG.H = ((x | Data.Reg[d]) & 0x08) != 0;
-    Data.SREG.V = x == 0x80;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = x != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    sreg_sync(cpu);
+    u8 x = -cpu->data.Reg[op->d];
+    cpu->data.SREG.H = ((x | cpu->data.Reg[op->d]) & 0x08) != 0;
+    cpu->data.SREG.V = x == 0x80;
+    cpu->data.SREG.N = (x & 0x80) != 0;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = x == 0;
+    cpu->data.SREG.C = x != 0;
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_NOP(u16 instr)
+static void do_NOP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    Cycle++;
 }
 
-static void do_OR(u16 instr)
+static void do_OR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] |= Data.Reg[r];
-    Data.SREG.V = 0;
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Cycle++;
+    if (cpu->lazy.kind != LAZY_LOGIC) {
+        sreg_sync(cpu);
+    }
+    u8 x = cpu->data.Reg[op->d] = cpu->data.Reg[op->d] | cpu->data.Reg[op->r];
+    lazy(cpu, LAZY_LOGIC, 0, 0, x);
 }
 
-static void do_ORI(u16 instr)
+static void do_ORI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----KKKKddddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 4) & 0xf0);
-    u16 d = 16 + ((instr >> 4) & 0xf);
-    u8 x = Data.Reg[d] |= K;
-    Data.SREG.S = (x & 0x80) != 0;
-    Data.SREG.V = 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.Z = x == 0;
-    Cycle++;
+    if (cpu->lazy.kind != LAZY_LOGIC) {
+        sreg_sync(cpu);
+    }
+    u8 x = cpu->data.Reg[op->d] = cpu->data.Reg[op->d] | op->k;
+    lazy(cpu, LAZY_LOGIC, 0, 0, x);
 }
 
-static void do_OUT(u16 instr)
+static void do_OUT(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -----AArrrrrAAAA
-    u16 A = (instr & 0xf) | ((instr >> 5) & 0x30);
-    u16 r = ((instr >> 4) & 0x1f);
-    write(0x20 + A, Data.Reg[r]);
-    Cycle++;
+    write(cpu, op->k, cpu->data.Reg[op->r]);
 }
 
-static void do_POP(u16 instr)
+static inline void do_POP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = read(++Data.SP);
-    Cycle += 2;
+    cpu->data.Reg[op->d] = read(cpu, ++cpu->data.SP);
 }
 
-static void do_PUSH(u16 instr)
+static inline void do_PUSH(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.SP--, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.SP--, cpu->data.Reg[op->r]);
 }
 
-static void do_RCALL(u16 instr)
+static void do_RCALL(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----kkkkkkkkkkkk
-    u16 k = (instr & 0xfff);
-    write(Data.SP--, PC >> 8);
-    write(Data.SP--, PC & 0xff);
-    PC += (s16)(k << 4) >> 4;
-    Cycle += 3;
+    write(cpu, cpu->data.SP--, cpu->pc >> 8);
+    write(cpu, cpu->data.SP--, cpu->pc & 0xff);
+    cpu->pc += op->k;
 }
 
-static void do_RET(u16 instr)
+static void do_RET(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    PC = read(Data.SP+1) | (read(Data.SP+2) << 8);
-    Data.SP += 2;
-    Cycle += 4;
+    cpu->pc = read(cpu, cpu->data.SP+1) | (read(cpu, cpu->data.SP+2) << 8);
+    cpu->data.SP += 2;
 }
 
-static void do_RETI(u16 instr)
+static void do_RETI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    PC = read(Data.SP+1) | (read(Data.SP+2) << 8);
-    Data.SP += 2;
-    Data.SREG.I = 1;
-    Cycle += 4;
+    cpu->pc = read(cpu, cpu->data.SP+1) | (read(cpu, cpu->data.SP+2) << 8);
+    cpu->data.SP += 2;
+    cpu->data.SREG.I = 1;
 }
 
-static void do_RJMP(u16 instr)
+static void do_RJMP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----kkkkkkkkkkkk
-    u16 k = (instr & 0xfff);
-    PC += (s16)(k << 4) >> 4;
-    Cycle += 2;
+    cpu->pc += op->k;
 }
 
-static void do_ROR(u16 instr)
+static void do_ROR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    int c = Data.Reg[d] & 0x01;
-    Data.Reg[d] = (Data.Reg[d] >> 1) | (Data.SREG.C ? 0x80 : 0);
-    Data.SREG.N = (Data.Reg[d] & 0x80) != 0;
-    Data.SREG.V = Data.SREG.N ^ Data.SREG.C;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = Data.Reg[d] == 0;
-    Data.SREG.C = c;
-    Cycle++;
+    sreg_sync(cpu);
+    int c = cpu->data.Reg[op->d] & 0x01;
+    cpu->data.Reg[op->d] = (cpu->data.Reg[op->d] >> 1) | (cpu->data.SREG.C ? 0x80 : 0);
+    cpu->data.SREG.N = (cpu->data.Reg[op->d] & 0x80) != 0;
+    cpu->data.SREG.V = cpu->data.SREG.N ^ cpu->data.SREG.C;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = cpu->data.Reg[op->d] == 0;
+    cpu->data.SREG.C = c;
 }
 
-static void do_SBC(u16 instr)
+static void do_SBC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] - Data.Reg[r] - (Data.SREG.C ? 1 : 0);
-    Data.SREG.H = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~Data.Reg[r] & ~x) | (~Data.Reg[d] & Data.Reg[r] & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z &= x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    sreg_sync(cpu);
+    u8 x = cpu->data.Reg[op->d] - cpu->data.Reg[op->r] - (cpu->data.SREG.C ? 1 : 0);
+    lazy(cpu, LAZY_SUBC, cpu->data.Reg[op->d], cpu->data.Reg[op->r], x);
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_SBCI(u16 instr)
+static inline void do_SBCI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----KKKKddddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 4) & 0xf0);
-    u16 d = 16 + ((instr >> 4) & 0xf);
-    u8 x = Data.Reg[d] - K - (Data.SREG.C ? 1 : 0);
-    Data.SREG.H = (((~Data.Reg[d] & K) | (K & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~K & ~x) | (~Data.Reg[d] & K & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z &= x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & K) | (K & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    sreg_sync(cpu);
+    u8 x = cpu->data.Reg[op->d] - op->k - (cpu->data.SREG.C ? 1 : 0);
+    lazy(cpu, LAZY_SUBC, cpu->data.Reg[op->d], op->k, x);
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_SBI(u16 instr)
+static void do_SBI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------AAAAAbbb
-    u16 A = ((instr >> 3) & 0x1f);
-    u16 b = (instr & 0x7);
-    write(0x20+A, read(0x20+A) | (1 << b));
-    Cycle += 2;
+    write(cpu, op->k, read(cpu, op->k) | (1 << op->b));
 }
 
-static void do_SBIC(u16 instr)
+static void do_SBIC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------AAAAAbbb
-    u16 A = ((instr >> 3) & 0x1f);
-    u16 b = (instr & 0x7);
-    if ((read(0x20+A) & (1 << b)) == 0) {
-        if (doubleWordInstruction(Program[PC])) {
-            PC++;
-            Cycle++;
-        }
-        PC++;
-        Cycle++;
+    if ((read(cpu, op->k) & (1 << op->b)) == 0) {
+        u8 n = cpu->decoded[cpu->pc].length;
+        cpu->pc += n;
+        cpu->cycle += n;
     }
-    Cycle++;
 }
 
-static void do_SBIS(u16 instr)
+static void do_SBIS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------AAAAAbbb
-    u16 A = ((instr >> 3) & 0x1f);
-    u16 b = (instr & 0x7);
-    if ((read(0x20+A) & (1 << b)) != 0) {
-        if (doubleWordInstruction(Program[PC])) {
-            PC++;
-            Cycle++;
-        }
-        PC++;
-        Cycle++;
+    if ((read(cpu, op->k) & (1 << op->b)) != 0) {
+        u8 n = cpu->decoded[cpu->pc].length;
+        cpu->pc += n;
+        cpu->cycle += n;
     }
-    Cycle++;
 }
 
-static void do_SBIW(u16 instr)
+static void do_SBIW(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --------KKddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 2) & 0x30);
-    u16 d = ((instr >> 4) & 0x3);
-    u16 x = Data.RegW[d] - K;
-    Data.SREG.V = ((Data.RegW[d] & ~x) & 0x8000) != 0;
-    Data.SREG.N = (x & 0x8000) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = ((x & ~Data.RegW[d]) & 0x8000) != 0;
-    Data.RegW[d] = x;
-    Cycle += 2;
+    sreg_sync(cpu);
+    u16 x = cpu->data.RegW[op->d] - op->k;
+    cpu->data.SREG.V = ((cpu->data.RegW[op->d] & ~x) & 0x8000) != 0;
+    cpu->data.SREG.N = (x & 0x8000) != 0;
+    cpu->data.SREG.S = cpu->data.SREG.N ^ cpu->data.SREG.V;
+    cpu->data.SREG.Z = x == 0;
+    cpu->data.SREG.C = ((x & ~cpu->data.RegW[op->d]) & 0x8000) != 0;
+    cpu->data.RegW[op->d] = x;
 }
 
-static void do_SBRC(u16 instr)
+static void do_SBRC(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr-bbb
-    u16 r = ((instr >> 4) & 0x1f);
-    u16 b = (instr & 0x7);
-    if ((Data.Reg[r] & (1 << b)) == 0) {
-        if (doubleWordInstruction(Program[PC])) {
-            PC++;
-            Cycle++;
-        }
-        PC++;
-        Cycle++;
+    if ((cpu->data.Reg[op->r] & (1 << op->b)) == 0) {
+        u8 n = cpu->decoded[cpu->pc].length;
+        cpu->pc += n;
+        cpu->cycle += n;
     }
-    Cycle++;
 }
 
-static void do_SBRS(u16 instr)
+static void do_SBRS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr-bbb
-    u16 r = ((instr >> 4) & 0x1f);
-    u16 b = (instr & 0x7);
-    if (Data.Reg[r] & (1 << b)) {
-        if (doubleWordInstruction(Program[PC])) {
-            PC++;
-            Cycle++;
-        }
-        PC++;
-        Cycle++;
+    if (cpu->data.Reg[op->r] & (1 << op->b)) {
+        u8 n = cpu->decoded[cpu->pc].length;
+        cpu->pc += n;
+        cpu->cycle += n;
     }
-    Cycle++;
 }
 
-static void do_SLEEP(u16 instr)
+static void do_SLEEP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
-    Cycle++;
+    // cpu_run() takes over until an interrupt wakes the core
+    if (cpu->data._Bytes[SMCR] & SMCR_SE) {
+        cpu->state = CPU_SLEEP;
+    }
 }
 
-static void do_SPM2_1(u16 instr)
+static void do_SPM2_1(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
     // unknown cycles
 }
 
-static void do_SPM2_2(u16 instr)
+static void do_SPM2_2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
+    unimplemented(cpu, __FUNCTION__);
     // unknown cycles
 }
 
-static void do_ST_X1(u16 instr)
+static void do_ST_X1(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.X, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.X, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_X2(u16 instr)
+static void do_ST_X2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.X++, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.X++, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_X3(u16 instr)
+static void do_ST_X3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(--Data.X, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, --cpu->data.X, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_Y2(u16 instr)
+static void do_ST_Y2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.Y++, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.Y++, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_Y3(u16 instr)
+static void do_ST_Y3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(--Data.Y, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, --cpu->data.Y, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_Y4(u16 instr)
+static void do_ST_Y4(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --q-qq-rrrrr-qqq
-    u16 q = (instr & 0x7) | ((instr >> 7) & 0x18) | ((instr >> 8) & 0x20);
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.Y+q, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.Y+op->k, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_Z2(u16 instr)
+static void do_ST_Z2(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.Z++, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.Z++, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_Z3(u16 instr)
+static void do_ST_Z3(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------rrrrr----
-    u16 r = ((instr >> 4) & 0x1f);
-    write(--Data.Z, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, --cpu->data.Z, cpu->data.Reg[op->r]);
 }
 
-static void do_ST_Z4(u16 instr)
+static void do_ST_Z4(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // --q-qq-rrrrr-qqq
-    u16 q = (instr & 0x7) | ((instr >> 7) & 0x18) | ((instr >> 8) & 0x20);
-    u16 r = ((instr >> 4) & 0x1f);
-    write(Data.Z+q, Data.Reg[r]);
-    Cycle += 2;
+    write(cpu, cpu->data.Z+op->k, cpu->data.Reg[op->r]);
 }
 
-static void do_STS(u16 instr)
+static void do_STS(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    write(Program[PC++], Data.Reg[d]);
-    Cycle += 2;
+    write(cpu, op->k, cpu->data.Reg[op->d]);
 }
 
-static void do_SUB(u16 instr)
+static void do_SUB(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ------rdddddrrrr
-    u16 r = (instr & 0xf) | ((instr >> 5) & 0x10);
-    u16 d = ((instr >> 4) & 0x1f);
-    u8 x = Data.Reg[d] - Data.Reg[r];
-    Data.SREG.H = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~Data.Reg[r] & ~x) | (~Data.Reg[d] & Data.Reg[r] & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & Data.Reg[r]) | (Data.Reg[r] & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    u8 x = cpu->data.Reg[op->d] - cpu->data.Reg[op->r];
+    lazy(cpu, LAZY_SUB, cpu->data.Reg[op->d], cpu->data.Reg[op->r], x);
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_SUBI(u16 instr)
+static inline void do_SUBI(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // ----KKKKddddKKKK
-    u16 K = (instr & 0xf) | ((instr >> 4) & 0xf0);
-    u16 d = 16 + ((instr >> 4) & 0xf);
-    u8 x = Data.Reg[d] - K;
-    Data.SREG.H = (((~Data.Reg[d] & K) | (K & x) | (x & ~Data.Reg[d])) & 0x08) != 0;
-    Data.SREG.V = (((Data.Reg[d] & ~K & ~x) | (~Data.Reg[d] & K & x)) & 0x80) != 0;
-    Data.SREG.N = (x & 0x80) != 0;
-    Data.SREG.S = Data.SREG.N ^ Data.SREG.V;
-    Data.SREG.Z = x == 0;
-    Data.SREG.C = (((~Data.Reg[d] & K) | (K & x) | (x & ~Data.Reg[d])) & 0x80) != 0;
-    Data.Reg[d] = x;
-    Cycle++;
+    u8 x = cpu->data.Reg[op->d] - op->k;
+    lazy(cpu, LAZY_SUB, cpu->data.Reg[op->d], op->k, x);
+    cpu->data.Reg[op->d] = x;
 }
 
-static void do_SWAP(u16 instr)
+static void do_SWAP(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    // -------ddddd----
-    u16 d = ((instr >> 4) & 0x1f);
-    Data.Reg[d] = (Data.Reg[d] << 4) | (Data.Reg[d] >> 4);
-    Cycle++;
+    cpu->data.Reg[op->d] = (cpu->data.Reg[op->d] << 4) | (cpu->data.Reg[op->d] >> 4);
 }
 
-static void do_WDR(u16 instr)
+static void do_WDR(Cpu *cpu, const Op *op)
 {
     trace(__FUNCTION__);
-    unimplemented(__FUNCTION__);
-    Cycle++;
+    // the watchdog isn't modelled, so there is nothing to reset
 }
 
-static void do_halt(u16 instr)
+static void do_halt(Cpu *cpu, const Op *op)
 {
-    State = CPU_HALT;
+    cpu->state = CPU_HALT;
 }
 
-#include "avr.inc"
+#define INSTR(encoding, name, operands, cycles, class) \
+    {#name, do_##name, decode_##operands, cycles, CLASS_##class, encoding},
+const Instruction Instructions[] = {
+#include "instructions.h"
+};
+#undef INSTR
+const int InstructionCount = sizeof(Instructions) / sizeof(Instructions[0]);
 
-void irq(int n)
+// index into Instructions[] for every opcode, filled in by build_instr()
+static u8 Instr[0x10000];
+
+static void build_instr()
+{
+    int i;
+    u32 x;
+    memset(Instr, 0xff, sizeof(Instr));
+    for (i = 0; i < InstructionCount; i++) {
+        const char *p;
+        u16 match = 0, free = 0;
+        for (p = Instructions[i].encoding; *p != 0; p++) {
+            if (*p == ' ') {
+                continue;
+            }
+            match <<= 1;
+            free <<= 1;
+            if (*p == '1') {
+                match |= 1;
+            } else if (*p != '0') {
+                free |= 1;
+            }
+        }
+        // visit every opcode whose operand bits are a subset of free
+        x = 0;
+        do {
+            assert(Instr[match | x] == 0xff);
+            Instr[match | x] = i;
+            x = (x - free) & free;
+        } while (x != 0);
+    }
+    // undefined opcodes execute as BREAK
+    for (x = 0; x < 0x10000; x++) {
+        if (Instr[x] == 0xff) {
+            Instr[x] = Instr[0x9598];
+        }
+    }
+}
+
+static void decode(const u16 *program, u16 pc, Op *op)
 {
-    if (Data.SREG.I) {
+    u16 instr = program[pc];
+    const Instruction *in = &Instructions[Instr[instr]];
+    memset(op, 0, sizeof(Op));
+    op->handler = in->handler;
+    op->cycles = in->cycles;
+    op->id = Instr[instr];
+    op->length = doubleWordInstruction(instr) ? 2 : 1;
+    in->decode(instr, program[(u16)(pc+1)], op);
+
+    // AVR programs often end with a jump-to-self after calling main()
+    // so we make that particular opcode return a special result
+    // from cpu_run() instead of looping forever
+    if (instr == 0xcfff) {
+        op->handler = do_halt;
+        op->cycles = 0;
+    }
+}
+
+// Superinstructions for common avr-gcc sequences. A fused Op keeps the
+// operands, cycles and length of the first instruction, so jumps and skips
+// into or over the sequence still work; its handler then runs the rest of
+// the sequence from the following Op records, and stops wherever the
+// dispatch loop would have polled in between.
+
+#define FUSE_NEXT(n) \
+    if (cpu->cycle >= cpu->nextevent) return; \
+    n = &cpu->decoded[cpu->pc]; \
+    cpu->pc += n->length; \
+    cpu->cycle += n->cycles
+
+static void do_LDI_LDI(Cpu *cpu, const Op *op)
+{
+    const Op *n;
+    cpu->fusionexecuted[FUSE_LDI_LDI]++;
+    do_LDI(cpu, op);
+    FUSE_NEXT(n);
+    do_LDI(cpu, n);
+}
+
+static void do_SUBI_SBCI(Cpu *cpu, const Op *op)
+{
+    const Op *n;
+    cpu->fusionexecuted[FUSE_SUBI_SBCI]++;
+    do_SUBI(cpu, op);
+    FUSE_NEXT(n);
+    do_SBCI(cpu, n);
+}
+
+static void do_ADD_ADC(Cpu *cpu, const Op *op)
+{
+    const Op *n;
+    int i;
+    cpu->fusionexecuted[FUSE_ADD_ADC]++;
+    do_ADD(cpu, op);
+    for (i = 0; i < op->b; i++) {
+        FUSE_NEXT(n);
+        do_ADC(cpu, n);
+    }
+}
+
+static void do_CP_CPC_BRNE(Cpu *cpu, const Op *op)
+{
+    const Op *n;
+    int i;
+    cpu->fusionexecuted[FUSE_CP_CPC_BRNE]++;
+    do_CP(cpu, op);
+    for (i = 0; i < op->b; i++) {
+        FUSE_NEXT(n);
+        do_CPC(cpu, n);
+    }
+    FUSE_NEXT(n);
+    do_BRBC(cpu, n);
+}
+
+// stack accesses can reach I/O registers, so stop if one raised an
+// interrupt or hit a watchpoint
+static void do_PUSH_PUSH(Cpu *cpu, const Op *op)
+{
+    const Op *n;
+    int i;
+    cpu->fusionexecuted[FUSE_PUSH_PUSH]++;
+    u16 pc = cpu->pc;
+    do_PUSH(cpu, op);
+    for (i = 0; i < op->b; i++) {
+        if (cpu->pc != pc || cpu->state != CPU_RUN) return;
+        FUSE_NEXT(n);
+        pc = cpu->pc;
+        do_PUSH(cpu, n);
+    }
+}
+
+static void do_POP_POP(Cpu *cpu, const Op *op)
+{
+    const Op *n;
+    int i;
+    cpu->fusionexecuted[FUSE_POP_POP]++;
+    u16 pc = cpu->pc;
+    do_POP(cpu, op);
+    for (i = 0; i < op->b; i++) {
+        if (cpu->pc != pc || cpu->state != CPU_RUN) return;
+        FUSE_NEXT(n);
+        pc = cpu->pc;
+        do_POP(cpu, n);
+    }
+}
+
+#undef FUSE_NEXT
+
+// Busy-wait loops. A countdown loop that touches nothing but its counter
+// and SREG is run arithmetically, either to its exit or to the last
+// iteration that ends before the next poll, so that polls and interrupts
+// still land on the same cycle. The handler is entered for the first
+// instruction of the loop with its base cycles already charged.
+
+// Number of iterations out of n that can be skipped for a loop starting at
+// cycle start and taking per cycles per iteration (one less for the last).
+static u32 delay_iterations(Cpu *cpu, u64 start, u32 n, u32 per)
+{
+    u64 limit = cpu->nextevent - 1;
+    if (start + per*n - 1 <= limit) {
+        return n;
+    }
+    if (limit < start) {
+        return 0;
+    }
+    return (limit - start) / per;
+}
+
+// Finish skipping m of n iterations of the loop at head: either leave the
+// loop (the closing branch is at exit - 1) or go round again.
+static void delay_done(Cpu *cpu, u16 head, u16 exit, u64 start, u32 m, u32 n, u32 per)
+{
+    if (m == n) {
+        cpu->cycle = start + per*n - 1;
+        cpu->pc = exit;
+    } else {
+        cpu->cycle = start + per*m;
+        cpu->pc = head;
+    }
+    cpu->skippedcycles += cpu->cycle - start;
+}
+
+// SBIW Rw,1; BRNE .-4
+static void do_delay_SBIW(Cpu *cpu, const Op *op)
+{
+    u16 head = cpu->pc - op->length;
+    u64 start = cpu->cycle - op->cycles;
+    u16 v = cpu->data.RegW[op->d];
+    u32 n = v ? v : 0x10000;
+    u32 m = delay_iterations(cpu, start, n, 4);
+    cpu->fusionexecuted[FUSE_DELAY_SBIW]++;
+    if (m == 0) {
+        do_SBIW(cpu, op);
+        return;
+    }
+    cpu->data.RegW[op->d] = v - m + 1;
+    do_SBIW(cpu, op);
+    delay_done(cpu, head, head + 2, start, m, n, 4);
+}
+
+// SUBI Rl,1; SBCI Rh,0; BRNE .-6
+static void do_delay_SUBI(Cpu *cpu, const Op *op)
+{
+    const Op *sbci = &cpu->decoded[cpu->pc];
+    u16 head = cpu->pc - op->length;
+    u64 start = cpu->cycle - op->cycles;
+    u16 v = cpu->data.Reg[sbci->d] << 8 | cpu->data.Reg[op->d];
+    u32 n = v ? v : 0x10000;
+    u32 m = delay_iterations(cpu, start, n, 4);
+    cpu->fusionexecuted[FUSE_DELAY_SUBI]++;
+    if (m == 0) {
+        do_SUBI(cpu, op);
+        return;
+    }
+    v -= m - 1;
+    cpu->data.Reg[op->d] = v & 0xff;
+    cpu->data.Reg[sbci->d] = v >> 8;
+    do_SUBI(cpu, op);
+    do_SBCI(cpu, sbci);
+    delay_done(cpu, head, head + 3, start, m, n, 4);
+}
+
+// DEC Rd; BRNE .-4
+static void do_delay_DEC(Cpu *cpu, const Op *op)
+{
+    u16 head = cpu->pc - op->length;
+    u64 start = cpu->cycle - op->cycles;
+    u8 v = cpu->data.Reg[op->d];
+    u32 n = v ? v : 0x100;
+    u32 m = delay_iterations(cpu, start, n, 3);
+    cpu->fusionexecuted[FUSE_DELAY_DEC]++;
+    if (m == 0) {
+        do_DEC(cpu, op);
+        return;
+    }
+    cpu->data.Reg[op->d] = v - m + 1;
+    do_DEC(cpu, op);
+    delay_done(cpu, head, head + 2, start, m, n, 3);
+}
+
+static const struct {
+    const char *name;
+    Handler handler;
+} Fusions[FUSION_COUNT] = {
+    {"LDI/LDI",         do_LDI_LDI},
+    {"SUBI/SBCI",       do_SUBI_SBCI},
+    {"ADD/ADC",         do_ADD_ADC},
+    {"CP/CPC/BRNE",     do_CP_CPC_BRNE},
+    {"PUSH/PUSH",       do_PUSH_PUSH},
+    {"POP/POP",         do_POP_POP},
+    {"SBIW/BRNE loop",  do_delay_SBIW},
+    {"SUBI/SBCI loop",  do_delay_SUBI},
+    {"DEC/BRNE loop",   do_delay_DEC},
+};
+
+// number of consecutive one word instructions at pc handled by h
+static int run_length(const Op *decoded, u32 pc, Handler h, int max)
+{
+    int n = 0;
+    while (n < max && pc < PROGRAM_SIZE_WORDS && decoded[pc].handler == h) {
+        pc++;
+        n++;
+    }
+    return n;
+}
+
+static void fuse(Flash *flash)
+{
+    Op *decoded = flash->decoded[DECODE_FUSED];
+    u32 pc;
+    for (pc = 0; pc < PROGRAM_SIZE_WORDS; pc++) {
+        Op *op = &decoded[pc];
+        u32 next = pc + op->length;
+        int f = -1;
+        int n = 0;
+        // a BRNE back to pc closing a loop of length words
+        #define LOOP(length) (pc + (length) < PROGRAM_SIZE_WORDS \
+            && decoded[pc + (length) - 1].handler == do_BRBC \
+            && decoded[pc + (length) - 1].b == 1 \
+            && (u16)(decoded[pc + (length) - 1].k + (length)) == 0)
+        if (op->handler == do_SBIW && op->k == 1 && LOOP(2)) {
+            f = FUSE_DELAY_SBIW;
+        } else if (op->handler == do_SUBI && op->k == 1 && run_length(decoded, next, do_SBCI, 1)
+                && decoded[next].k == 0 && decoded[next].d != op->d && LOOP(3)) {
+            f = FUSE_DELAY_SUBI;
+        } else if (op->handler == do_DEC && LOOP(2)) {
+            f = FUSE_DELAY_DEC;
+        } else if (op->handler == do_LDI && run_length(decoded, next, do_LDI, 1)) {
+            f = FUSE_LDI_LDI;
+            n = 1;
+        } else if (op->handler == do_SUBI && run_length(decoded, next, do_SBCI, 1)) {
+            f = FUSE_SUBI_SBCI;
+            n = 1;
+        } else if (op->handler == do_ADD && (n = run_length(decoded, next, do_ADC, 7)) > 0) {
+            f = FUSE_ADD_ADC;
+        } else if (op->handler == do_CP) {
+            n = run_length(decoded, next, do_CPC, 7);
+            if (n > 0 && run_length(decoded, next + n, do_BRBC, 1) && decoded[next + n].b == 1) {
+                f = FUSE_CP_CPC_BRNE;
+            }
+        } else if (op->handler == do_PUSH && (n = run_length(decoded, next, do_PUSH, 31)) > 0) {
+            f = FUSE_PUSH_PUSH;
+        } else if (op->handler == do_POP && (n = run_length(decoded, next, do_POP, 31)) > 0) {
+            f = FUSE_POP_POP;
+        }
+        if (f >= 0) {
+            op->handler = Fusions[f].handler;
+            op->id = InstructionCount + f;
+            op->b = n;
+            flash->fusionsites[f]++;
+        }
+        #undef LOOP
+    }
+}
+
+// Setting I in SREG takes a pending interrupt there and then, leaving the
+// rest of the block unrun, so anything that can write SREG ends a block.
+// OUT and STS name their address; the stores through a pointer might.
+static bool may_write_sreg(const Op *op)
+{
+    if (op->handler == do_OUT || op->handler == do_STS) {
+        return op->k == 0x5f;
+    }
+    return op->handler == do_ST_X1 || op->handler == do_ST_X2 || op->handler == do_ST_X3
+        || op->handler == do_ST_Y2 || op->handler == do_ST_Y3 || op->handler == do_ST_Y4
+        || op->handler == do_ST_Z2 || op->handler == do_ST_Z3 || op->handler == do_ST_Z4;
+}
+
+static bool ends_block(const Op *op, bool watching)
+{
+    // superinstructions and the halt override count their own cycles
+    if (op->id >= InstructionCount || op->handler != Instructions[op->id].handler) {
+        return true;
+    }
+    switch (Instructions[op->id].class) {
+    case CLASS_ALU:
+        return false;
+    case CLASS_MEM:
+        // with watchpoints set, a hit must see the exact cycle and can stop
+        // the cpu, so every memory access ends its block
+        return watching || op->handler == do_SBIC || op->handler == do_SBIS || may_write_sreg(op);
+    default:
+        return true;
+    }
+}
+
+static void find_blocks(const Op *decoded, Block *blocks, bool watching)
+{
+    // work backwards so each block extends the one after it; long runs
+    // are cut every MAX_BLOCK_COUNT ops to keep the counts small
+    u32 pc = PROGRAM_SIZE_WORDS;
+    while (pc-- > 0) {
+        const Op *op = &decoded[pc];
+        u32 next = pc + op->length;
+        Block *b = &blocks[pc];
+        b->cycles = op->cycles;
+        b->count = 1;
+        if (!ends_block(op, watching) && next < PROGRAM_SIZE_WORDS && blocks[next].count < MAX_BLOCK_COUNT) {
+            b->cycles += blocks[next].cycles;
+            b->count += blocks[next].count;
+        }
+    }
+}
+
+void irq(Cpu *cpu, int n)
+{
+    sreg_sync(cpu);
+    // a board stopped by cpu_stop_at() while asleep is still asleep
+    int *state = cpu->state == CPU_STOP ? &cpu->resume : &cpu->state;
+    if (*state == CPU_SLEEP) {
+        // the peripheral is stopped in this sleep mode
+        if ((WakeSources[(cpu->data._Bytes[SMCR] >> 1) & 7] & BIT(n)) == 0) {
+            return;
+        }
+        if (cpu->data.SREG.I) {
+            *state = CPU_RUN;
+        }
+    }
+    if (cpu->data.SREG.I) {
         #ifdef TRACE
             if (n != 17) { // timer
                 fprintf(stderr, "irq: %d\n", n);
             }
         #endif
-        write(Data.SP--, PC >> 8);
-        write(Data.SP--, PC & 0xff);
-        PC = (n - 1) << 1;
-        Data.SREG.I = 0;
+        write(cpu, cpu->data.SP--, cpu->pc >> 8);
+        write(cpu, cpu->data.SP--, cpu->pc & 0xff);
+        cpu->pc = (n - 1) << 1;
+        cpu->data.SREG.I = 0;
     } else {
-        PendingIRQ[n] = 1;
-        PendingIRQCount++;
+        cpu->pendingirq |= BIT(n);
     }
 }
 
-static u8 ioread(u16 addr)
+static u8 ioread(Cpu *cpu, u16 addr)
 {
     //fprintf(stderr, "ioread %04x\n", addr);
+    if (addr >= DATA_SIZE_BYTES) {
+        // nothing there
+        return 0;
+    }
+    if (addr == 0x5f) {
+        sreg_sync(cpu);
+    }
     ReadFunction f = IORead[addr];
     if (f != NULL) {
-        return f(addr);
+        return f(cpu, addr);
     }
-    return Data._Bytes[addr];
+    return cpu->data._Bytes[addr];
 }
 
-static void iowrite(u16 addr, u8 value)
+static void iowrite(Cpu *cpu, u16 addr, u8 value)
 {
+    if (addr >= DATA_SIZE_BYTES) {
+        return;
+    }
     if (addr != 0x5f) {
         #ifdef TRACE
             fprintf(stderr, "iowrite %04x %02x\n", addr, value);
@@ -1205,25 +1499,70 @@ static void iowrite(u16 addr, u8 value)
     }
     WriteFunction f = IOWrite[addr];
     if (f != NULL) {
-        f(addr, value);
+        f(cpu, addr, value);
     }
-    Data._Bytes[addr] = value;
-    if (addr == 0x5f && PendingIRQCount > 0 && Data.SREG.I) {
-        int i;
-        for (i = 0; i < MAX_IRQ; i++) {
-            if (PendingIRQ[i]) {
-                #ifdef TRACE
-                    fprintf(stderr, "pending irq %d\n", i);
-                #endif
-                PendingIRQ[i] = 0;
-                PendingIRQCount--;
-                irq(i);
-                break;
-            }
-        }
+    if (addr == 0x5f) {
+        cpu->lazy.kind = LAZY_NONE;
+    }
+    cpu->data._Bytes[addr] = value;
+    if (addr == 0x5f && cpu->pendingirq != 0 && cpu->data.SREG.I) {
+        int i = __builtin_ctz(cpu->pendingirq);
+        #ifdef TRACE
+            fprintf(stderr, "pending irq %d\n", i);
+        #endif
+        cpu->pendingirq &= ~BIT(i);
+        irq(cpu, i);
+    }
+}
+
+static void watch_hit(Cpu *cpu, u16 addr, bool write, u8 old, u8 value)
+{
+    WatchHit *h = &cpu->watchhit;
+    // PC is already past the instruction, which is one word long unless
+    // it is one of the two word ones
+    u16 pc = cpu->pc;
+    h->pc = pc >= 2 && cpu->decoded[(u16)(pc-2)].length == 2 ? pc - 2 : pc - 1;
+    h->cycle = cpu->cycle;
+    h->addr = addr;
+    h->write = write;
+    h->old = old;
+    h->value = value;
+    if (cpu->watchcallback != NULL) {
+        cpu->watchcallback(cpu, h);
+    }
+    if (cpu->access[addr] & WATCH_STOP) {
+        cpu->state = CPU_WATCH;
     }
 }
 
+static u8 slow_read(Cpu *cpu, u16 addr)
+{
+    u8 value = cpu->access[addr] & IO_READ ? ioread(cpu, addr) : cpu->data._Bytes[addr];
+    if (cpu->access[addr] & WATCH_READ) {
+        watch_hit(cpu, addr, false, value, value);
+    }
+    return value;
+}
+
+static void slow_write(Cpu *cpu, u16 addr, u8 value)
+{
+    if ((cpu->access[addr] & WATCH_WRITE) == 0) {
+        iowrite(cpu, addr, value);
+        return;
+    }
+    if (addr == 0x5f) {
+        sreg_sync(cpu);
+    }
+    u8 old = addr < DATA_SIZE_BYTES ? cpu->data._Bytes[addr] : 0;
+    if (cpu->access[addr] & IO_WRITE) {
+        iowrite(cpu, addr, value);
+    } else {
+        cpu->data._Bytes[addr] = value;
+        cpu->dirty |= 1ULL << (addr >> DIRTY_SHIFT);
+    }
+    watch_hit(cpu, addr, true, old, value);
+}
+
 void register_io(u16 addr, ReadFunction rf, WriteFunction wf)
 {
     assert(IORead[addr] == NULL);
@@ -1231,115 +1570,804 @@ void register_io(u16 addr, ReadFunction rf, WriteFunction wf)
 
     assert(IOWrite[addr] == NULL);
     IOWrite[addr] = wf;
+
+    Access[addr] |= (rf != NULL ? IO_READ : 0) | (wf != NULL ? IO_WRITE : 0);
+}
+
+// The registered poll functions all run from one event every
+// POLL_CYCLES cycles, for peripherals with nothing to schedule.
+static void poll_event(Cpu *cpu, u64 when)
+{
+    int i;
+    for (i = 0; i < PollFunctionCount; i++) {
+        PollFunctions[i](cpu);
+    }
+    schedule_event(cpu, cpu->cycle + POLL_CYCLES + 1, poll_event);
 }
 
 void register_poll(PollFunction pf)
 {
+    assert(PollFunctionCount < MAX_POLL_FUNCTIONS);
     PollFunctions[PollFunctionCount++] = pf;
 }
 
-void out_pin(int pin, bool state)
+// Event functions are registered at init so a pending event can be
+// written to a state file as a number that means the same thing in
+// another process.
+void register_event(EventFunction f)
 {
-    if (PinCallback[pin] != NULL) {
-        PinCallback[pin](pin, state);
+    assert(EventFunctionCount < MAX_EVENT_FUNCTIONS);
+    EventFunctions[EventFunctionCount++] = f;
+}
+
+int event_id(EventFunction f)
+{
+    int i;
+    for (i = 0; i < EventFunctionCount; i++) {
+        if (EventFunctions[i] == f) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+EventFunction event_function(int id)
+{
+    if (id < 0 || id >= EventFunctionCount) {
+        return NULL;
+    }
+    return EventFunctions[id];
+}
+
+static void stop_event(Cpu *cpu, u64 when)
+{
+    // already stopped by something else on the same instruction, which
+    // knows what to carry on in
+    if (cpu->state != CPU_STOP) {
+        cpu->resume = cpu->state;
+        cpu->state = CPU_STOP;
+    }
+}
+
+// Events are kept sorted by cycle. There are only ever a few of them, one
+// per peripheral, and ones due on the same cycle run in the order they
+// were scheduled. Each is passed the cycle it was due on, which the
+// instruction that reached it can have gone past.
+void cancel_event(Cpu *cpu, EventFunction f)
+{
+    Event *events = cpu->events;
+    int i;
+    for (i = 0; i < cpu->eventcount; i++) {
+        if (events[i].f == f) {
+            cpu->eventcount--;
+            memmove(&events[i], &events[i+1], (cpu->eventcount - i) * sizeof(Event));
+            break;
+        }
+    }
+    cpu->nextevent = cpu->eventcount > 0 ? events[0].when : NEVER;
+}
+
+void schedule_event(Cpu *cpu, u64 when, EventFunction f)
+{
+    Event *events = cpu->events;
+    cancel_event(cpu, f);
+    assert(cpu->eventcount < MAX_EVENTS);
+    int i = cpu->eventcount++;
+    while (i > 0 && events[i-1].when > when) {
+        events[i] = events[i-1];
+        i--;
+    }
+    events[i].when = when;
+    events[i].f = f;
+    cpu->nextevent = events[0].when;
+}
+
+void out_pin(Cpu *cpu, int pin, bool state)
+{
+    // a board driving its pins isn't idle, whatever it polls
+    cpu->usart.idlepolls = 0;
+    if (cpu->pincallback[pin] != NULL) {
+        cpu->pincallback[pin](cpu, pin, state);
     }
 }
 
 void cpu_init()
 {
+    int i;
+    Access[0x5f] = IO_READ|IO_WRITE; // SREG
+    for (i = DATA_SIZE_BYTES; i < LENGTHOF(Access); i++) {
+        Access[i] = IO_READ|IO_WRITE;
+    }
+    #ifdef TRACE
+        // so that iowrite() can log them all
+        for (i = 0; i < 0x100; i++) {
+            Access[i] |= IO_WRITE;
+        }
+    #endif
+    register_event(poll_event);
+    register_event(stop_event);
     eeprom_init();
     port_init();
     timer_init();
     usart_init();
 
-    // AVR programs often end with a jump-to-self after calling main()
-    // so we make that particular opcode return a special result
-    // from cpu_run() instead of looping forever
-    Instr[0xcfff] = do_halt;
+    build_instr();
+    jit_init();
+    lockstep_init();
+    #ifdef THREADED
+        threaded_run(NULL);
+    #endif
+}
 
-    cpu_reset();
+Flash *flash_load(u8 *buf, u32 bufsize)
+{
+    Flash *flash = calloc(1, sizeof(Flash));
+    if (flash == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memcpy(flash->program, buf, bufsize);
+    // FNV-1a, so a state file can tell which program it belongs to
+    const u8 *p = (const u8 *)flash->program;
+    flash->hash = 0xcbf29ce484222325ULL;
+    u32 i;
+    for (i = 0; i < sizeof(flash->program); i++) {
+        flash->hash = (flash->hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    u32 pc;
+    for (pc = 0; pc < PROGRAM_SIZE_WORDS; pc++) {
+        decode(flash->program, pc, &flash->decoded[DECODE_PLAIN][pc]);
+    }
+    // the JIT does its own translation of whole blocks, so superinstructions
+    // are only for the interpreters
+    memcpy(flash->decoded[DECODE_FUSED], flash->decoded[DECODE_PLAIN], sizeof(flash->decoded[DECODE_FUSED]));
+    fuse(flash);
+    find_blocks(flash->decoded[DECODE_PLAIN], flash->blocks[DECODE_PLAIN], false);
+    find_blocks(flash->decoded[DECODE_FUSED], flash->blocks[DECODE_FUSED], false);
+    flash->refs = 1;
+    return flash;
+}
+
+void flash_release(Flash *flash)
+{
+    if (__sync_sub_and_fetch(&flash->refs, 1) == 0) {
+        if (flash->image != NULL) {
+            munmap(flash->image, IMAGE_HEADER_SIZE + sizeof(Flash));
+        } else {
+            free(flash);
+        }
+    }
 }
 
-void cpu_load_flash(u8 *buf, u32 bufsize)
+// Handler addresses relative to cpu_step(), which are the same in every
+// process running the same build wherever its code is loaded.
+static u64 handler_layout()
 {
-    memcpy(Program, buf, bufsize);
+    unsigned long anchor = (unsigned long)cpu_step;
+    u64 h = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < InstructionCount + FUSION_COUNT + 1; i++) {
+        Handler f = i < InstructionCount ? Instructions[i].handler
+                  : i < InstructionCount + FUSION_COUNT ? Fusions[i - InstructionCount].handler
+                  : do_halt;
+        h = (h ^ ((unsigned long)f - anchor)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Writes flash out as a prepared image: a header page and then the Flash
+// itself, ready for flash_map().
+void flash_save(const Flash *flash, const char *fn)
+{
+    static u8 page[IMAGE_HEADER_SIZE];
+    ImageHeader *header = (ImageHeader *)page;
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+    header->version = IMAGE_VERSION;
+    header->size = sizeof(Flash);
+    header->layout = handler_layout();
+    header->anchor = (unsigned long)cpu_step;
+    FILE *f = fopen(fn, "wb");
+    if (f == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    if (fwrite(page, sizeof(page), 1, f) != 1
+     || fwrite(flash, sizeof(Flash), 1, f) != 1
+     || fclose(f) != 0) {
+        perror(fn);
+        exit(1);
+    }
 }
 
-void cpu_load_eeprom(u8 *buf, u32 bufsize)
+// Maps a prepared image written by flash_save(), or returns NULL if fn is
+// not one. The mapping is private, but pages nothing writes stay shared
+// through the page cache with every other process mapping the same
+// file. If the code is loaded somewhere else than in the process that
+// wrote the image (a position-independent build), the handlers are
+// relocated, which costs the sharing but not correctness.
+Flash *flash_map(const char *fn)
 {
-    eeprom_load(buf, bufsize);
+    FILE *f = fopen(fn, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    ImageHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+     || memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    if (header.version != IMAGE_VERSION || header.size != sizeof(Flash) || header.layout != handler_layout()) {
+        fprintf(stderr, "emulino: %s: prepared by a different build of emulino\n", fn);
+        exit(1);
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || ftell(f) != IMAGE_HEADER_SIZE + sizeof(Flash)) {
+        fprintf(stderr, "emulino: %s: truncated prepared image\n", fn);
+        exit(1);
+    }
+    fprintf(stderr, "emulino: Mapping prepared image: %s\n", fn);
+    u8 *image = mmap(NULL, IMAGE_HEADER_SIZE + sizeof(Flash), PROT_READ|PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    if (image == MAP_FAILED) {
+        perror(fn);
+        exit(1);
+    }
+    fclose(f);
+    Flash *flash = (Flash *)(image + IMAGE_HEADER_SIZE);
+    unsigned long delta = (unsigned long)cpu_step - header.anchor;
+    if (delta != 0) {
+        int d;
+        u32 pc;
+        for (d = 0; d < 2; d++) {
+            for (pc = 0; pc < PROGRAM_SIZE_WORDS; pc++) {
+                Op *op = &flash->decoded[d][pc];
+                op->handler = (Handler)((unsigned long)op->handler + delta);
+            }
+        }
+    }
+    flash->image = image;
+    flash->refs = 1;
+    return flash;
 }
 
-void cpu_usart_set_output(int fd)
+Cpu *cpu_new(Flash *flash)
 {
-    usart_set_output(fd);
+    Cpu *cpu;
+    if (posix_memalign((void **)&cpu, 64, sizeof(Cpu)) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(cpu, 0, sizeof(Cpu));
+    __sync_add_and_fetch(&flash->refs, 1);
+    cpu->flash = flash;
+    cpu->engine = CPU_ENGINE_INTERP;
+    cpu->decoded = flash->decoded[DECODE_FUSED];
+    cpu->blocks = flash->blocks[DECODE_FUSED];
+    cpu->access = Access;
+    cpu->nextevent = NEVER;
+    cpu->breakpoint = -1;
+    timer_attach(cpu);
+    usart_attach(cpu);
+    if (PollFunctionCount > 0) {
+        schedule_event(cpu, POLL_CYCLES + 1, poll_event);
+    }
+    cpu_reset(cpu);
+    return cpu;
 }
 
-void cpu_usart_set_input(int fd)
+void cpu_free(Cpu *cpu)
 {
-    usart_set_input(fd);
+    jit_free(cpu);
+    usart_free(cpu);
+    flash_release(cpu->flash);
+    free(cpu->watchaccess);
+    free(cpu->watchblocks);
+    free(cpu);
 }
 
-void cpu_reset()
+void cpu_load_eeprom(Cpu *cpu, u8 *buf, u32 bufsize)
 {
-    PC = 0;
-    Cycle = 0;
-    Data.SP = DATA_SIZE_BYTES - 1;
-    LastPoll = 0;
-    State = CPU_RUN;
+    eeprom_load(cpu, buf, bufsize);
 }
 
-int cpu_run()
+void cpu_usart_set_output(Cpu *cpu, int fd)
 {
-    while (State == CPU_RUN) {
-        #ifdef TRACE
-            int i;
-            for (i = 0; i < 24; i++) {
-                fprintf(stderr, "%2d:%02x ", i, Data.Reg[i]);
-                if (i == 15) {
-                    fprintf(stderr, "\n");
-                }
+    usart_set_output(cpu, fd);
+}
+
+void cpu_usart_set_input(Cpu *cpu, int fd)
+{
+    usart_set_input(cpu, fd);
+}
+
+// Sends the board's USART output to f instead of the output fd.
+void cpu_usart_callback(Cpu *cpu, SerialFunction f)
+{
+    usart_set_callback(cpu, f);
+}
+
+// Writes output out at the end of every line as well as when cpu_run()
+// returns, for watching a board interactively.
+void cpu_usart_line_buffered(Cpu *cpu, bool line)
+{
+    usart_set_line_buffered(cpu, line);
+}
+
+// Queues bytes for the board's USART to receive, returning how many it
+// had room for.
+int cpu_usart_receive(Cpu *cpu, const u8 *buf, int len)
+{
+    return usart_receive(cpu, buf, len);
+}
+
+// How many bytes queued by cpu_usart_receive() the board hasn't read yet.
+int cpu_usart_pending(Cpu *cpu)
+{
+    return cpu->usart.rxcount;
+}
+
+// Makes cpu_run() return CPU_STOP when the board keeps polling the USART
+// for input and there is none.
+void cpu_usart_stop_idle(Cpu *cpu, bool stop)
+{
+    usart_stop_idle(cpu, stop);
+}
+
+void cpu_set_context(Cpu *cpu, void *context)
+{
+    cpu->context = context;
+}
+
+void *cpu_get_context(Cpu *cpu)
+{
+    return cpu->context;
+}
+
+void cpu_reset(Cpu *cpu)
+{
+    // pending events keep their distance from the current cycle
+    int i;
+    for (i = 0; i < cpu->eventcount; i++) {
+        Event *e = &cpu->events[i];
+        e->when = e->when > cpu->cycle ? e->when - cpu->cycle : 0;
+    }
+    cpu->nextevent = cpu->eventcount > 0 ? cpu->events[0].when : NEVER;
+    cpu->pc = 0;
+    cpu->cycle = 0;
+    cpu->data.SP = DATA_SIZE_BYTES - 1;
+    cpu->state = CPU_RUN;
+}
+
+Snapshot *cpu_snapshot(Cpu *cpu)
+{
+    static u32 serial;
+    Snapshot *snap = malloc(sizeof(Snapshot));
+    if (snap == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    snap->serial = __sync_add_and_fetch(&serial, 1);
+    snap->flash = cpu->flash;
+    snap->data = cpu->data;
+    snap->pc = cpu->pc;
+    snap->state = cpu->state == CPU_STOP ? cpu->resume : cpu->state;
+    snap->cycle = cpu->cycle;
+    snap->lazy = cpu->lazy;
+    memcpy(snap->events, cpu->events, sizeof(snap->events));
+    snap->eventcount = cpu->eventcount;
+    snap->pendingirq = cpu->pendingirq;
+    snap->skippedcycles = cpu->skippedcycles;
+    snap->sleepcycles = cpu->sleepcycles;
+    snap->port = cpu->port;
+    snap->eeprom = cpu->eeprom;
+    snap->ucsra = cpu->usart.ucsra;
+    snap->ucsrb = cpu->usart.ucsrb;
+    cpu->dirty = 0;
+    cpu->snapshot = snap->serial;
+    return snap;
+}
+
+// Puts the board back in the state it was in when snap was taken, which
+// can be on any board running the same flash. Restoring the snapshot the
+// board last took or restored only copies back the memory written since.
+// A snapshot with serial 0 is always copied in full.
+void cpu_restore(Cpu *cpu, const Snapshot *snap)
+{
+    assert(snap->flash == cpu->flash);
+    u64 dirty = snap->serial != 0 && cpu->snapshot == snap->serial ? cpu->dirty : ~0ULL;
+    memcpy(cpu->data._Bytes, snap->data._Bytes, DIRTY_BASE);
+    dirty &= ~((1ULL << (DIRTY_BASE >> DIRTY_SHIFT)) - 1);
+    while (dirty & ~DIRTY_EEPROM) {
+        u32 a = __builtin_ctzll(dirty) << DIRTY_SHIFT;
+        if (a < DATA_SIZE_BYTES) {
+            memcpy(&cpu->data._Bytes[a], &snap->data._Bytes[a], 1 << DIRTY_SHIFT);
+        }
+        dirty &= dirty - 1;
+    }
+    if (dirty & DIRTY_EEPROM) {
+        memcpy(cpu->eeprom.eeprom, snap->eeprom.eeprom, EEPROM_SIZE);
+    }
+    cpu->eeprom.eecr = snap->eeprom.eecr;
+    cpu->eeprom.eedr = snap->eeprom.eedr;
+    cpu->eeprom.eear = snap->eeprom.eear;
+    cpu->pc = snap->pc;
+    cpu->state = snap->state;
+    cpu->cycle = snap->cycle;
+    cpu->lazy = snap->lazy;
+    memcpy(cpu->events, snap->events, sizeof(cpu->events));
+    cpu->eventcount = snap->eventcount;
+    cpu->nextevent = cpu->eventcount > 0 ? cpu->events[0].when : NEVER;
+    cpu->pendingirq = snap->pendingirq;
+    cpu->skippedcycles = snap->skippedcycles;
+    cpu->sleepcycles = snap->sleepcycles;
+    cpu->port = snap->port;
+    cpu->usart.ucsra = snap->ucsra;
+    cpu->usart.ucsrb = snap->ucsrb;
+    cpu->usart.rxcount = 0;
+    cpu->usart.idlepolls = 0;
+    cpu->dirty = 0;
+    cpu->snapshot = snap->serial;
+}
+
+void snapshot_free(Snapshot *snap)
+{
+    free(snap);
+}
+
+void cpu_step(Cpu *cpu)
+{
+    #ifdef TRACE
+        sreg_sync(cpu);
+        int i;
+        for (i = 0; i < 24; i++) {
+            fprintf(stderr, "%2d:%02x ", i, cpu->data.Reg[i]);
+            if (i == 15) {
+                fprintf(stderr, "\n");
             }
-            for (i = 0; i < 4; i++) {
-                fprintf(stderr, "%d:%04x ", 24+i*2, Data.RegW[i]);
+        }
+        for (i = 0; i < 4; i++) {
+            fprintf(stderr, "%d:%04x ", 24+i*2, cpu->data.RegW[i]);
+        }
+        fprintf(stderr, "SP:%04x ", cpu->data.SP);
+        for (i = 7; i >= 0; i--) {
+            static const char flags[] = "cznvshti";
+            putc(cpu->data.SREG.bits & (1 << i) ? toupper(flags[i]) : flags[i], stderr);
+        }
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%04x %04x ", cpu->pc*2, cpu->flash->program[cpu->pc]);
+    #endif
+    const Op *op = &cpu->decoded[cpu->pc];
+    cpu->pc += op->length;
+    cpu->cycle += op->cycles;
+    op->handler(cpu, op);
+}
+
+// Enters the block at PC: its static cycle cost is added up front so
+// nothing is counted or checked per instruction, and taken branches and
+// skips add their extra cycles as they happen. Returns the number of ops
+// to run, which is just one if the block could reach the next event.
+static inline int cpu_block(Cpu *cpu)
+{
+    const Block *b = &cpu->blocks[cpu->pc];
+    if (cpu->cycle + b->cycles < cpu->nextevent) {
+        cpu->cycle += b->cycles;
+        return b->count;
+    }
+    cpu->cycle += cpu->decoded[cpu->pc].cycles;
+    return 1;
+}
+
+// Takes back what cpu_block() charged for the ops a handler left unrun by
+// stopping the cpu partway through a block, a fault or an idle stop say.
+// The rest of a block is the block at the op after the one that stopped.
+void cpu_block_refund(Cpu *cpu, int remaining)
+{
+    if (remaining > 0) {
+        cpu->cycle -= cpu->blocks[cpu->pc].cycles;
+    }
+}
+
+// The interpreter loop, counting every move from one block to another in
+// the coverage map as it goes. Branches, calls, returns and interrupts
+// all end blocks, so these are the edges of the program's control flow.
+// Edges are hashed from the two addresses as AFL does, and the map is
+// left for the caller to clear. A stack pointer outside data memory is a
+// fault, checked at every block.
+static void coverage_run(Cpu *cpu)
+{
+    u8 *map = cpu->coverage;
+    while (cpu->state == CPU_RUN) {
+        u16 loc = cpu->pc * 0x9e37;
+        map[loc ^ cpu->prevloc]++;
+        cpu->prevloc = loc >> 1;
+        if (cpu->data.SP < SRAM_START || cpu->data.SP >= DATA_SIZE_BYTES) {
+            fault(cpu, "stack pointer outside data memory");
+            break;
+        }
+        int remaining = cpu_block(cpu);
+        do {
+            const Op *op = &cpu->decoded[cpu->pc];
+            cpu->pc += op->length;
+            op->handler(cpu, op);
+        } while (--remaining > 0 && cpu->state == CPU_RUN);
+        cpu_block_refund(cpu, remaining);
+        if (cpu_poll(cpu)) {
+            break;
+        }
+    }
+}
+
+bool cpu_poll(Cpu *cpu)
+{
+    if (cpu->cycle < cpu->nextevent) {
+        return false;
+    }
+    while (cpu->eventcount > 0 && cpu->events[0].when <= cpu->cycle) {
+        EventFunction f = cpu->events[0].f;
+        u64 when = cpu->events[0].when;
+        cancel_event(cpu, f);
+        f(cpu, when);
+    }
+    return true;
+}
+
+// Picks the decoding and blocks for the engine, with private blocks that
+// end at every memory access while any watchpoints are set.
+static void select_decode(Cpu *cpu)
+{
+    int d = cpu->engine == CPU_ENGINE_INTERP && cpu->breakpoint < 0 ? DECODE_FUSED : DECODE_PLAIN;
+    cpu->decoded = cpu->flash->decoded[d];
+    if (cpu->watchcount > 0) {
+        if (cpu->watchblocks == NULL) {
+            cpu->watchblocks = malloc(PROGRAM_SIZE_WORDS * sizeof(Block));
+            if (cpu->watchblocks == NULL) {
+                perror("malloc");
+                exit(1);
             }
-            fprintf(stderr, "SP:%04x ", Data.SP);
-            for (i = 7; i >= 0; i--) {
-                static const char flags[] = "cznvshti";
-                putc(Data.SREG.bits & (1 << i) ? toupper(flags[i]) : flags[i], stderr);
+        }
+        find_blocks(cpu->decoded, cpu->watchblocks, true);
+        cpu->blocks = cpu->watchblocks;
+    } else {
+        free(cpu->watchblocks);
+        cpu->watchblocks = NULL;
+        cpu->blocks = cpu->flash->blocks[d];
+    }
+}
+
+int cpu_set_engine(Cpu *cpu, int engine)
+{
+    if (engine != CPU_ENGINE_INTERP && !jit_available()) {
+        return 0;
+    }
+    if (engine != cpu->engine) {
+        cpu->engine = engine;
+        select_decode(cpu);
+        jit_flush(cpu);
+    }
+    return 1;
+}
+
+int cpu_run(Cpu *cpu)
+{
+    if (cpu->state == CPU_WATCH) {
+        cpu->state = CPU_RUN;
+    } else if (cpu->state == CPU_STOP) {
+        cpu->state = cpu->resume;
+    }
+    if (cpu->state == CPU_SLEEP) {
+        // nothing happens until the next event, so skip straight to it
+        if (cpu->nextevent == NEVER) {
+            cpu->state = CPU_HALT;
+            return cpu->state;
+        }
+        cpu->sleepcycles += cpu->nextevent - cpu->cycle;
+        cpu->cycle = cpu->nextevent;
+        cpu_poll(cpu);
+        return cpu->state;
+    }
+    if (cpu->breakpoint >= 0) {
+        // single step the plain decoding so the breakpoint is seen
+        // exactly, letting a due interrupt go first
+        while (cpu->state == CPU_RUN) {
+            cpu_step(cpu);
+            bool polled = cpu_poll(cpu);
+            if (cpu->pc == cpu->breakpoint && cpu->state == CPU_RUN) {
+                cpu->resume = CPU_RUN;
+                cpu->state = CPU_STOP;
+                break;
             }
-            fprintf(stderr, "\n");
-            fprintf(stderr, "%04x %04x ", PC*2, Program[PC]);
-        #endif
-        u16 instr = Program[PC++];
-        Instr[instr](instr);
-        if (Cycle - LastPoll > 10000) {
-            LastPoll = Cycle;
-            int i;
-            for (i = 0; i < PollFunctionCount; i++) {
-                PollFunctions[i]();
+            if (polled) {
+                break;
             }
-            break;
+        }
+    } else if (cpu->coverage != NULL) {
+        coverage_run(cpu);
+    } else if (cpu->engine != CPU_ENGINE_INTERP) {
+        jit_run(cpu, cpu->engine == CPU_ENGINE_DIFF);
+    } else {
+        #if defined(TRACE)
+            while (cpu->state == CPU_RUN) {
+                cpu_step(cpu);
+                if (cpu_poll(cpu)) {
+                    break;
+                }
+            }
+        #elif defined(THREADED)
+            threaded_run(cpu);
+        #else
+            int remaining = cpu->state == CPU_RUN ? cpu_block(cpu) : 0;
+            while (cpu->state == CPU_RUN) {
+                const Op *op = &cpu->decoded[cpu->pc];
+                cpu->pc += op->length;
+                op->handler(cpu, op);
+                if (--remaining == 0) {
+                    if (cpu_poll(cpu) || cpu->state != CPU_RUN) {
+                        break;
+                    }
+                    remaining = cpu_block(cpu);
+                }
+            }
+            cpu_block_refund(cpu, remaining);
+        #endif
+    }
+    // leave SREG coherent for anyone looking at the CPU between runs
+    sreg_sync(cpu);
+    if (cpu->usart.txcount > 0) {
+        usart_flush(cpu);
+    }
+    return cpu->state;
+}
+
+// Makes cpu_run() return CPU_STOP once the cycle count reaches cycle.
+void cpu_stop_at(Cpu *cpu, u64 cycle)
+{
+    schedule_event(cpu, cycle, stop_event);
+}
+
+// Returns the cycle of the next event other than a cpu_stop_at() stop or
+// a poll, which is as far as a board that is asleep or polling for input
+// with no input file can be moved on without anything happening, or ~0 if
+// there isn't one.
+u64 cpu_next_event(Cpu *cpu)
+{
+    int i;
+    for (i = 0; i < cpu->eventcount; i++) {
+        if (cpu->events[i].f != stop_event && cpu->events[i].f != poll_event) {
+            return cpu->events[i].when;
         }
     }
-    return State;
+    return NEVER;
 }
 
-void cpu_set_pin(int pin, bool state)
+// Moves a board that cpu_usart_stop_idle() stopped on to cycle, or to its
+// next event if that's sooner, as if it had kept polling until then. The
+// cycles count as skipped.
+void cpu_idle_until(Cpu *cpu, u64 cycle)
+{
+    if (cycle > cpu->nextevent) {
+        cycle = cpu->nextevent;
+    }
+    if (cycle > cpu->cycle) {
+        cpu->skippedcycles += cycle - cpu->cycle;
+        cpu->cycle = cycle;
+    }
+}
+
+// Counts edges into map, of COVERAGE_SIZE bytes, while running the
+// interpreter, or stops if map is NULL.
+void cpu_coverage(Cpu *cpu, u8 *map)
+{
+    cpu->coverage = map;
+    cpu->prevloc = 0;
+}
+
+// Makes cpu_run() return CPU_STOP just before the instruction at word
+// address pc, or clears the breakpoint if pc is -1. The board single
+// steps while the breakpoint is set.
+void cpu_break(Cpu *cpu, int pc)
+{
+    assert(pc >= -1 && pc < PROGRAM_SIZE_WORDS);
+    cpu->breakpoint = pc;
+    select_decode(cpu);
+}
+
+void cpu_set_pin(Cpu *cpu, int pin, bool state)
 {
     assert(pin >= 0);
-    assert(pin < LENGTHOF(PinCallback));
-    port_pin(pin, state);
+    assert(pin < PIN_COUNT);
+    port_pin(cpu, pin, state);
 }
 
-void cpu_pin_callback(int pin, PinFunction f)
+void cpu_pin_callback(Cpu *cpu, int pin, PinFunction f)
 {
     assert(pin >= 0);
-    assert(pin < LENGTHOF(PinCallback));
-    PinCallback[pin] = f;
+    assert(pin < PIN_COUNT);
+    cpu->pincallback[pin] = f;
+}
+
+// Watches len bytes of data memory from addr for the accesses in flags,
+// or stops watching them if flags is 0. The board gets its own copy of
+// the access map while it has any watchpoints.
+void cpu_watch(Cpu *cpu, u16 addr, u16 len, int flags)
+{
+    int before = cpu->watchcount;
+    if (cpu->watchaccess == NULL) {
+        cpu->watchaccess = malloc(sizeof(Access));
+        if (cpu->watchaccess == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(cpu->watchaccess, Access, sizeof(Access));
+    }
+    u8 *access = cpu->watchaccess;
+    u32 a;
+    for (a = addr; a < (u32)addr + len && a < LENGTHOF(Access); a++) {
+        if (access[a] & (WATCH_READ|WATCH_WRITE)) {
+            cpu->watchcount--;
+        }
+        access[a] = (access[a] & (IO_READ|IO_WRITE)) | (flags & (WATCH_READ|WATCH_WRITE|WATCH_STOP));
+        if (access[a] & (WATCH_READ|WATCH_WRITE)) {
+            cpu->watchcount++;
+        }
+    }
+    if (cpu->watchcount > 0) {
+        cpu->access = access;
+    } else {
+        cpu->access = Access;
+        free(cpu->watchaccess);
+        cpu->watchaccess = NULL;
+    }
+    if ((before > 0) != (cpu->watchcount > 0)) {
+        select_decode(cpu);
+    }
+}
+
+void cpu_watch_callback(Cpu *cpu, WatchFunction f)
+{
+    cpu->watchcallback = f;
+}
+
+const WatchHit *cpu_get_watch_hit(Cpu *cpu)
+{
+    return &cpu->watchhit;
+}
+
+void cpu_fusion_report(Cpu *cpu)
+{
+    int i;
+    fprintf(stderr, "%-16s %8s %12s\n", "fusion", "sites", "executed");
+    for (i = 0; i < FUSION_COUNT; i++) {
+        fprintf(stderr, "%-16s %8lu %12lu\n", Fusions[i].name, cpu->flash->fusionsites[i], cpu->fusionexecuted[i]);
+    }
+}
+
+int cpu_get_state(Cpu *cpu)
+{
+    return cpu->state;
+}
+
+// Whether the board is asleep, including stopped by cpu_stop_at() while
+// asleep.
+bool cpu_is_asleep(Cpu *cpu)
+{
+    return cpu->state == CPU_SLEEP || (cpu->state == CPU_STOP && cpu->resume == CPU_SLEEP);
+}
+
+const char *cpu_get_fault(Cpu *cpu)
+{
+    return cpu->fault;
+}
+
+u64 cpu_get_cycles(Cpu *cpu)
+{
+    return cpu->cycle;
+}
+
+u64 cpu_get_skipped_cycles(Cpu *cpu)
+{
+    return cpu->skippedcycles;
 }
 
-u32 cpu_get_cycles()
+u64 cpu_get_sleep_cycles(Cpu *cpu)
 {
-    return Cycle;
+    return cpu->sleepcycles;
 }
@@ -18,6 +18,9 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __CPU_H
+#define __CPU_H
+
 #include "util.h"
 
 #define PROGRAM_SIZE_WORDS  0x10000
@@ -30,33 +33,111 @@
 
 #define CPU_RUN     0
 #define CPU_HALT    1
+#define CPU_SLEEP   2
+#define CPU_WATCH   3   // stopped at a watchpoint; cpu_run() carries on
+#define CPU_STOP    4   // stopped by cpu_stop_at() or cpu_break(); cpu_run() carries on
+#define CPU_FAULT   5   // crashed, for the reason cpu_get_fault() gives
+
+#define CPU_ENGINE_INTERP   0
+#define CPU_ENGINE_JIT      1
+#define CPU_ENGINE_DIFF     2   // run the JIT, checking every block against the interpreter
+
+#define LOCKSTEP_LANES      32  // most boards cpu_lockstep() runs together
+
+#define COVERAGE_SIZE       0x10000 // bytes in a cpu_coverage() map
+
+// cpu_watch() flags
+#define WATCH_READ  BIT(2)
+#define WATCH_WRITE BIT(3)
+#define WATCH_STOP  BIT(4)  // cpu_run() returns CPU_WATCH after the access
 
-typedef u8 (*ReadFunction)(u16 addr);
-typedef void (*WriteFunction)(u16 addr, u8 value);
-typedef void (*PollFunction)();
-typedef void (*PinFunction)(int pin, bool state);
+typedef struct {
+    u16 pc;         // word address of the instruction making the access
+    u64 cycle;
+    u16 addr;
+    bool write;
+    u8 old;
+    u8 value;       // value written, or value read
+} WatchHit;
+
+// A board: its registers, memory, peripherals and cycle counter. Boards
+// are independent of each other and can each be run on their own thread.
+typedef struct Cpu Cpu;
+
+// A loaded flash image and its decode tables, shared read-only between
+// all the boards running it.
+typedef struct Flash Flash;
+
+// The state of a board at some cycle, for cpu_restore() to go back to.
+typedef struct Snapshot Snapshot;
+
+typedef u8 (*ReadFunction)(Cpu *cpu, u16 addr);
+typedef void (*WriteFunction)(Cpu *cpu, u16 addr, u8 value);
+typedef void (*PollFunction)(Cpu *cpu);
+typedef void (*EventFunction)(Cpu *cpu, u64 when);
+typedef void (*PinFunction)(Cpu *cpu, int pin, bool state);
+typedef void (*WatchFunction)(Cpu *cpu, const WatchHit *hit);
+typedef void (*SerialFunction)(Cpu *cpu, u8 c);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void irq(int n);
+void irq(Cpu *cpu, int n);
 
 void register_io(u16 addr, ReadFunction rf, WriteFunction wf);
 void register_poll(PollFunction pf);
-void out_pin(int pin, bool state);
+void register_event(EventFunction f);
+void schedule_event(Cpu *cpu, u64 when, EventFunction f);
+void cancel_event(Cpu *cpu, EventFunction f);
+void out_pin(Cpu *cpu, int pin, bool state);
 
+// cpu_init() sets up the tables common to all boards, and must be called
+// once before anything else.
 void cpu_init();
-void cpu_load_flash(u8 *buf, u32 bufsize);
-void cpu_load_eeprom(u8 *buf, u32 bufsize);
-void cpu_usart_set_output(int fd);
-void cpu_usart_set_input(int fd);
-void cpu_reset();
-int cpu_run();
-void cpu_set_pin(int pin, bool state);
-void cpu_pin_callback(int pin, PinFunction f);
-u32 cpu_get_cycles();
+Flash *flash_load(u8 *buf, u32 bufsize);
+void flash_release(Flash *flash);
+void flash_save(const Flash *flash, const char *fn);
+Flash *flash_map(const char *fn);
+Cpu *cpu_new(Flash *flash);
+void cpu_free(Cpu *cpu);
+void cpu_load_eeprom(Cpu *cpu, u8 *buf, u32 bufsize);
+void cpu_usart_set_output(Cpu *cpu, int fd);
+void cpu_usart_set_input(Cpu *cpu, int fd);
+void cpu_usart_callback(Cpu *cpu, SerialFunction f);
+void cpu_usart_line_buffered(Cpu *cpu, bool line);
+int cpu_usart_receive(Cpu *cpu, const u8 *buf, int len);
+int cpu_usart_pending(Cpu *cpu);
+void cpu_usart_stop_idle(Cpu *cpu, bool stop);
+void cpu_set_context(Cpu *cpu, void *context);
+void *cpu_get_context(Cpu *cpu);
+void cpu_reset(Cpu *cpu);
+Snapshot *cpu_snapshot(Cpu *cpu);
+void cpu_restore(Cpu *cpu, const Snapshot *snap);
+void snapshot_free(Snapshot *snap);
+int cpu_set_engine(Cpu *cpu, int engine);
+int cpu_run(Cpu *cpu);
+void cpu_stop_at(Cpu *cpu, u64 cycle);
+u64 cpu_next_event(Cpu *cpu);
+void cpu_idle_until(Cpu *cpu, u64 cycle);
+void cpu_break(Cpu *cpu, int pc);
+void cpu_lockstep(Cpu **cpus, int count);
+void cpu_coverage(Cpu *cpu, u8 *map);
+void cpu_set_pin(Cpu *cpu, int pin, bool state);
+void cpu_pin_callback(Cpu *cpu, int pin, PinFunction f);
+void cpu_watch(Cpu *cpu, u16 addr, u16 len, int flags);
+void cpu_watch_callback(Cpu *cpu, WatchFunction f);
+const WatchHit *cpu_get_watch_hit(Cpu *cpu);
+void cpu_fusion_report(Cpu *cpu);
+int cpu_get_state(Cpu *cpu);
+bool cpu_is_asleep(Cpu *cpu);
+const char *cpu_get_fault(Cpu *cpu);
+u64 cpu_get_cycles(Cpu *cpu);
+u64 cpu_get_skipped_cycles(Cpu *cpu);
+u64 cpu_get_sleep_cycles(Cpu *cpu);
 
 #ifdef __cplusplus
 } // extern "C"
 #endif
+
+#endif // __CPU_H
@@ -22,9 +22,7 @@
 
 #include <string.h>
 
-#include "cpu.h"
-
-#define EEPROM_SIZE 1024
+#include "core.h"
 
 #define EEPROM_EECR     0x3f
 #define EEPROM_EEDR     0x40
@@ -38,54 +36,50 @@
 #define EEPROM_EECR_EEPM0   BIT(4)
 #define EEPROM_EECR_EEPM1   BIT(5)
 
-static u8 EEPROM[EEPROM_SIZE];
-static u8 EECR;
-static u8 EEDR;
-static u16 EEAR;
-
-u8 eeprom_read_eecr(u16 addr)
+u8 eeprom_read_eecr(Cpu *cpu, u16 addr)
 {
-    return EECR;
+    return cpu->eeprom.eecr;
 }
 
-void eeprom_write_eecr(u16 addr, u8 value)
+void eeprom_write_eecr(Cpu *cpu, u16 addr, u8 value)
 {
-    EECR = value;
+    cpu->eeprom.eecr = value;
 }
 
-u8 eeprom_read_eedr(u16 addr)
+u8 eeprom_read_eedr(Cpu *cpu, u16 addr)
 {
-    return EEPROM[EEAR];
+    return cpu->eeprom.eeprom[cpu->eeprom.eear];
 }
 
-void eeprom_write_eedr(u16 addr, u8 value)
+void eeprom_write_eedr(Cpu *cpu, u16 addr, u8 value)
 {
-    EEDR = value;
+    cpu->eeprom.eedr = value;
 }
 
-u8 eeprom_read_eearl(u16 addr)
+u8 eeprom_read_eearl(Cpu *cpu, u16 addr)
 {
-    return EEAR & 0xff;
+    return cpu->eeprom.eear & 0xff;
 }
 
-void eeprom_write_eearl(u16 addr, u8 value)
+void eeprom_write_eearl(Cpu *cpu, u16 addr, u8 value)
 {
-    EEAR = (EEAR & ~0xff) | value;
+    cpu->eeprom.eear = (cpu->eeprom.eear & ~0xff) | value;
 }
 
-u8 eeprom_read_eearh(u16 addr)
+u8 eeprom_read_eearh(Cpu *cpu, u16 addr)
 {
-    return (EEAR & (EEPROM_SIZE-1)) >> 8;
+    return (cpu->eeprom.eear & (EEPROM_SIZE-1)) >> 8;
 }
 
-void eeprom_write_eearh(u16 addr, u8 value)
+void eeprom_write_eearh(Cpu *cpu, u16 addr, u8 value)
 {
-    EEAR = (EEAR & ~0xff00) | ((value << 8) & (EEPROM_SIZE-1));
+    cpu->eeprom.eear = (cpu->eeprom.eear & ~0xff00) | ((value << 8) & (EEPROM_SIZE-1));
 }
 
-void eeprom_load(u8 *buf, u32 bufsize)
+void eeprom_load(Cpu *cpu, u8 *buf, u32 bufsize)
 {
-    memcpy(EEPROM, buf, bufsize);
+    memcpy(cpu->eeprom.eeprom, buf, bufsize);
+    cpu->dirty |= DIRTY_EEPROM;
 }
 
 void eeprom_init()
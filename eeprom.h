@@ -18,7 +18,21 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "util.h"
+#ifndef __EEPROM_H
+#define __EEPROM_H
+
+#include "cpu.h"
+
+#define EEPROM_SIZE 1024
+
+typedef struct {
+    u8 eeprom[EEPROM_SIZE];
+    u8 eecr;
+    u8 eedr;
+    u16 eear;
+} EepromState;
 
 void eeprom_init();
-void eeprom_load(u8 *buf, u32 bufsize);
+void eeprom_load(Cpu *cpu, u8 *buf, u32 bufsize);
+
+#endif // __EEPROM_H
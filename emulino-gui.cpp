@@ -26,10 +26,13 @@
 #include <qpainter.h>
 #include <qpushbutton.h>
 #include <qtimer.h>
+#include <stdio.h>
 
 #include "cpu.h"
 #include "loader.h"
 
+Cpu *cpu;
+
 class EmulinoApp: public QApplication {
     Q_OBJECT
 public:
@@ -51,19 +54,23 @@ EmulinoApp::EmulinoApp(int &argc, char *argv[])
 
 void EmulinoApp::onIdle()
 {
-    if (cpu_run() == CPU_HALT) {
+    int state = cpu_run(cpu);
+    if (state == CPU_FAULT) {
+        fprintf(stderr, "%s\n", cpu_get_fault(cpu));
+        timer.stop();
+    } else if (state == CPU_HALT) {
         timer.stop();
     }
 }
 
 void EmulinoApp::onButtonPress()
 {
-    cpu_set_pin(PIN_PORTD+2, true);
+    cpu_set_pin(cpu, PIN_PORTD+2, true);
 }
 
 void EmulinoApp::onButtonRelease()
 {
-    cpu_set_pin(PIN_PORTD+2, false);
+    cpu_set_pin(cpu, PIN_PORTD+2, false);
 }
 
 class BoardWidget: public QWidget {
@@ -272,7 +279,7 @@ void Pin::setState(bool newState)
 }
 
 Pin *Pins[PIN_COUNT];
-void pin_change(int pin, bool state)
+void pin_change(Cpu *cpu, int pin, bool state)
 {
     //fprintf(stderr, "pin %d %d\n", pin, state);
     if (Pins[pin] != NULL) {
@@ -334,10 +341,12 @@ int main(int argc, char *argv[])
     u32 eepromsize = load_file("emulino.eeprom", eeprom, sizeof(eeprom));
 
     cpu_init();
-    cpu_load_flash(prog, progsize);
-    cpu_load_eeprom(eeprom, eepromsize);
+    Flash *flash = flash_load(prog, progsize);
+    cpu = cpu_new(flash);
+    flash_release(flash);
+    cpu_load_eeprom(cpu, eeprom, eepromsize);
     for (int i = 0; i < PIN_COUNT; i++) {
-        cpu_pin_callback(i, pin_change);
+        cpu_pin_callback(cpu, i, pin_change);
     }
 
     return a.exec();
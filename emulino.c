@@ -18,17 +18,28 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
+#include "compare.h"
 #include "cpu.h"
+#include "forkserver.h"
+#include "fuzz.h"
 #include "loader.h"
+#include "network.h"
+#include "state.h"
+
+#define MAX_WATCHES 16
 
 bool pins[PIN_COUNT];
+volatile sig_atomic_t saverequested;
 
-void pinchange(int pin, bool state)
+void pinchange(Cpu *cpu, int pin, bool state)
 {
     fprintf(stderr, "pin %d %d\n", pin, state);
     pins[pin] = state;
@@ -38,16 +49,141 @@ void pinchange(int pin, bool state)
         pins[16], pins[17], pins[18], pins[19], pins[20], pins[21], pins[22], pins[23]);
 }
 
+void watchhit(Cpu *cpu, const WatchHit *hit)
+{
+    if (hit->write) {
+        fprintf(stderr, "watch: pc %04x cycle %llu write %04x %02x -> %02x\n", hit->pc*2, hit->cycle, hit->addr, hit->old, hit->value);
+    } else {
+        fprintf(stderr, "watch: pc %04x cycle %llu read %04x %02x\n", hit->pc*2, hit->cycle, hit->addr, hit->value);
+    }
+}
+
+void saverequest(int sig)
+{
+    saverequested = 1;
+}
+
+// addr[:len][:rws], watching writes by default
+bool parse_watch(const char *arg, u16 *addr, u16 *len, int *flags)
+{
+    char *p;
+    *addr = strtoul(arg, &p, 0);
+    *len = 1;
+    *flags = WATCH_WRITE;
+    if (p == arg) {
+        return false;
+    }
+    if (*p == ':' && isdigit((unsigned char)p[1])) {
+        *len = strtoul(p+1, &p, 0);
+    }
+    if (*p == ':') {
+        *flags = 0;
+        for (p++; *p != 0 && strchr("rws", *p) != NULL; p++) {
+            *flags |= *p == 'r' ? WATCH_READ : *p == 'w' ? WATCH_WRITE : WATCH_STOP;
+        }
+    }
+    return *p == 0 && *len > 0 && (*flags & (WATCH_READ|WATCH_WRITE)) != 0;
+}
+
+// addr[:len]
+bool parse_region(const char *arg, Region *region)
+{
+    char *p;
+    region->addr = strtoul(arg, &p, 0);
+    region->len = 1;
+    if (p == arg) {
+        return false;
+    }
+    if (*p == ':') {
+        region->len = strtoul(p+1, &p, 0);
+    }
+    return *p == 0 && region->len > 0;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s image\n"
-                        "       image is a raw binary or hex image file\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-io name] [--engine=interp|jit|diff] [--fusion-report] [--line-buffered]\n"
+                        "       [--stop-idle] [--watch addr[:len][:rws]]... [--load-state file]\n"
+                        "       [--save-state file [--save-cycle n] [--save-pc addr]]\n"
+                        "       [--prepare file]\n"
+                        "       [--fuzz corpus [--crashes dir] [--runs n] [--hang-cycles n]]\n"
+                        "       [--forkserver socket [--boot-cycle n] [--boot-pc addr]] image\n"
+                        "       %s [-io name] --connect socket\n"
+                        "       %s --batch manifest [--report file] [--jobs n] [--lockstep] [--cache dir]\n"
+                        "       %s --network topology [--jobs n]\n"
+                        "       %s [-io name] [--sram addr[:len]]... [--sync-cycles n] [--cycles n]\n"
+                        "       --compare image2 image\n"
+                        "       image is a raw binary or hex image file, or a prepared image\n"
+                        "       --line-buffered writes USART output at the end of every line\n"
+                        "       --stop-idle takes no USART input, and stops wherever the firmware\n"
+                        "       polls for some and carries on, as networks and the fuzzer do; the\n"
+                        "       run should come out the same as without it\n"
+                        "       --watch reports reads (r) and/or writes (w, the default) of data\n"
+                        "       memory, and stops the run on a hit with s\n"
+                        "       --save-state writes the machine state when the cycle count reaches\n"
+                        "       n, just before the instruction at byte address addr, or on SIGUSR1,\n"
+                        "       and carries on; --load-state starts from a saved state\n"
+                        "       --prepare writes image decoded and ready to map, for fast startup\n"
+                        "       and sharing between processes, and exits\n"
+                        "       --fuzz feeds mutated inputs from corpus to the USART from the point\n"
+                        "       where the firmware first waits for input, keeps those reaching new\n"
+                        "       code in corpus, and saves crashes and hangs to dir; given one of those\n"
+                        "       files instead of corpus it runs just that input\n"
+                        "       --forkserver boots image to cycle n, the instruction at byte\n"
+                        "       address addr, or by default where it first waits for input, then\n"
+                        "       forks a copy from there for each --connect, which runs like image\n"
+                        "       --batch runs the jobs in manifest, one per line as\n"
+                        "       image input expected [cycles], on n threads (default one per CPU)\n"
+                        "       and writes a tab separated report; --lockstep runs jobs on the\n"
+                        "       same image together while they take the same path; --cache keeps\n"
+                        "       results in dir and reuses them for runs of the same image, input\n"
+                        "       and emulino build\n"
+                        "       --network runs the boards in topology wired together, spread\n"
+                        "       over n threads (default one per CPU), parking idle ones\n"
+                        "       --compare runs image and image2 side by side on the same input,\n"
+                        "       checking every n cycles (default 100000) that they have sent the\n"
+                        "       same USART bytes and pin changes, with the same data memory at\n"
+                        "       each --sram region, and stops at the first difference\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
         exit(1);
     }
 
     int inf = 0;
     int outf = 1;
+    int engine = CPU_ENGINE_INTERP;
+    bool fusionreport = false;
+    bool linebuffered = false;
+    bool stopidle = false;
+    struct {
+        u16 addr;
+        u16 len;
+        int flags;
+    } watches[MAX_WATCHES];
+    int watchcount = 0;
+    const char *loadstate = NULL;
+    const char *savestate = NULL;
+    u64 savecycle = 0;
+    int savepc = -1;
+    const char *prepare = NULL;
+    const char *batch = NULL;
+    const char *report = NULL;
+    const char *network = NULL;
+    const char *fuzz = NULL;
+    const char *crashes = ".";
+    u64 runs = 0;
+    u64 hangcycles = 1000000;
+    int jobs = 0;
+    bool lockstep = false;
+    const char *cache = NULL;
+    const char *forkserver = NULL;
+    const char *connectto = NULL;
+    u64 bootcycle = 0;
+    int bootpc = -1;
+    const char *compare = NULL;
+    Region regions[MAX_REGIONS];
+    int regioncount = 0;
+    u64 synccycles = 100000;
+    u64 cycles = 0;
 
     int a = 1;
     while (a < argc) {
@@ -67,6 +203,83 @@ int main(int argc, char *argv[])
                     perror(fn);
                     exit(1);
                 }
+            } else if (strncmp(argv[a], "--engine=", 9) == 0) {
+                const char *e = argv[a] + 9;
+                if (strcmp(e, "interp") == 0) {
+                    engine = CPU_ENGINE_INTERP;
+                } else if (strcmp(e, "jit") == 0) {
+                    engine = CPU_ENGINE_JIT;
+                } else if (strcmp(e, "diff") == 0) {
+                    engine = CPU_ENGINE_DIFF;
+                } else {
+                    fprintf(stderr, "Unknown engine: %s\n", e);
+                    exit(1);
+                }
+            } else if (strcmp(argv[a], "--fusion-report") == 0) {
+                fusionreport = true;
+            } else if (strcmp(argv[a], "--line-buffered") == 0) {
+                linebuffered = true;
+            } else if (strcmp(argv[a], "--stop-idle") == 0) {
+                stopidle = true;
+            } else if (strcmp(argv[a], "--watch") == 0) {
+                a++;
+                if (a >= argc || watchcount >= MAX_WATCHES
+                 || !parse_watch(argv[a], &watches[watchcount].addr, &watches[watchcount].len, &watches[watchcount].flags)) {
+                    fprintf(stderr, "Bad watchpoint: %s\n", a < argc ? argv[a] : "");
+                    exit(1);
+                }
+                watchcount++;
+            } else if (strcmp(argv[a], "--load-state") == 0 && a+1 < argc) {
+                loadstate = argv[++a];
+            } else if (strcmp(argv[a], "--save-state") == 0 && a+1 < argc) {
+                savestate = argv[++a];
+            } else if (strcmp(argv[a], "--save-cycle") == 0 && a+1 < argc) {
+                savecycle = strtoull(argv[++a], NULL, 0);
+            } else if (strcmp(argv[a], "--save-pc") == 0 && a+1 < argc) {
+                savepc = strtoul(argv[++a], NULL, 0) / 2 % PROGRAM_SIZE_WORDS;
+            } else if (strcmp(argv[a], "--prepare") == 0 && a+1 < argc) {
+                prepare = argv[++a];
+            } else if (strcmp(argv[a], "--fuzz") == 0 && a+1 < argc) {
+                fuzz = argv[++a];
+            } else if (strcmp(argv[a], "--crashes") == 0 && a+1 < argc) {
+                crashes = argv[++a];
+            } else if (strcmp(argv[a], "--runs") == 0 && a+1 < argc) {
+                runs = strtoull(argv[++a], NULL, 0);
+            } else if (strcmp(argv[a], "--hang-cycles") == 0 && a+1 < argc) {
+                hangcycles = strtoull(argv[++a], NULL, 0);
+            } else if (strcmp(argv[a], "--forkserver") == 0 && a+1 < argc) {
+                forkserver = argv[++a];
+            } else if (strcmp(argv[a], "--connect") == 0 && a+1 < argc) {
+                connectto = argv[++a];
+            } else if (strcmp(argv[a], "--boot-cycle") == 0 && a+1 < argc) {
+                bootcycle = strtoull(argv[++a], NULL, 0);
+            } else if (strcmp(argv[a], "--boot-pc") == 0 && a+1 < argc) {
+                bootpc = strtoul(argv[++a], NULL, 0) / 2 % PROGRAM_SIZE_WORDS;
+            } else if (strcmp(argv[a], "--batch") == 0 && a+1 < argc) {
+                batch = argv[++a];
+            } else if (strcmp(argv[a], "--network") == 0 && a+1 < argc) {
+                network = argv[++a];
+            } else if (strcmp(argv[a], "--report") == 0 && a+1 < argc) {
+                report = argv[++a];
+            } else if (strcmp(argv[a], "--jobs") == 0 && a+1 < argc) {
+                jobs = atoi(argv[++a]);
+            } else if (strcmp(argv[a], "--lockstep") == 0) {
+                lockstep = true;
+            } else if (strcmp(argv[a], "--cache") == 0 && a+1 < argc) {
+                cache = argv[++a];
+            } else if (strcmp(argv[a], "--compare") == 0 && a+1 < argc) {
+                compare = argv[++a];
+            } else if (strcmp(argv[a], "--sram") == 0) {
+                a++;
+                if (a >= argc || regioncount >= MAX_REGIONS || !parse_region(argv[a], &regions[regioncount])) {
+                    fprintf(stderr, "Bad region: %s\n", a < argc ? argv[a] : "");
+                    exit(1);
+                }
+                regioncount++;
+            } else if (strcmp(argv[a], "--sync-cycles") == 0 && a+1 < argc) {
+                synccycles = strtoull(argv[++a], NULL, 0);
+            } else if (strcmp(argv[a], "--cycles") == 0 && a+1 < argc) {
+                cycles = strtoull(argv[++a], NULL, 0);
             } else {
                 fprintf(stderr, "Unknown option: %s\n", argv[a]);
                 exit(1);
@@ -77,34 +290,115 @@ int main(int argc, char *argv[])
         a++;
     }
 
-    u8 prog[PROGRAM_SIZE_WORDS*2];
-    u32 progsize = load_file(argv[a], prog, sizeof(prog));
-    if (progsize == 0) {
-        perror(argv[a]);
+    if (cache != NULL && batch == NULL) {
+        // a cached result has no output to replay, so only batches use it
+        fprintf(stderr, "--cache only applies to --batch\n");
+        exit(1);
+    }
+    if (stopidle && savestate != NULL) {
+        // both stop the run, and only one of them is for saving
+        fprintf(stderr, "--stop-idle can't be used with --save-state\n");
         exit(1);
     }
 
+    if (connectto != NULL) {
+        return forkserver_connect(connectto, inf, outf);
+    }
+    if (batch != NULL) {
+        cpu_init();
+        return batch_run(batch, report, jobs, engine, lockstep, cache) > 0;
+    }
+    if (network != NULL) {
+        cpu_init();
+        return network_run(network, jobs, engine) > 0;
+    }
+
+    if (compare != NULL) {
+        cpu_init();
+        return compare_run(argv[a], compare, inf, regions, regioncount, synccycles > 0 ? synccycles : 1, cycles, engine);
+    }
+
     u8 eeprom[512];
     u32 eepromsize = load_file("emulino.eeprom", eeprom, sizeof(eeprom));
 
     cpu_init();
-    cpu_load_flash(prog, progsize);
-    cpu_load_eeprom(eeprom, eepromsize);
+    Flash *flash = load_flash(argv[a]);
+    if (prepare != NULL) {
+        flash_save(flash, prepare);
+        flash_release(flash);
+        return 0;
+    }
+    Cpu *cpu = cpu_new(flash);
+    flash_release(flash);
+    if (!cpu_set_engine(cpu, engine)) {
+        fprintf(stderr, "JIT engine not available on this platform\n");
+        exit(1);
+    }
+    cpu_load_eeprom(cpu, eeprom, eepromsize);
+    if (loadstate != NULL) {
+        state_load(cpu, loadstate);
+    }
+    if (fuzz != NULL) {
+        return fuzz_run(cpu, fuzz, crashes, runs, hangcycles) > 0;
+    }
+    if (forkserver != NULL) {
+        return forkserver_run(cpu, forkserver, engine, bootcycle, bootpc);
+    }
 
-    cpu_usart_set_input(inf);
-    cpu_usart_set_output(outf);
+    cpu_usart_set_input(cpu, stopidle ? -1 : inf);
+    cpu_usart_set_output(cpu, outf);
+    cpu_usart_line_buffered(cpu, linebuffered);
+    cpu_usart_stop_idle(cpu, stopidle);
 
     int i;
+    cpu_watch_callback(cpu, watchhit);
+    for (i = 0; i < watchcount; i++) {
+        cpu_watch(cpu, watches[i].addr, watches[i].len, watches[i].flags);
+    }
+
     for (i = 0; i < 8; i++) {
-        cpu_pin_callback(PIN_PORTB+i, pinchange);
-        cpu_pin_callback(PIN_PORTC+i, pinchange);
-        cpu_pin_callback(PIN_PORTD+i, pinchange);
+        cpu_pin_callback(cpu, PIN_PORTB+i, pinchange);
+        cpu_pin_callback(cpu, PIN_PORTC+i, pinchange);
+        cpu_pin_callback(cpu, PIN_PORTD+i, pinchange);
+    }
+    if (savestate != NULL) {
+        if (savecycle > 0) {
+            cpu_stop_at(cpu, savecycle);
+        }
+        if (savepc >= 0) {
+            cpu_break(cpu, savepc);
+        }
+        signal(SIGUSR1, saverequest);
     }
     for (;;) {
-        if (cpu_run() == CPU_HALT) {
+        int state = cpu_run(cpu);
+        if (savestate != NULL && (state == CPU_STOP || saverequested)) {
+            saverequested = 0;
+            if (state == CPU_STOP) {
+                // a breakpoint in a loop only saves once
+                cpu_break(cpu, -1);
+            }
+            state_save(cpu, savestate);
+            fprintf(stderr, "emulino: Saved state at cycle %llu: %s\n", cpu_get_cycles(cpu), savestate);
+        }
+        if (state == CPU_FAULT) {
+            fprintf(stderr, "%s\n", cpu_get_fault(cpu));
+            exit(1);
+        }
+        if (state == CPU_HALT || state == CPU_WATCH) {
             break;
         }
     }
-    fprintf(stderr, "cycles: %lu\n", cpu_get_cycles());
+    fprintf(stderr, "cycles: %llu\n", cpu_get_cycles(cpu));
+    if (cpu_get_skipped_cycles(cpu) > 0) {
+        fprintf(stderr, "skipped in delay loops: %llu\n", cpu_get_skipped_cycles(cpu));
+    }
+    if (cpu_get_sleep_cycles(cpu) > 0) {
+        fprintf(stderr, "skipped asleep: %llu\n", cpu_get_sleep_cycles(cpu));
+    }
+    if (fusionreport) {
+        cpu_fusion_report(cpu);
+    }
+    cpu_free(cpu);
     return 0;
 }
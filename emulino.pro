@@ -9,11 +9,22 @@ INCLUDEPATH += .
 
 # Input
 CONFIG += qt
-HEADERS += cpu.h eeprom.h loader.h port.h timer.h usart.h util.h avr.inc
-SOURCES += cpu.c \
+DEFINES += THREADED
+HEADERS += batch.h cache.h compare.h core.h cpu.h eeprom.h forkserver.h fuzz.h loader.h network.h port.h state.h timer.h usart.h util.h instructions.h
+SOURCES += batch.c \
+           cache.c \
+           compare.c \
+           cpu.c \
            eeprom.c \
            emulino-gui.cpp \
+           forkserver.c \
+           fuzz.c \
+           jit.c \
            loader.c \
+           lockstep.c \
+           network.c \
            port.c \
+           state.c \
+           threaded.c \
            timer.c \
            usart.c
@@ -0,0 +1,243 @@
+/*
+ * Fork server for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "forkserver.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define BOOT_CYCLES     100000000   // most to run looking for the first read of input
+
+// The server boots the board once, up to a marker, and then forks a copy
+// of itself for each test, so every test starts from the booted machine
+// with copy-on-write doing the reset. A client connects to the socket and
+// passes over its stdin and stdout, which the test's USART then uses
+// directly, and gets back a line with the exit status and cycle count:
+//
+//     <status> <cycles> [<fault>]
+
+static void bind_path(struct sockaddr_un *sa, const char *path)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        fprintf(stderr, "forkserver: socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(sa->sun_path, path);
+}
+
+// Receives the client's stdin and stdout.
+static bool receive_fds(int conn, int fds[2])
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(conn, &msg, 0) != 1) {
+        return false;
+    }
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS
+     || c->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(c), 2 * sizeof(int));
+    return true;
+}
+
+static bool send_fds(int conn, const int fds[2])
+{
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, 2 * sizeof(int));
+    return sendmsg(conn, &msg, 0) == 1;
+}
+
+// Runs the test in the forked child, to the end, and reports back.
+static void run_test(Cpu *cpu, int conn, const int fds[2], int engine)
+{
+    cpu_usart_stop_idle(cpu, false);
+    cpu_usart_set_input(cpu, fds[0]);
+    cpu_usart_set_output(cpu, fds[1]);
+    cpu_set_engine(cpu, engine);
+    int state;
+    do {
+        state = cpu_run(cpu);
+    } while (state != CPU_HALT && state != CPU_FAULT);
+    char reply[100];
+    int n = snprintf(reply, sizeof(reply), "%d %llu %s\n", state == CPU_FAULT, cpu_get_cycles(cpu),
+        state == CPU_FAULT ? cpu_get_fault(cpu) : "");
+    if (write(conn, reply, n) != n) {
+        perror("forkserver");
+        exit(1);
+    }
+    exit(0);
+}
+
+// Boots the board to the cycle bootcycle, the instruction at word address
+// bootpc, or else the first time it waits for USART input, and then serves
+// tests on the socket at path for ever, running them with engine.
+int forkserver_run(Cpu *cpu, const char *path, int engine, u64 bootcycle, int bootpc)
+{
+    // the marker is found with the interpreter, which stops exactly
+    cpu_set_engine(cpu, CPU_ENGINE_INTERP);
+    cpu_usart_set_input(cpu, -1);
+    if (bootcycle > 0) {
+        cpu_stop_at(cpu, bootcycle);
+    } else if (bootpc >= 0) {
+        cpu_break(cpu, bootpc);
+    } else {
+        cpu_usart_stop_idle(cpu, true);
+        cpu_stop_at(cpu, cpu_get_cycles(cpu) + BOOT_CYCLES);
+    }
+    int state;
+    do {
+        state = cpu_run(cpu);
+    } while (state == CPU_RUN || state == CPU_SLEEP);
+    cpu_break(cpu, -1);
+    if (state != CPU_STOP) {
+        fprintf(stderr, "forkserver: firmware %s before reaching the boot marker\n",
+            state == CPU_FAULT ? cpu_get_fault(cpu) : "halted");
+        exit(1);
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        perror("socket");
+        exit(1);
+    }
+    struct sockaddr_un sa;
+    bind_path(&sa, path);
+    unlink(path);
+    if (bind(server, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(server, 16) != 0) {
+        perror(path);
+        exit(1);
+    }
+    // finished tests are reaped by the system
+    signal(SIGCHLD, SIG_IGN);
+    fprintf(stderr, "forkserver: booted in %llu cycles, listening on %s\n", cpu_get_cycles(cpu), path);
+
+    for (;;) {
+        int conn = accept(server, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        int fds[2];
+        if (!receive_fds(conn, fds)) {
+            fprintf(stderr, "forkserver: bad request\n");
+            close(conn);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(server);
+            run_test(cpu, conn, fds, engine);
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
+        close(fds[0]);
+        close(fds[1]);
+        close(conn);
+    }
+}
+
+// Runs one test on the server at path with inf and outf as its USART, as
+// if the image had been run directly, and returns its exit status.
+int forkserver_connect(const char *path, int inf, int outf)
+{
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0) {
+        perror("socket");
+        exit(1);
+    }
+    struct sockaddr_un sa;
+    bind_path(&sa, path);
+    if (connect(conn, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        perror(path);
+        exit(1);
+    }
+    const int fds[2] = {inf, outf};
+    if (!send_fds(conn, fds)) {
+        perror("forkserver");
+        exit(1);
+    }
+    char reply[100];
+    int len = 0;
+    for (;;) {
+        int n = read(conn, reply + len, sizeof(reply) - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    close(conn);
+    reply[len] = 0;
+    int status;
+    unsigned long long cycles;
+    int pos;
+    if (sscanf(reply, "%d %llu %n", &status, &cycles, &pos) < 2) {
+        fprintf(stderr, "forkserver: test process died\n");
+        return 1;
+    }
+    reply[strcspn(reply, "\n")] = 0;
+    if (status != 0) {
+        fprintf(stderr, "%s\n", reply + pos);
+    } else {
+        fprintf(stderr, "cycles: %llu\n", cycles);
+    }
+    return status;
+}
@@ -0,0 +1,422 @@
+/*
+ * Fuzzing harness for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fuzz.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+
+#define INPUT_SIZE      USART_RX_SIZE   // all of it fits in the receive queue
+#define BOOT_CYCLES     100000000       // most to run before the first read of input
+#define MUTANTS         64              // tried from each queue entry in turn
+#define MAX_STACK       8               // mutations applied to make one mutant
+
+// how one run of an input ended
+#define RUN_OK      0
+#define RUN_CRASH   1
+#define RUN_HANG    2   // ran out of cycles without going back to waiting for input
+
+// The board boots once, up to the point where it first waits for input,
+// and a snapshot is taken there. Every input starts from that snapshot
+// with its bytes in the receive queue, so a run costs only the memory the
+// last one wrote plus clearing the coverage map.
+
+typedef struct {
+    u8 *data;
+    int len;
+} Entry;
+
+static Cpu *Board;
+static Snapshot *Boot;
+static u64 HangCycles;
+static Entry *Queue;
+static int QueueCount;
+static u64 Random;
+
+static u8 Trace[COVERAGE_SIZE] __attribute__((aligned(64)));
+// bits of each edge's hit count bucket not yet seen, for the corpus, and
+// edges not yet seen for crashes and hangs, which are only kept if they
+// do something new
+static u8 Virgin[COVERAGE_SIZE] __attribute__((aligned(64)));
+static u8 CrashVirgin[COVERAGE_SIZE] __attribute__((aligned(64)));
+static u8 HangVirgin[COVERAGE_SIZE] __attribute__((aligned(64)));
+static u8 Buckets[256];
+
+static const u8 Interesting[] = {0, 1, 0x7f, 0x80, 0xff, ' ', '\r', '\n', '0', '9', 'A', 'z'};
+
+static void init_buckets()
+{
+    // AFL's hit count classes: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+    int i;
+    for (i = 1; i < 256; i++) {
+        Buckets[i] = i <= 3 ? 1 << (i - 1) : i < 8 ? 8 : i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+    }
+}
+
+static u64 next_random()
+{
+    // xorshift64*
+    Random ^= Random >> 12;
+    Random ^= Random << 25;
+    Random ^= Random >> 27;
+    return Random * 0x2545f4914f6cdd1dULL;
+}
+
+static int below(int n)
+{
+    return next_random() % n;
+}
+
+static void discard(Cpu *cpu, u8 c)
+{
+}
+
+// Whether the last run hit an edge, or an edge a number of times, that
+// virgin hasn't seen, which it then has. With counts false only new
+// edges count, as for crashes and hangs, where a loop running a different
+// number of times doesn't make a different bug.
+static bool new_coverage(u8 *virgin, bool counts)
+{
+    const u64 *trace = (const u64 *)Trace;
+    bool found = false;
+    int i, j;
+    for (i = 0; i < COVERAGE_SIZE / 8; i++) {
+        if (trace[i] == 0) {
+            continue;
+        }
+        for (j = 8*i; j < 8*i + 8; j++) {
+            u8 b = counts ? Buckets[Trace[j]] : Trace[j] != 0;
+            if (b & virgin[j]) {
+                virgin[j] &= ~b;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+static int run_input(const u8 *data, int len)
+{
+    memset(Trace, 0, sizeof(Trace));
+    cpu_restore(Board, Boot);
+    cpu_coverage(Board, Trace);
+    cpu_usart_receive(Board, data, len);
+    u64 deadline = cpu_get_cycles(Board) + HangCycles;
+    cpu_stop_at(Board, deadline);
+    for (;;) {
+        int state = cpu_run(Board);
+        if (state == CPU_FAULT) {
+            return RUN_CRASH;
+        }
+        if (state == CPU_HALT) {
+            return RUN_OK;
+        }
+        if (state == CPU_STOP) {
+            // stopping early is waiting for more input, having read it
+            // all; running out of cycles is a hang unless the board has
+            // read it all and gone to sleep waiting for more
+            if (cpu_get_cycles(Board) < deadline) {
+                return RUN_OK;
+            }
+            return cpu_usart_pending(Board) == 0 && cpu_is_asleep(Board) ? RUN_OK : RUN_HANG;
+        }
+    }
+}
+
+// Writes data to the first of dir/prefix-000000, dir/prefix-000001 and
+// so on from *next that doesn't exist yet, so that nothing from an
+// earlier session is written over, and leaves its name in fn.
+static void write_new_file(const char *dir, const char *prefix, int *next, const u8 *data, int len,
+                           char *fn, int fnsize)
+{
+    int fd;
+    for (;;) {
+        snprintf(fn, fnsize, "%s/%s-%06d", dir, prefix, (*next)++);
+        fd = open(fn, O_WRONLY|O_CREAT|O_EXCL, 0666);
+        if (fd >= 0) {
+            break;
+        }
+        if (errno != EEXIST) {
+            perror(fn);
+            exit(1);
+        }
+    }
+    if (write(fd, data, len) != len || close(fd) != 0) {
+        perror(fn);
+        exit(1);
+    }
+}
+
+static void add_entry(const u8 *data, int len)
+{
+    Queue = realloc(Queue, (QueueCount + 1) * sizeof(Entry));
+    u8 *copy = malloc(len > 0 ? len : 1);
+    if (Queue == NULL || copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (len > 0) {
+        memcpy(copy, data, len);
+    }
+    Queue[QueueCount].data = copy;
+    Queue[QueueCount].len = len;
+    QueueCount++;
+}
+
+static void read_input(const char *fn)
+{
+    FILE *f = fopen(fn, "rb");
+    if (f == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    u8 buf[INPUT_SIZE];
+    int len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    add_entry(buf, len);
+}
+
+static void read_corpus(const char *corpus)
+{
+    DIR *dir = opendir(corpus);
+    if (dir == NULL) {
+        perror(corpus);
+        exit(1);
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        char fn[1024];
+        snprintf(fn, sizeof(fn), "%s/%s", corpus, de->d_name);
+        struct stat st;
+        if (stat(fn, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        read_input(fn);
+    }
+    closedir(dir);
+    if (QueueCount == 0) {
+        add_entry(NULL, 0);
+    }
+}
+
+// Applies a stack of random edits to data, returning the new length.
+static int mutate(u8 *data, int len)
+{
+    int n = 1 + below(MAX_STACK);
+    while (n-- > 0) {
+        int at = len > 0 ? below(len) : 0;
+        int size = 1 + below(len > 8 ? 8 : len > 0 ? len : 1);
+        switch (below(8)) {
+        case 0:
+            if (len > 0) {
+                data[at] ^= 1 << below(8);
+            }
+            break;
+        case 1:
+            if (len > 0) {
+                data[at] = Interesting[below(sizeof(Interesting))];
+            }
+            break;
+        case 2:
+            if (len > 0) {
+                data[at] = next_random();
+            }
+            break;
+        case 3:
+            if (len > 0) {
+                data[at] += below(35) - 17;
+            }
+            break;
+        case 4:
+            // delete
+            if (at + size <= len && size < len) {
+                memmove(data + at, data + at + size, len - at - size);
+                len -= size;
+            }
+            break;
+        case 5:
+            // insert a run of one byte, random or from the input
+            if (len + size <= INPUT_SIZE) {
+                u8 c = len > 0 && below(2) ? data[below(len)] : (u8)next_random();
+                memmove(data + at + size, data + at, len - at);
+                memset(data + at, c, size);
+                len += size;
+            }
+            break;
+        case 6:
+            // append
+            if (len < INPUT_SIZE) {
+                data[len++] = below(2) ? Interesting[below(sizeof(Interesting))] : (u8)next_random();
+            }
+            break;
+        case 7: {
+            // splice in the tail of another entry
+            const Entry *e = &Queue[below(QueueCount)];
+            if (e->len > 0) {
+                int from = below(e->len);
+                int count = e->len - from;
+                if (at + count > INPUT_SIZE) {
+                    count = INPUT_SIZE - at;
+                }
+                memcpy(data + at, e->data + from, count);
+                len = at + count;
+            }
+            break;
+        }
+        }
+    }
+    return len;
+}
+
+static u64 now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int count_edges()
+{
+    int n = 0;
+    int i;
+    for (i = 0; i < COVERAGE_SIZE; i++) {
+        n += Virgin[i] != 0xff;
+    }
+    return n;
+}
+
+// Fuzzes the board's USART input from the inputs in the corpus directory,
+// adding any that reach new edges to it, and saving crashes and hangs to
+// the crashes directory as reproducers, until runs inputs have been tried
+// (or for ever if runs is 0). Each input gets hangcycles. Returns the
+// number of crashes and hangs found. If corpus is a file rather than a
+// directory it is run once, as a reproducer, with the output written out.
+int fuzz_run(Cpu *cpu, const char *corpus, const char *crashes, u64 runs, u64 hangcycles)
+{
+    Board = cpu;
+    HangCycles = hangcycles;
+    Random = now_us() ^ getpid();
+    init_buckets();
+    memset(Virgin, 0xff, sizeof(Virgin));
+    memset(CrashVirgin, 0xff, sizeof(CrashVirgin));
+    memset(HangVirgin, 0xff, sizeof(HangVirgin));
+    struct stat st;
+    bool replay = stat(corpus, &st) == 0 && S_ISREG(st.st_mode);
+    if (replay) {
+        read_input(corpus);
+    } else {
+        read_corpus(corpus);
+    }
+
+    cpu_set_engine(cpu, CPU_ENGINE_INTERP);
+    cpu_usart_set_input(cpu, -1);
+    if (!replay) {
+        cpu_usart_callback(cpu, discard);
+    }
+    cpu_usart_stop_idle(cpu, true);
+    cpu_stop_at(cpu, cpu_get_cycles(cpu) + BOOT_CYCLES);
+    int state;
+    do {
+        state = cpu_run(cpu);
+    } while (state == CPU_RUN || state == CPU_SLEEP);
+    if (state != CPU_STOP) {
+        fprintf(stderr, "fuzz: firmware %s before reading any input\n",
+            state == CPU_FAULT ? cpu_get_fault(cpu) : "halted");
+        exit(1);
+    }
+    Boot = cpu_snapshot(cpu);
+    if (replay) {
+        int result = run_input(Queue[0].data, Queue[0].len);
+        if (result == RUN_CRASH) {
+            fprintf(stderr, "fuzz: %s: %s\n", corpus, cpu_get_fault(cpu));
+        } else if (result == RUN_HANG) {
+            fprintf(stderr, "fuzz: %s: still running after %llu cycles\n", corpus, HangCycles);
+        }
+        return result != RUN_OK;
+    }
+    fprintf(stderr, "fuzz: booted in %llu cycles, %d inputs in corpus\n", cpu_get_cycles(cpu), QueueCount);
+
+    u64 start = now_us();
+    u64 lastreport = start;
+    u64 execs = 0;
+    int found = 0;
+    int crashcount = 0, hangcount = 0;
+    int nextid = 0, nextcrash = 0, nexthang = 0;
+    int i;
+    for (i = 0; i < QueueCount; i++) {
+        run_input(Queue[i].data, Queue[i].len);
+        new_coverage(Virgin, true);
+        execs++;
+    }
+    int current = 0;
+    while (runs == 0 || execs < runs) {
+        u8 data[INPUT_SIZE];
+        const Entry *parent = &Queue[current];
+        memcpy(data, parent->data, parent->len);
+        int len = mutate(data, parent->len);
+        int result = run_input(data, len);
+        execs++;
+        char fn[1024];
+        if (result == RUN_CRASH && new_coverage(CrashVirgin, false)) {
+            write_new_file(crashes, "crash", &nextcrash, data, len, fn, sizeof(fn));
+            crashcount++;
+            fprintf(stderr, "fuzz: %s: %s\n", fn, cpu_get_fault(Board));
+            found++;
+        } else if (result == RUN_HANG && new_coverage(HangVirgin, false)) {
+            write_new_file(crashes, "hang", &nexthang, data, len, fn, sizeof(fn));
+            hangcount++;
+            fprintf(stderr, "fuzz: %s: still running after %llu cycles\n", fn, HangCycles);
+            found++;
+        } else if (result == RUN_OK && new_coverage(Virgin, true)) {
+            add_entry(data, len);
+            write_new_file(corpus, "id", &nextid, data, len, fn, sizeof(fn));
+        }
+        if (execs % MUTANTS == 0) {
+            current = (current + 1) % QueueCount;
+        }
+        if ((execs & 0xfff) == 0) {
+            u64 now = now_us();
+            if (now - lastreport >= 1000000) {
+                lastreport = now;
+                fprintf(stderr, "fuzz: %llu runs, %.0f/s, corpus %d, edges %d, crashes %d, hangs %d\n",
+                    execs, execs * 1e6 / (now - start), QueueCount, count_edges(), crashcount, hangcount);
+            }
+        }
+    }
+    u64 wallus = now_us() - start;
+    fprintf(stderr, "fuzz: %llu runs in %.3f s, %.0f/s, corpus %d, edges %d, crashes %d, hangs %d\n",
+        execs, wallus / 1e6, wallus > 0 ? execs * 1e6 / wallus : 0.0, QueueCount, count_edges(), crashcount, hangcount);
+
+    snapshot_free(Boot);
+    for (i = 0; i < QueueCount; i++) {
+        free(Queue[i].data);
+    }
+    free(Queue);
+    return found;
+}
@@ -0,0 +1,163 @@
+/*
+ * emulino - arduino emulator
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// AVR instruction set, included by cpu.c with INSTR() defined.
+// INSTR(encoding, handler, operands, cycles, class): 0 and 1 in the
+// encoding are fixed bits, letters are operand fields picked apart by
+// decode_<operands>. Commented entries are aliases of another encoding.
+
+INSTR("0001 11rd dddd rrrr", ADC,    rd,   1, ALU)
+INSTR("0000 11rd dddd rrrr", ADD,    rd,   1, ALU)
+INSTR("1001 0110 KKdd KKKK", ADIW,   Kw,   2, ALU)
+INSTR("0010 00rd dddd rrrr", AND,    rd,   1, ALU)
+INSTR("0111 KKKK dddd KKKK", ANDI,   Kd,   1, ALU)
+INSTR("1001 010d dddd 0101", ASR,    d,    1, ALU)
+INSTR("1001 0100 1sss 1000", BCLR,   s,    1, ALU)
+INSTR("1111 100d dddd 0bbb", BLD,    db,   1, ALU)
+INSTR("1111 01kk kkkk ksss", BRBC,   ks,   1, FLOW)
+INSTR("1111 00kk kkkk ksss", BRBS,   ks,   1, FLOW)
+//    "1111 01kk kkkk k000", BRCC
+//    "1111 00kk kkkk k000", BRCS
+INSTR("1001 0101 1001 1000", BREAK,  none, 1, SYS)
+//    "1111 00kk kkkk k001", BREQ
+//    "1111 01kk kkkk k100", BRGE
+//    "1111 01kk kkkk k101", BRHC
+//    "1111 00kk kkkk k101", BRHS
+//    "1111 01kk kkkk k111", BRID
+//    "1111 00kk kkkk k111", BRIE
+//    "1111 00kk kkkk k000", BRLO
+//    "1111 00kk kkkk k100", BRLT
+//    "1111 00kk kkkk k010", BRMI
+//    "1111 01kk kkkk k001", BRNE
+//    "1111 01kk kkkk k010", BRPL
+//    "1111 01kk kkkk k000", BRSH
+//    "1111 01kk kkkk k110", BRTC
+//    "1111 00kk kkkk k110", BRTS
+//    "1111 01kk kkkk k011", BRVC
+//    "1111 00kk kkkk k011", BRVS
+INSTR("1001 0100 0sss 1000", BSET,   s,    1, ALU)
+INSTR("1111 101d dddd 0bbb", BST,    db,   1, ALU)
+INSTR("1001 010k kkkk 111k", CALL,   k22,  4, FLOW)
+INSTR("1001 1000 AAAA Abbb", CBI,    Ab,   2, MEM)
+//    "1001 0100 1000 1000", CLC
+//    "1001 0100 1101 1000", CLH
+//    "1001 0100 1111 1000", CLI
+//    "1001 0100 1010 1000", CLN
+//    "0010 01dd dddd dddd", CLR
+//    "1001 0100 1100 1000", CLS
+//    "1001 0100 1110 1000", CLT
+//    "1001 0100 1011 1000", CLV
+//    "1001 0100 1001 1000", CLZ
+INSTR("1001 010d dddd 0000", COM,    d,    1, ALU)
+INSTR("0001 01rd dddd rrrr", CP,     rd,   1, ALU)
+INSTR("0000 01rd dddd rrrr", CPC,    rd,   1, ALU)
+INSTR("0011 KKKK dddd KKKK", CPI,    Kd,   1, ALU)
+INSTR("0001 00rd dddd rrrr", CPSE,   rd,   1, FLOW)
+INSTR("1001 010d dddd 1010", DEC,    d,    1, ALU)
+INSTR("1001 0100 KKKK 1011", DES,    none, 1, SYS)
+INSTR("1001 0101 0001 1001", EICALL, none, 4, SYS)
+INSTR("1001 0100 0001 1001", EIJMP,  none, 2, SYS)
+INSTR("1001 0101 1101 1000", ELPM_1, none, 3, ALU)
+INSTR("1001 000d dddd 0110", ELPM_2, d,    3, SYS)
+INSTR("1001 000d dddd 0111", ELPM_3, d,    3, SYS)
+INSTR("0010 01rd dddd rrrr", EOR,    rd,   1, ALU)
+INSTR("0000 0011 0ddd 1rrr", FMUL,   none, 2, SYS)
+INSTR("0000 0011 1ddd 0rrr", FMULS,  none, 2, SYS)
+INSTR("0000 0011 1ddd 1rrr", FMULSU, none, 2, SYS)
+INSTR("1001 0101 0000 1001", ICALL,  none, 3, FLOW)
+INSTR("1001 0100 0000 1001", IJMP,   none, 2, FLOW)
+INSTR("1011 0AAd dddd AAAA", IN,     Ad,   1, MEM)
+INSTR("1001 010d dddd 0011", INC,    d,    1, ALU)
+INSTR("1001 010k kkkk 110k", JMP,    k22,  3, FLOW)
+INSTR("1001 000d dddd 1100", LD_X1,  d,    2, MEM)
+INSTR("1001 000d dddd 1101", LD_X2,  d,    2, MEM)
+INSTR("1001 000d dddd 1110", LD_X3,  d,    2, MEM)
+//    "1000 000d dddd 1000", LD_Y1
+INSTR("1001 000d dddd 1001", LD_Y2,  d,    2, MEM)
+INSTR("1001 000d dddd 1010", LD_Y3,  d,    2, MEM)
+INSTR("10q0 qq0d dddd 1qqq", LD_Y4,  qd,   2, MEM)
+//    "1000 000d dddd 0000", LD_Z1
+INSTR("1001 000d dddd 0001", LD_Z2,  d,    2, MEM)
+INSTR("1001 000d dddd 0010", LD_Z3,  d,    2, MEM)
+INSTR("10q0 qq0d dddd 0qqq", LD_Z4,  qd,   2, MEM)
+INSTR("1110 KKKK dddd KKKK", LDI,    Kd,   1, ALU)
+INSTR("1001 000d dddd 0000", LDS,    dk16, 2, MEM)
+INSTR("1001 0101 1100 1000", LPM_1,  none, 3, ALU)
+INSTR("1001 000d dddd 0100", LPM_2,  d,    3, ALU)
+INSTR("1001 000d dddd 0101", LPM_3,  d,    3, ALU)
+//    "0000 11dd dddd dddd", LSL
+INSTR("1001 010d dddd 0110", LSR,    d,    1, ALU)
+INSTR("0010 11rd dddd rrrr", MOV,    rd,   1, ALU)
+INSTR("0000 0001 dddd rrrr", MOVW,   rdw,  1, ALU)
+INSTR("1001 11rd dddd rrrr", MUL,    rd,   2, ALU)
+INSTR("0000 0010 dddd rrrr", MULS,   rdh,  2, ALU)
+INSTR("0000 0011 0ddd 0rrr", MULSU,  rdh3, 2, ALU)
+INSTR("1001 010d dddd 0001", NEG,    d,    1, ALU)
+INSTR("0000 0000 0000 0000", NOP,    none, 1, ALU)
+INSTR("0010 10rd dddd rrrr", OR,     rd,   1, ALU)
+INSTR("0110 KKKK dddd KKKK", ORI,    Kd,   1, ALU)
+INSTR("1011 1AAr rrrr AAAA", OUT,    Ar,   1, MEM)
+INSTR("1001 000d dddd 1111", POP,    d,    2, MEM)
+INSTR("1001 001d dddd 1111", PUSH,   r,    2, MEM)
+INSTR("1101 kkkk kkkk kkkk", RCALL,  k12,  3, FLOW)
+INSTR("1001 0101 0000 1000", RET,    none, 4, FLOW)
+INSTR("1001 0101 0001 1000", RETI,   none, 4, FLOW)
+INSTR("1100 kkkk kkkk kkkk", RJMP,   k12,  2, FLOW)
+//    "0001 11dd dddd dddd", ROL
+INSTR("1001 010d dddd 0111", ROR,    d,    1, ALU)
+INSTR("0000 10rd dddd rrrr", SBC,    rd,   1, ALU)
+INSTR("0100 KKKK dddd KKKK", SBCI,   Kd,   1, ALU)
+INSTR("1001 1010 AAAA Abbb", SBI,    Ab,   2, MEM)
+INSTR("1001 1001 AAAA Abbb", SBIC,   Ab,   1, MEM)
+INSTR("1001 1011 AAAA Abbb", SBIS,   Ab,   1, MEM)
+INSTR("1001 0111 KKdd KKKK", SBIW,   Kw,   2, ALU)
+//    "0110 KKKK dddd KKKK", SBR
+INSTR("1111 110r rrrr 0bbb", SBRC,   rb,   1, FLOW)
+INSTR("1111 111r rrrr 0bbb", SBRS,   rb,   1, FLOW)
+//    "1001 0100 0000 1000", SEC
+//    "1001 0100 0101 1000", SEH
+//    "1001 0100 0111 1000", SEI
+//    "1001 0100 0010 1000", SEN
+//    "1110 1111 dddd 1111", SER
+//    "1001 0100 0100 1000", SES
+//    "1001 0100 0110 1000", SET
+//    "1001 0100 0011 1000", SEV
+//    "1001 0100 0001 1000", SEZ
+INSTR("1001 0101 1000 1000", SLEEP,  none, 1, SYS)
+//    "1001 0101 1110 1000", SPM
+INSTR("1001 0101 1110 1000", SPM2_1, none, 0, SYS)
+INSTR("1001 0101 1111 1000", SPM2_2, none, 0, SYS)
+INSTR("1001 001r rrrr 1100", ST_X1,  r,    2, MEM)
+INSTR("1001 001r rrrr 1101", ST_X2,  r,    2, MEM)
+INSTR("1001 001r rrrr 1110", ST_X3,  r,    2, MEM)
+//    "1000 001r rrrr 1000", ST_Y1
+INSTR("1001 001r rrrr 1001", ST_Y2,  r,    2, MEM)
+INSTR("1001 001r rrrr 1010", ST_Y3,  r,    2, MEM)
+INSTR("10q0 qq1r rrrr 1qqq", ST_Y4,  qr,   2, MEM)
+//    "1000 001r rrrr 0000", ST_Z1
+INSTR("1001 001r rrrr 0001", ST_Z2,  r,    2, MEM)
+INSTR("1001 001r rrrr 0010", ST_Z3,  r,    2, MEM)
+INSTR("10q0 qq1r rrrr 0qqq", ST_Z4,  qr,   2, MEM)
+INSTR("1001 001d dddd 0000", STS,    dk16, 2, MEM)
+INSTR("0001 10rd dddd rrrr", SUB,    rd,   1, ALU)
+INSTR("0101 KKKK dddd KKKK", SUBI,   Kd,   1, ALU)
+INSTR("1001 010d dddd 0010", SWAP,   d,    1, ALU)
+//    "0010 00dd dddd dddd", TST
+INSTR("1001 0101 1010 1000", WDR,    none, 1, SYS)
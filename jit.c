@@ -0,0 +1,573 @@
+/*
+ * x86-64 basic block JIT for the emulino CPU core
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A block is a run of CLASS_ALU instructions followed by at most one
+ * instruction of any other class (the terminator). Simple ALU instructions
+ * are translated to native code, everything else calls the do_* handler
+ * from cpu.c with the predecoded Op. While a block runs, rbx points at
+ * the Cpu (whose first member is its data memory), r12 at FlagTable, and
+ * r13d holds SREG; SREG is written back to memory before any handler is
+ * called and when control returns to C. Each board compiles into its own
+ * code buffer.
+ *
+ * The whole cost of a block is charged to the cycle counter on entry. A block is only
+ * entered when it cannot reach the next scheduled event, so events,
+ * interrupts and cpu_run() returns happen on exactly the same cycle as in
+ * the interpreter. At the end of a block, control passes directly to the
+ * next block if it has already been compiled and also fits before the
+ * next event.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#include "core.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define CODE_SIZE       (16*1024*1024)
+#define MAX_BLOCK_OPS   64
+#define MAX_BLOCK_CODE  (MAX_BLOCK_OPS*64 + 256)
+#define MAX_EXTRA       2       // most cycles a handler adds on top of Op.cycles
+
+// native translations available for a handful of common instructions
+enum {
+    J_NONE,
+    J_NOP, J_LDI, J_MOV, J_MOVW, J_SWAP, J_BSET, J_BCLR, J_INC, J_DEC,
+    J_ADD, J_ADC, J_SUB, J_SBC, J_CP, J_CPC, J_AND, J_OR, J_EOR,
+    J_SUBI, J_SBCI, J_CPI, J_ANDI, J_ORI,
+};
+
+static const struct {
+    const char *name;
+    u8 kind;
+} JitNames[] = {
+    {"NOP", J_NOP}, {"LDI", J_LDI}, {"MOV", J_MOV}, {"MOVW", J_MOVW},
+    {"SWAP", J_SWAP}, {"BSET", J_BSET}, {"BCLR", J_BCLR},
+    {"INC", J_INC}, {"DEC", J_DEC},
+    {"ADD", J_ADD}, {"ADC", J_ADC}, {"SUB", J_SUB}, {"SBC", J_SBC},
+    {"CP", J_CP}, {"CPC", J_CPC}, {"AND", J_AND}, {"OR", J_OR}, {"EOR", J_EOR},
+    {"SUBI", J_SUBI}, {"SBCI", J_SBCI}, {"CPI", J_CPI}, {"ANDI", J_ANDI}, {"ORI", J_ORI},
+};
+
+// SREG bits
+#define F_C BIT(0)
+#define F_Z BIT(1)
+#define F_N BIT(2)
+#define F_V BIT(3)
+#define F_S BIT(4)
+#define F_H BIT(5)
+
+typedef struct {
+    u32 maxcycles;  // upper bound on cycles the block can use
+    u32 count;      // number of instructions
+} BlockHeader;
+
+typedef void (*EnterFunction)(Cpu *cpu, u8 *code);
+
+typedef struct Jit {
+    u8 *code;
+    u8 *codenext;
+    u8 *leave;
+    EnterFunction enter;
+    u8 *p;                          // where the next byte is emitted
+    bool diff;
+    TData saved;                    // for diff_block()
+    u8 *entry[PROGRAM_SIZE_WORDS];  // compiled block for each pc
+} Jit;
+
+// displacement of a Cpu field from rbx
+#define FIELD(f) ((u32)offsetof(Cpu, f))
+
+static u8 JitKind[256];
+static u8 FlagTable[256];
+
+static void emit(Jit *j, u8 b)
+{
+    *j->p++ = b;
+}
+
+static void emit2(Jit *j, u8 b1, u8 b2)
+{
+    emit(j, b1);
+    emit(j, b2);
+}
+
+static void emit3(Jit *j, u8 b1, u8 b2, u8 b3)
+{
+    emit(j, b1);
+    emit(j, b2);
+    emit(j, b3);
+}
+
+static void emit32(Jit *j, u32 x)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        emit(j, x >> (i*8));
+    }
+}
+
+static void emit64(Jit *j, const void *x)
+{
+    unsigned long long v = (unsigned long)x;
+    int i;
+    for (i = 0; i < 8; i++) {
+        emit(j, v >> (i*8));
+    }
+}
+
+static void emit_jump(Jit *j, u8 *target)
+{
+    // jmp rel32
+    emit(j, 0xe9);
+    emit32(j, target - (j->p + 4));
+}
+
+static void emit_jcc(Jit *j, u8 cc, u8 *target)
+{
+    // jcc rel32
+    emit2(j, 0x0f, cc);
+    emit32(j, target - (j->p + 4));
+}
+
+static void emit_sreg_store(Jit *j)
+{
+    // mov [rbx+0x5f],r13b
+    emit2(j, 0x44, 0x88); emit2(j, 0x6b, 0x5f);
+}
+
+static void emit_sreg_load(Jit *j)
+{
+    // movzx r13d,byte [rbx+0x5f]
+    emit2(j, 0x44, 0x0f); emit3(j, 0xb6, 0x6b, 0x5f);
+}
+
+static void emit_load_al(Jit *j, u8 reg)
+{
+    // mov al,[rbx+reg]
+    emit3(j, 0x8a, 0x43, reg);
+}
+
+static void emit_store_al(Jit *j, u8 reg)
+{
+    // mov [rbx+reg],al
+    emit3(j, 0x88, 0x43, reg);
+}
+
+static void emit_carry_in(Jit *j)
+{
+    // bt r13d,0
+    emit2(j, 0x41, 0x0f); emit3(j, 0xba, 0xe5, 0x00);
+}
+
+// Collect the host flags left by the previous instruction into ecx as
+// AVR SREG bits, then merge the bits in mask into r13d.
+static void emit_flags(Jit *j, u8 mask, bool chainz)
+{
+    emit(j, 0x9f);                 // lahf
+    emit3(j, 0x0f, 0x90, 0xc2);    // seto dl
+    emit2(j, 0x88, 0xe1);          // mov cl,ah
+    emit3(j, 0x80, 0xe1, 0xd1);    // and cl,0xd1
+    emit2(j, 0x00, 0xd2);          // add dl,dl
+    emit2(j, 0x08, 0xd1);          // or cl,dl
+    emit3(j, 0x0f, 0xb6, 0xc9);    // movzx ecx,cl
+    emit2(j, 0x41, 0x0f); emit3(j, 0xb6, 0x0c, 0x0c); // movzx ecx,byte [r12+rcx]
+    if (chainz) {
+        // CPC, SBC and SBCI can only clear Z
+        emit3(j, 0x44, 0x89, 0xea);    // mov edx,r13d
+        emit3(j, 0x83, 0xca, 0xfd);    // or edx,~F_Z
+        emit2(j, 0x21, 0xd1);          // and ecx,edx
+    }
+    emit2(j, 0x81, 0xe1); emit32(j, mask);            // and ecx,mask
+    emit3(j, 0x41, 0x81, 0xe5); emit32(j, ~mask);     // and r13d,~mask
+    emit3(j, 0x41, 0x09, 0xcd);                    // or r13d,ecx
+}
+
+// opcode for "op al,[rbx+disp8]" and "op al,imm8" for each ALU operation
+static void emit_alu(Jit *j, u8 kind, const Op *op)
+{
+    static const u8 RegForm[] = {
+        [J_ADD] = 0x02, [J_ADC] = 0x12, [J_SUB] = 0x2a, [J_SBC] = 0x1a,
+        [J_CP] = 0x3a, [J_CPC] = 0x1a, [J_AND] = 0x22, [J_OR] = 0x0a, [J_EOR] = 0x32,
+    };
+    static const u8 ImmForm[] = {
+        [J_SUBI] = 0x2c, [J_SBCI] = 0x1c, [J_CPI] = 0x3c, [J_ANDI] = 0x24, [J_ORI] = 0x0c,
+    };
+    bool carry = kind == J_ADC || kind == J_SBC || kind == J_CPC || kind == J_SBCI;
+    bool chainz = kind == J_SBC || kind == J_CPC || kind == J_SBCI;
+    bool store = kind != J_CP && kind != J_CPC && kind != J_CPI;
+    bool logic = kind == J_AND || kind == J_OR || kind == J_EOR || kind == J_ANDI || kind == J_ORI;
+
+    emit_load_al(j, op->d);
+    if (carry) {
+        emit_carry_in(j);
+    }
+    if (kind < LENGTHOF(RegForm) && RegForm[kind]) {
+        emit3(j, RegForm[kind], 0x43, op->r);
+    } else {
+        emit2(j, ImmForm[kind], op->k);
+    }
+    emit_flags(j, logic ? F_S|F_V|F_N|F_Z : F_H|F_S|F_V|F_N|F_Z|F_C, chainz);
+    if (store) {
+        emit_store_al(j, op->d);
+    }
+}
+
+static void emit_call(Jit *j, const Op *op)
+{
+    emit_sreg_store(j);
+    emit3(j, 0x48, 0x89, 0xdf);                 // mov rdi,rbx
+    emit2(j, 0x48, 0xbe); emit64(j, op);        // mov rsi,op
+    emit2(j, 0x48, 0xb8); emit64(j, op->handler); // mov rax,handler
+    emit2(j, 0xff, 0xd0);                       // call rax
+    // pick up any flags the handler left for lazy evaluation
+    emit2(j, 0x80, 0xbb); emit32(j, FIELD(lazy.kind)); emit(j, LAZY_NONE); // cmp byte [rbx+lazy.kind],LAZY_NONE
+    emit2(j, 0x74, 15);                         // je +15
+    emit3(j, 0x48, 0x89, 0xdf);                 // mov rdi,rbx
+    emit2(j, 0x48, 0xb8); emit64(j, sreg_sync); // mov rax,sreg_sync
+    emit2(j, 0xff, 0xd0);                       // call rax
+    emit_sreg_load(j);
+}
+
+static void emit_op(Jit *j, const Op *op)
+{
+    u8 kind = op->handler == Instructions[op->id].handler ? JitKind[op->id] : J_NONE;
+    switch (kind) {
+    case J_NOP:
+        break;
+    case J_LDI:
+        emit3(j, 0xc6, 0x43, op->d); emit(j, op->k);  // mov byte [rbx+d],k
+        break;
+    case J_MOV:
+        emit_load_al(j, op->r);
+        emit_store_al(j, op->d);
+        break;
+    case J_MOVW:
+        emit(j, 0x66); emit3(j, 0x8b, 0x43, op->r);   // mov ax,[rbx+r]
+        emit(j, 0x66); emit3(j, 0x89, 0x43, op->d);   // mov [rbx+d],ax
+        break;
+    case J_SWAP:
+        emit3(j, 0xc0, 0x43, op->d); emit(j, 4);      // rol byte [rbx+d],4
+        break;
+    case J_BSET:
+        emit3(j, 0x41, 0x81, 0xcd); emit32(j, BIT(op->b));    // or r13d,bit
+        break;
+    case J_BCLR:
+        emit3(j, 0x41, 0x81, 0xe5); emit32(j, ~BIT(op->b));   // and r13d,~bit
+        break;
+    case J_INC:
+        emit3(j, 0xfe, 0x43, op->d);               // inc byte [rbx+d]
+        emit_flags(j, F_S|F_V|F_N|F_Z, false);
+        break;
+    case J_DEC:
+        emit3(j, 0xfe, 0x4b, op->d);               // dec byte [rbx+d]
+        emit_flags(j, F_S|F_V|F_N|F_Z, false);
+        break;
+    case J_NONE:
+        emit_call(j, op);
+        break;
+    default:
+        emit_alu(j, kind, op);
+        break;
+    }
+}
+
+static void emit_set_pc(Jit *j, u16 pc)
+{
+    emit3(j, 0x66, 0xc7, 0x83); emit32(j, FIELD(pc)); emit(j, pc); emit(j, pc >> 8); // mov word [rbx+pc],pc
+}
+
+// Jump straight to the block for the new PC if there is one and it fits
+// before the next event, otherwise return to C.
+static void emit_chain(Jit *j)
+{
+    emit2(j, 0x83, 0xbb); emit32(j, FIELD(state)); emit(j, 0x00); // cmp dword [rbx+state],0
+    emit_jcc(j, 0x85, j->leave);                // jne Leave
+    emit3(j, 0x0f, 0xb7, 0x83); emit32(j, FIELD(pc)); // movzx eax,word [rbx+pc]
+    emit2(j, 0x48, 0xb9); emit64(j, j->entry);  // mov rcx,entry
+    emit2(j, 0x48, 0x8b); emit2(j, 0x04, 0xc1); // mov rax,[rcx+rax*8]
+    emit3(j, 0x48, 0x85, 0xc0);                 // test rax,rax
+    emit_jcc(j, 0x84, j->leave);                // jz Leave
+    emit3(j, 0x48, 0x8b, 0x8b); emit32(j, FIELD(cycle)); // mov rcx,[rbx+cycle]
+    emit3(j, 0x8b, 0x50, -(int)sizeof(BlockHeader));// mov edx,[rax-8]
+    emit3(j, 0x48, 0x01, 0xd1);                 // add rcx,rdx
+    emit3(j, 0x48, 0x3b, 0x8b); emit32(j, FIELD(nextevent)); // cmp rcx,[rbx+nextevent]
+    emit_jcc(j, 0x83, j->leave);                // jae Leave
+    emit2(j, 0xff, 0xe0);                       // jmp rax
+}
+
+static void emit_trampolines(Jit *j)
+{
+    j->p = j->code;
+
+    // void enter(Cpu *cpu, u8 *code)
+    j->enter = (EnterFunction)j->p;
+    emit(j, 0x53);                              // push rbx
+    emit2(j, 0x41, 0x54);                       // push r12
+    emit2(j, 0x41, 0x55);                       // push r13
+    emit3(j, 0x48, 0x89, 0xfb);                 // mov rbx,rdi
+    emit2(j, 0x49, 0xbc); emit64(j, FlagTable); // mov r12,FlagTable
+    emit_sreg_load(j);
+    emit2(j, 0xff, 0xe6);                       // jmp rsi
+
+    j->leave = j->p;
+    emit_sreg_store(j);
+    emit2(j, 0x41, 0x5d);                       // pop r13
+    emit2(j, 0x41, 0x5c);                       // pop r12
+    emit(j, 0x5b);                              // pop rbx
+    emit(j, 0xc3);                              // ret
+
+    j->codenext = j->p;
+}
+
+static bool pure(const Op *op)
+{
+    // in differential mode a block is run twice, so it must not touch I/O
+    u8 class = Instructions[op->id].class;
+    return class == CLASS_ALU || (class == CLASS_FLOW && op->handler == Instructions[op->id].handler);
+}
+
+static u8 *compile(Cpu *cpu, u16 pc)
+{
+    Jit *j = cpu->jit;
+    if (j->codenext + MAX_BLOCK_CODE > j->code + CODE_SIZE) {
+        jit_flush(cpu);
+    }
+    BlockHeader hdr = {MAX_EXTRA, 0};
+    u32 end = pc;
+    for (;;) {
+        const Op *op = &cpu->decoded[end];
+        if (j->diff && !pure(op)) {
+            break;
+        }
+        hdr.maxcycles += op->cycles;
+        hdr.count++;
+        end += op->length;
+        if (Instructions[op->id].class != CLASS_ALU || op->handler != Instructions[op->id].handler
+         || hdr.count >= MAX_BLOCK_OPS || end >= PROGRAM_SIZE_WORDS) {
+            break;
+        }
+    }
+    if (hdr.count == 0) {
+        return NULL;
+    }
+
+    j->p = j->codenext;
+    memcpy(j->p, &hdr, sizeof(hdr));
+    j->p += sizeof(hdr);
+    u8 *entry = j->p;
+
+    emit3(j, 0x48, 0x81, 0x83); emit32(j, FIELD(cycle)); emit32(j, hdr.maxcycles - MAX_EXTRA); // add qword [rbx+cycle],cycles
+    u32 i;
+    u16 a = pc;
+    for (i = 0; i < hdr.count; i++) {
+        const Op *op = &cpu->decoded[a];
+        a += op->length;
+        if (i == hdr.count - 1 || op->handler != Instructions[op->id].handler || Instructions[op->id].class != CLASS_ALU) {
+            // handlers expect PC to point past the instruction
+            emit_set_pc(j, a);
+        }
+        emit_op(j, op);
+    }
+    if (j->diff) {
+        emit_jump(j, j->leave);
+    } else {
+        emit_chain(j);
+    }
+
+    j->codenext = j->p;
+    j->entry[pc] = entry;
+    return entry;
+}
+
+static void diff_block(Cpu *cpu, u8 *code)
+{
+    Jit *j = cpu->jit;
+    TData jitdata;
+    u16 savedpc = cpu->pc;
+    u64 savedcycle = cpu->cycle;
+    int savedstate = cpu->state;
+    const BlockHeader *hdr = (const BlockHeader *)(code - sizeof(BlockHeader));
+
+    sreg_sync(cpu);
+    j->saved = cpu->data;
+    j->enter(cpu, code);
+    u16 jitpc = cpu->pc;
+    u64 jitcycle = cpu->cycle;
+    int jitstate = cpu->state;
+
+    jitdata = cpu->data;
+    cpu->data = j->saved;
+    cpu->pc = savedpc;
+    cpu->cycle = savedcycle;
+    cpu->state = savedstate;
+    u32 i;
+    for (i = 0; i < hdr->count; i++) {
+        cpu_step(cpu);
+    }
+    sreg_sync(cpu);
+
+    if (cpu->pc == jitpc && cpu->cycle == jitcycle && cpu->state == jitstate
+     && memcmp(&cpu->data, &jitdata, sizeof(cpu->data)) == 0) {
+        return;
+    }
+    fprintf(stderr, "emulino: engine mismatch in block at %04x (%u instructions)\n", savedpc*2, (unsigned)hdr->count);
+    fprintf(stderr, "  PC: jit %04x interp %04x\n", jitpc*2, cpu->pc*2);
+    fprintf(stderr, "  cycles: jit %llu interp %llu\n", jitcycle, cpu->cycle);
+    fprintf(stderr, "  state: jit %d interp %d\n", jitstate, cpu->state);
+    for (i = 0; i < DATA_SIZE_BYTES; i++) {
+        if (jitdata._Bytes[i] != cpu->data._Bytes[i]) {
+            if (i < 32) {
+                fprintf(stderr, "  r%u: jit %02x interp %02x\n", (unsigned)i, jitdata._Bytes[i], cpu->data._Bytes[i]);
+            } else if (i == 0x5f) {
+                fprintf(stderr, "  SREG: jit %02x interp %02x\n", jitdata._Bytes[i], cpu->data._Bytes[i]);
+            } else {
+                fprintf(stderr, "  %04x: jit %02x interp %02x\n", (unsigned)i, jitdata._Bytes[i], cpu->data._Bytes[i]);
+            }
+        }
+    }
+    exit(1);
+}
+
+void jit_init()
+{
+    int i, j;
+    for (i = 0; i < InstructionCount; i++) {
+        for (j = 0; j < LENGTHOF(JitNames); j++) {
+            if (strcmp(Instructions[i].name, JitNames[j].name) == 0) {
+                JitKind[i] = JitNames[j].kind;
+            }
+        }
+    }
+    // index is SF ZF - AF - - OF CF as assembled by emit_flags()
+    for (i = 0; i < 256; i++) {
+        u8 f = 0;
+        if (i & BIT(0)) f |= F_C;
+        if (i & BIT(1)) f |= F_V;
+        if (i & BIT(4)) f |= F_H;
+        if (i & BIT(6)) f |= F_Z;
+        if (i & BIT(7)) f |= F_N;
+        if (((i >> 7) ^ (i >> 1)) & 1) f |= F_S;
+        FlagTable[i] = f;
+    }
+}
+
+bool jit_available()
+{
+    return true;
+}
+
+void jit_flush(Cpu *cpu)
+{
+    Jit *j = cpu->jit;
+    if (j == NULL) {
+        return;
+    }
+    memset(j->entry, 0, sizeof(j->entry));
+    emit_trampolines(j);
+}
+
+void jit_free(Cpu *cpu)
+{
+    Jit *j = cpu->jit;
+    if (j == NULL) {
+        return;
+    }
+    munmap(j->code, CODE_SIZE);
+    free(j);
+    cpu->jit = NULL;
+}
+
+int jit_run(Cpu *cpu, bool diff)
+{
+    Jit *j = cpu->jit;
+    if (j == NULL) {
+        j = cpu->jit = calloc(1, sizeof(Jit));
+        if (j == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        j->code = mmap(NULL, CODE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (j->code == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        emit_trampolines(j);
+    }
+    if (diff != j->diff) {
+        j->diff = diff;
+        jit_flush(cpu);
+    }
+    while (cpu->state == CPU_RUN) {
+        u8 *code = j->entry[cpu->pc];
+        if (code == NULL) {
+            code = compile(cpu, cpu->pc);
+        }
+        if (code != NULL && cpu->cycle + ((const BlockHeader *)(code - sizeof(BlockHeader)))->maxcycles < cpu->nextevent) {
+            if (j->diff) {
+                diff_block(cpu, code);
+            } else {
+                sreg_sync(cpu);
+                j->enter(cpu, code);
+            }
+        } else {
+            cpu_step(cpu);
+            if (cpu_poll(cpu)) {
+                break;
+            }
+        }
+    }
+    return cpu->state;
+}
+
+#else // !__x86_64__
+
+void jit_init()
+{
+}
+
+bool jit_available()
+{
+    return false;
+}
+
+void jit_flush(Cpu *cpu)
+{
+}
+
+void jit_free(Cpu *cpu)
+{
+}
+
+int jit_run(Cpu *cpu, bool diff)
+{
+    fprintf(stderr, "emulino: no JIT for this architecture\n");
+    exit(1);
+}
+
+#endif
@@ -106,3 +106,19 @@ u32 load_file(const char *fn, u8 *buf, u32 bufsize)
     }
     return r;
 }
+
+// Maps fn if it is a prepared image, or loads and decodes it if not.
+Flash *load_flash(const char *fn)
+{
+    Flash *flash = flash_map(fn);
+    if (flash == NULL) {
+        static u8 prog[PROGRAM_SIZE_WORDS*2];
+        u32 progsize = load_file(fn, prog, sizeof(prog));
+        if (progsize == 0) {
+            perror(fn);
+            exit(1);
+        }
+        flash = flash_load(prog, progsize);
+    }
+    return flash;
+}
@@ -18,6 +18,7 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "cpu.h"
 #include "util.h"
 
 #ifdef __cplusplus
@@ -25,6 +26,7 @@ extern "C" {
 #endif
 
 u32 load_file(const char *fn, u8 *buf, u32 bufsize);
+Flash *load_flash(const char *fn);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,752 @@
+/*
+ * Lockstep execution of many boards for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Boards running the same flash from the same point mostly run the same
+// instructions, only on different data. A lockstep group keeps the
+// register files and SREG of up to LOCKSTEP_LANES boards as vectors, one
+// lane per board, and steps them all with one dispatch per instruction.
+// Register and flow instructions are done as vector operations; plain
+// memory accesses loop over the lanes, each in its own board's data.
+// Anything else (I/O, watchpoints, SLEEP and so on) runs the ordinary
+// handler on every lane. Where a data dependent branch or skip sends
+// lanes different ways, the smaller side leaves the group and carries on
+// as an ordinary board.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#include "util.h"
+
+#include "core.h"
+
+// the vector helpers are all static, so their calling convention never
+// has to match anything compiled elsewhere; Lanes still only go in by
+// pointer, since GCC notes the 32-byte parameter ABI with no way to
+// turn that off here
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef u8 Lanes __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef s8 SignedLanes __attribute__((vector_size(LOCKSTEP_LANES)));
+
+typedef unsigned long long LaneMask;
+COMPILE_ASSERT(LOCKSTEP_LANES <= 64);
+COMPILE_ASSERT(LOCKSTEP_LANES % 8 == 0);
+
+// SREG bits
+#define F_C BIT(0)
+#define F_Z BIT(1)
+#define F_N BIT(2)
+#define F_V BIT(3)
+#define F_S BIT(4)
+#define F_H BIT(5)
+#define F_T BIT(6)
+
+#define SREG_ADDR   0x5f
+
+enum {
+    L_NONE,
+    L_NOP, L_LDI, L_MOV, L_MOVW, L_SWAP, L_BSET, L_BCLR, L_BST, L_BLD,
+    L_INC, L_DEC, L_COM, L_NEG, L_LSR, L_ROR, L_ASR,
+    L_ADD, L_ADC, L_SUB, L_SBC, L_CP, L_CPC, L_AND, L_OR, L_EOR,
+    L_SUBI, L_SBCI, L_CPI, L_ANDI, L_ORI, L_ADIW, L_SBIW,
+    L_RJMP, L_JMP, L_BRBS, L_BRBC, L_CPSE, L_SBRC, L_SBRS,
+    L_LD, L_ST, L_LDS, L_STS, L_IN, L_OUT, L_PUSH, L_POP,
+    L_RCALL, L_CALL, L_RET, L_LPM,
+};
+
+// how LD and ST find their address
+#define M_PLAIN     0   // pointer
+#define M_INC       1   // pointer, then increment it
+#define M_DEC       2   // decrement the pointer first
+#define M_DISP      3   // pointer + Op.k
+
+static const struct {
+    const char *name;
+    u8 kind;
+    u8 ptr;     // pointer register for LD, ST and LPM
+    u8 mode;
+} LockNames[] = {
+    {"NOP", L_NOP}, {"LDI", L_LDI}, {"MOV", L_MOV}, {"MOVW", L_MOVW},
+    {"SWAP", L_SWAP}, {"BSET", L_BSET}, {"BCLR", L_BCLR}, {"BST", L_BST}, {"BLD", L_BLD},
+    {"INC", L_INC}, {"DEC", L_DEC}, {"COM", L_COM}, {"NEG", L_NEG},
+    {"LSR", L_LSR}, {"ROR", L_ROR}, {"ASR", L_ASR},
+    {"ADD", L_ADD}, {"ADC", L_ADC}, {"SUB", L_SUB}, {"SBC", L_SBC},
+    {"CP", L_CP}, {"CPC", L_CPC}, {"AND", L_AND}, {"OR", L_OR}, {"EOR", L_EOR},
+    {"SUBI", L_SUBI}, {"SBCI", L_SBCI}, {"CPI", L_CPI}, {"ANDI", L_ANDI}, {"ORI", L_ORI},
+    {"ADIW", L_ADIW}, {"SBIW", L_SBIW},
+    {"RJMP", L_RJMP}, {"JMP", L_JMP}, {"BRBS", L_BRBS}, {"BRBC", L_BRBC},
+    {"CPSE", L_CPSE}, {"SBRC", L_SBRC}, {"SBRS", L_SBRS},
+    {"LD_X1", L_LD, 26, M_PLAIN}, {"LD_X2", L_LD, 26, M_INC}, {"LD_X3", L_LD, 26, M_DEC},
+    {"LD_Y2", L_LD, 28, M_INC}, {"LD_Y3", L_LD, 28, M_DEC}, {"LD_Y4", L_LD, 28, M_DISP},
+    {"LD_Z2", L_LD, 30, M_INC}, {"LD_Z3", L_LD, 30, M_DEC}, {"LD_Z4", L_LD, 30, M_DISP},
+    {"ST_X1", L_ST, 26, M_PLAIN}, {"ST_X2", L_ST, 26, M_INC}, {"ST_X3", L_ST, 26, M_DEC},
+    {"ST_Y2", L_ST, 28, M_INC}, {"ST_Y3", L_ST, 28, M_DEC}, {"ST_Y4", L_ST, 28, M_DISP},
+    {"ST_Z2", L_ST, 30, M_INC}, {"ST_Z3", L_ST, 30, M_DEC}, {"ST_Z4", L_ST, 30, M_DISP},
+    {"LDS", L_LDS}, {"STS", L_STS}, {"IN", L_IN}, {"OUT", L_OUT},
+    {"PUSH", L_PUSH}, {"POP", L_POP}, {"RCALL", L_RCALL}, {"CALL", L_CALL}, {"RET", L_RET},
+    {"LPM_1", L_LPM, 30, M_PLAIN}, {"LPM_2", L_LPM, 30, M_PLAIN}, {"LPM_3", L_LPM, 30, M_INC},
+};
+
+static u8 LockKind[256];
+static u8 LockPtr[256];
+static u8 LockMode[256];
+
+typedef struct {
+    Lanes reg[32];
+    Lanes sreg;
+    Lanes ones;                 // 1 in the lanes still in the group
+    LaneMask active;
+    u16 pc;
+    u64 cycle;
+    u64 nextevent;
+    const Op *decoded;
+    Cpu *cpu[LOCKSTEP_LANES];
+    const Op *saved[LOCKSTEP_LANES];    // each board's own Cpu.decoded
+} Group;
+
+#define FOR_LANES(g, l, m) \
+    for (m = (g)->active; m != 0 && ((l) = __builtin_ctzll(m), 1); m &= m - 1)
+
+static inline bool none(const Lanes *v)
+{
+    u64 w[LOCKSTEP_LANES / 8];
+    memcpy(w, v, sizeof(w));
+    u64 x = 0;
+    int i;
+    for (i = 0; i < LOCKSTEP_LANES / 8; i++) {
+        x |= w[i];
+    }
+    return x == 0;
+}
+
+static inline Lanes splat(u8 x)
+{
+    return (Lanes){0} + x;
+}
+
+#define IS_ZERO(x) ((Lanes)((x) == 0))
+
+static inline u16 pair(const Group *g, int r, int l)
+{
+    return g->reg[r][l] | (g->reg[r+1][l] << 8);
+}
+
+static inline void set_pair(Group *g, int r, int l, u16 x)
+{
+    g->reg[r][l] = x & 0xff;
+    g->reg[r+1][l] = x >> 8;
+}
+
+static inline bool plain(const Cpu *cpu, u16 addr, u8 slow)
+{
+    // the registers live in the group, not in the board's data
+    return addr >= 0x20 && (cpu->access[addr] & slow) == 0;
+}
+
+static inline void store(Cpu *cpu, u16 addr, u8 value)
+{
+    cpu->data._Bytes[addr] = value;
+    cpu->dirty |= 1ULL << (addr >> DIRTY_SHIFT);
+}
+
+// Writes lane l back to its board, at the group's pc and cycle.
+static void sync_out(Group *g, int l)
+{
+    Cpu *cpu = g->cpu[l];
+    int r;
+    for (r = 0; r < 32; r++) {
+        cpu->data.Reg[r] = g->reg[r][l];
+    }
+    cpu->data.SREG.bits = g->sreg[l];
+    cpu->lazy.kind = LAZY_NONE;
+    cpu->pc = g->pc;
+    cpu->cycle = g->cycle;
+}
+
+static void sync_in(Group *g, int l)
+{
+    Cpu *cpu = g->cpu[l];
+    sreg_sync(cpu);
+    int r;
+    for (r = 0; r < 32; r++) {
+        g->reg[r][l] = cpu->data.Reg[r];
+    }
+    g->sreg[l] = cpu->data.SREG.bits;
+}
+
+// Lane l goes back to being an ordinary board. Its board must be up to
+// date already.
+static void leave(Group *g, int l)
+{
+    g->cpu[l]->decoded = g->saved[l];
+    g->active &= ~(1ULL << l);
+    g->ones[l] = 0;
+}
+
+static void find_nextevent(Group *g)
+{
+    int l;
+    LaneMask m;
+    g->nextevent = NEVER;
+    FOR_LANES(g, l, m) {
+        if (g->cpu[l]->nextevent < g->nextevent) {
+            g->nextevent = g->cpu[l]->nextevent;
+        }
+    }
+}
+
+// After every lane's board has run something on its own, keeps the lanes
+// that are running and agree with most of the others on pc and cycle.
+static void settle(Group *g)
+{
+    int l, k;
+    LaneMask m, n;
+    int best = -1;
+    int bestcount = 0;
+    FOR_LANES(g, l, m) {
+        const Cpu *cpu = g->cpu[l];
+        if (cpu->state != CPU_RUN) {
+            continue;
+        }
+        int count = 0;
+        FOR_LANES(g, k, n) {
+            const Cpu *other = g->cpu[k];
+            count += other->state == CPU_RUN && other->pc == cpu->pc && other->cycle == cpu->cycle;
+        }
+        if (count > bestcount) {
+            best = l;
+            bestcount = count;
+        }
+        if (count * 2 > __builtin_popcountll(g->active)) {
+            break;
+        }
+    }
+    u16 pc = best >= 0 ? g->cpu[best]->pc : 0;
+    u64 cycle = best >= 0 ? g->cpu[best]->cycle : 0;
+    FOR_LANES(g, l, m) {
+        const Cpu *cpu = g->cpu[l];
+        if (cpu->state == CPU_RUN && cpu->pc == pc && cpu->cycle == cycle) {
+            sync_in(g, l);
+        } else {
+            leave(g, l);
+        }
+    }
+    g->pc = pc;
+    g->cycle = cycle;
+    find_nextevent(g);
+}
+
+// Runs op with the interpreter's handler on every lane.
+static void scalar_op(Group *g, const Op *op)
+{
+    int l;
+    LaneMask m;
+    FOR_LANES(g, l, m) {
+        sync_out(g, l);
+        Cpu *cpu = g->cpu[l];
+        cpu->pc += op->length;
+        cpu->cycle += op->cycles;
+        op->handler(cpu, op);
+    }
+    settle(g);
+}
+
+static void poll(Group *g)
+{
+    int l;
+    LaneMask m;
+    FOR_LANES(g, l, m) {
+        sync_out(g, l);
+        cpu_poll(g->cpu[l]);
+    }
+    settle(g);
+}
+
+// Where cond (0 or 1 per lane) is set the lane goes to taken with extra
+// cycles, otherwise it stays at the group's pc. If the lanes disagree the
+// smaller side leaves the group.
+static void fork_lanes(Group *g, const Lanes *cond, u16 taken, int extra)
+{
+    Lanes t = *cond & g->ones;
+    if (none(&t)) {
+        return;
+    }
+    Lanes f = t ^ g->ones;
+    if (!none(&f)) {
+        int l;
+        LaneMask m;
+        int count = 0;
+        FOR_LANES(g, l, m) {
+            count += t[l];
+        }
+        bool keeptaken = count * 2 > __builtin_popcountll(g->active);
+        FOR_LANES(g, l, m) {
+            if ((t[l] != 0) != keeptaken) {
+                sync_out(g, l);
+                if (t[l]) {
+                    g->cpu[l]->pc = taken;
+                    g->cpu[l]->cycle += extra;
+                }
+                leave(g, l);
+            }
+        }
+        if (!keeptaken) {
+            return;
+        }
+    }
+    g->pc = taken;
+    g->cycle += extra;
+}
+
+// Moves the group to the pc most lanes have in pcs; the rest leave.
+static void split_pcs(Group *g, const u16 *pcs)
+{
+    int l, k;
+    LaneMask m, n;
+    u16 pc = pcs[__builtin_ctzll(g->active)];
+    bool same = true;
+    FOR_LANES(g, l, m) {
+        same &= pcs[l] == pc;
+    }
+    if (!same) {
+        int bestcount = 0;
+        FOR_LANES(g, l, m) {
+            int count = 0;
+            FOR_LANES(g, k, n) {
+                count += pcs[k] == pcs[l];
+            }
+            if (count > bestcount) {
+                pc = pcs[l];
+                bestcount = count;
+            }
+        }
+        FOR_LANES(g, l, m) {
+            if (pcs[l] != pc) {
+                sync_out(g, l);
+                g->cpu[l]->pc = pcs[l];
+                leave(g, l);
+            }
+        }
+    }
+    g->pc = pc;
+}
+
+#define SET_FLAGS(g, mask, f) ((g)->sreg = ((g)->sreg & (u8)~(mask)) | (f))
+
+static inline Lanes flags_add(const Lanes *pd, const Lanes *pr, const Lanes *px)
+{
+    Lanes d = *pd, r = *pr, x = *px;
+    Lanes c = (d & r) | (r & ~x) | (~x & d);
+    Lanes v = ((d & r & ~x) | (~d & ~r & x)) >> 7;
+    Lanes n = x >> 7;
+    return (((c >> 3) & 1) << 5) | ((n ^ v) << 4) | (v << 3) | (n << 2) | (IS_ZERO(x) & F_Z) | (c >> 7);
+}
+
+// for SBC, SBCI and CPC, where Z can only be cleared, zero is the old Z;
+// the rest pass NULL
+static inline Lanes flags_sub(const Lanes *pd, const Lanes *pr, const Lanes *px, const Lanes *zero)
+{
+    Lanes d = *pd, r = *pr, x = *px;
+    Lanes c = (~d & r) | (r & x) | (x & ~d);
+    Lanes v = ((d & ~r & ~x) | (~d & r & x)) >> 7;
+    Lanes n = x >> 7;
+    Lanes z = IS_ZERO(x) & F_Z;
+    if (zero != NULL) {
+        z &= *zero;
+    }
+    return (((c >> 3) & 1) << 5) | ((n ^ v) << 4) | (v << 3) | (n << 2) | z | (c >> 7);
+}
+
+// S V N Z for AND, OR, EOR and friends
+static inline Lanes flags_logic(const Lanes *px)
+{
+    Lanes n = *px >> 7;
+    return (n << 4) | (n << 2) | (IS_ZERO(*px) & F_Z);
+}
+
+// S V N Z C after a right shift that took c out of the bottom
+static inline Lanes flags_shift(const Lanes *px, const Lanes *pc)
+{
+    Lanes n = *px >> 7;
+    Lanes v = n ^ *pc;
+    return ((n ^ v) << 4) | (v << 3) | (n << 2) | (IS_ZERO(*px) & F_Z) | *pc;
+}
+
+static void run_group(Group *g)
+{
+    while (__builtin_popcountll(g->active) >= 2) {
+        if (g->cycle >= g->nextevent) {
+            poll(g);
+            continue;
+        }
+        const Op *op = &g->decoded[g->pc];
+        u8 kind = op->handler == Instructions[op->id].handler ? LockKind[op->id] : L_NONE;
+        if (kind == L_NONE) {
+            scalar_op(g, op);
+            continue;
+        }
+        u16 pc = g->pc;
+        g->pc += op->length;
+        g->cycle += op->cycles;
+        Lanes *reg = g->reg;
+        Lanes d = reg[op->d];
+        Lanes r = reg[op->r];
+        Lanes k = splat(op->k);
+        Lanes x, c;
+        int l;
+        LaneMask m;
+        u16 addr[LOCKSTEP_LANES];
+        switch (kind) {
+        case L_NOP:
+            break;
+        case L_LDI:
+            reg[op->d] = k;
+            break;
+        case L_MOV:
+            reg[op->d] = r;
+            break;
+        case L_MOVW:
+            reg[op->d] = r;
+            reg[op->d+1] = reg[op->r+1];
+            break;
+        case L_SWAP:
+            reg[op->d] = (d << 4) | (d >> 4);
+            break;
+        case L_BSET:
+            g->sreg |= (u8)(1 << op->b);
+            break;
+        case L_BCLR:
+            g->sreg &= (u8)~(1 << op->b);
+            break;
+        case L_BST:
+            SET_FLAGS(g, F_T, ((d >> op->b) & 1) << 6);
+            break;
+        case L_BLD:
+            reg[op->d] = (d & (u8)~(1 << op->b)) | (((g->sreg >> 6) & 1) << op->b);
+            break;
+        case L_INC:
+            x = reg[op->d] = d + 1;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x) ^ ((Lanes)(x == 0x80) & (F_S|F_V)));
+            break;
+        case L_DEC:
+            x = reg[op->d] = d - 1;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x) ^ ((Lanes)(x == 0x7f) & (F_S|F_V)));
+            break;
+        case L_COM:
+            x = reg[op->d] = ~d;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z|F_C, flags_logic(&x) | F_C);
+            break;
+        case L_NEG:
+            x = reg[op->d] = -d;
+            SET_FLAGS(g, F_H|F_S|F_V|F_N|F_Z|F_C,
+                (((x | d) & 0x08) << 2) | (flags_logic(&x) ^ ((Lanes)(x == 0x80) & (F_S|F_V))) | (~IS_ZERO(x) & F_C));
+            break;
+        case L_LSR:
+            x = reg[op->d] = d >> 1;
+            c = d & 1;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z|F_C, flags_shift(&x, &c));
+            break;
+        case L_ROR: {
+            // V from the carry going in, as do_ROR() has it
+            c = g->sreg & F_C;
+            x = reg[op->d] = (d >> 1) | (c << 7);
+            Lanes f = flags_shift(&x, &c);
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z|F_C, (f & ~F_C) | (d & 1));
+            break;
+        }
+        case L_ASR:
+            x = reg[op->d] = (Lanes)((SignedLanes)d >> 1);
+            c = d & 1;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z|F_C, flags_shift(&x, &c));
+            break;
+        case L_ADD:
+            x = reg[op->d] = d + r;
+            SET_FLAGS(g, 0x3f, flags_add(&d, &r, &x));
+            break;
+        case L_ADC:
+            x = reg[op->d] = d + r + (g->sreg & F_C);
+            SET_FLAGS(g, 0x3f, flags_add(&d, &r, &x));
+            break;
+        case L_SUB:
+            x = reg[op->d] = d - r;
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &r, &x, NULL));
+            break;
+        case L_SBC:
+            x = reg[op->d] = d - r - (g->sreg & F_C);
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &r, &x, &g->sreg));
+            break;
+        case L_CP:
+            x = d - r;
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &r, &x, NULL));
+            break;
+        case L_CPC:
+            x = d - r - (g->sreg & F_C);
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &r, &x, &g->sreg));
+            break;
+        case L_SUBI:
+            x = reg[op->d] = d - k;
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &k, &x, NULL));
+            break;
+        case L_SBCI:
+            x = reg[op->d] = d - k - (g->sreg & F_C);
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &k, &x, &g->sreg));
+            break;
+        case L_CPI:
+            x = d - k;
+            SET_FLAGS(g, 0x3f, flags_sub(&d, &k, &x, NULL));
+            break;
+        case L_AND:
+            x = reg[op->d] = d & r;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x));
+            break;
+        case L_ANDI:
+            x = reg[op->d] = d & k;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x));
+            break;
+        case L_OR:
+            x = reg[op->d] = d | r;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x));
+            break;
+        case L_ORI:
+            x = reg[op->d] = d | k;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x));
+            break;
+        case L_EOR:
+            x = reg[op->d] = d ^ r;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z, flags_logic(&x));
+            break;
+        case L_ADIW:
+        case L_SBIW: {
+            // Op.d is the word register number
+            Lanes lo = reg[24 + op->d*2];
+            Lanes hi = reg[25 + op->d*2];
+            Lanes xl, xh, v;
+            if (kind == L_ADIW) {
+                xl = lo + k;
+                xh = hi + ((Lanes)(xl < lo) & 1);
+                v = (~hi & xh) >> 7;
+                c = (~xh & hi) >> 7;
+            } else {
+                xl = lo - k;
+                xh = hi - ((Lanes)(lo < k) & 1);
+                v = (hi & ~xh) >> 7;
+                c = (xh & ~hi) >> 7;
+            }
+            reg[24 + op->d*2] = xl;
+            reg[25 + op->d*2] = xh;
+            Lanes n = xh >> 7;
+            SET_FLAGS(g, F_S|F_V|F_N|F_Z|F_C, ((n ^ v) << 4) | (v << 3) | (n << 2) | (IS_ZERO(xl | xh) & F_Z) | c);
+            break;
+        }
+        case L_RJMP:
+            g->pc += op->k;
+            break;
+        case L_JMP:
+            g->pc = op->k;
+            break;
+        case L_BRBS:
+            x = (g->sreg >> op->b) & 1;
+            fork_lanes(g, &x, g->pc + op->k, 1);
+            break;
+        case L_BRBC:
+            x = ((g->sreg >> op->b) & 1) ^ 1;
+            fork_lanes(g, &x, g->pc + op->k, 1);
+            break;
+        case L_CPSE:
+            x = (Lanes)(d == r) & 1;
+            fork_lanes(g, &x, g->pc + g->decoded[g->pc].length, g->decoded[g->pc].length);
+            break;
+        case L_SBRC:
+            x = ((reg[op->r] >> op->b) & 1) ^ 1;
+            fork_lanes(g, &x, g->pc + g->decoded[g->pc].length, g->decoded[g->pc].length);
+            break;
+        case L_SBRS:
+            x = (reg[op->r] >> op->b) & 1;
+            fork_lanes(g, &x, g->pc + g->decoded[g->pc].length, g->decoded[g->pc].length);
+            break;
+        case L_LPM: {
+            // LPM_1 has Op.d 0 for r0
+            u8 p = LockPtr[op->id];
+            FOR_LANES(g, l, m) {
+                u16 z = pair(g, p, l);
+                reg[op->d][l] = ((const u8 *)g->cpu[l]->flash->program)[z];
+                if (LockMode[op->id] == M_INC) {
+                    set_pair(g, p, l, z + 1);
+                }
+            }
+            break;
+        }
+        case L_LD:
+        case L_ST:
+        case L_LDS:
+        case L_STS:
+        case L_IN:
+        case L_OUT:
+        case L_PUSH:
+        case L_POP: {
+            bool load = kind == L_LD || kind == L_LDS || kind == L_IN || kind == L_POP;
+            if (kind == L_IN && op->k == SREG_ADDR) {
+                reg[op->d] = g->sreg;
+                break;
+            }
+            u8 p = LockPtr[op->id];
+            u8 mode = LockMode[op->id];
+            bool ok = true;
+            FOR_LANES(g, l, m) {
+                const Cpu *cpu = g->cpu[l];
+                switch (kind) {
+                case L_LD:
+                case L_ST:
+                    addr[l] = pair(g, p, l) + (mode == M_DEC ? -1 : mode == M_DISP ? op->k : 0);
+                    break;
+                case L_PUSH:
+                    addr[l] = cpu->data.SP;
+                    break;
+                case L_POP:
+                    addr[l] = cpu->data.SP + 1;
+                    break;
+                default:
+                    addr[l] = op->k;
+                    break;
+                }
+                ok &= plain(cpu, addr[l], load ? SLOW_READ : SLOW_WRITE);
+            }
+            if (!ok) {
+                // back up and let the handlers take the slow path
+                g->pc = pc;
+                g->cycle -= op->cycles;
+                scalar_op(g, op);
+                break;
+            }
+            FOR_LANES(g, l, m) {
+                Cpu *cpu = g->cpu[l];
+                if (load) {
+                    reg[op->d][l] = cpu->data._Bytes[addr[l]];
+                } else {
+                    store(cpu, addr[l], reg[kind == L_STS ? op->d : op->r][l]);
+                }
+                if (kind == L_PUSH) {
+                    cpu->data.SP--;
+                } else if (kind == L_POP) {
+                    cpu->data.SP++;
+                } else if (mode == M_INC) {
+                    set_pair(g, p, l, addr[l] + 1);
+                } else if (mode == M_DEC) {
+                    set_pair(g, p, l, addr[l]);
+                }
+            }
+            break;
+        }
+        case L_RCALL:
+        case L_CALL:
+        case L_RET: {
+            bool ok = true;
+            FOR_LANES(g, l, m) {
+                const Cpu *cpu = g->cpu[l];
+                if (kind == L_RET) {
+                    ok &= plain(cpu, cpu->data.SP + 1, SLOW_READ) && plain(cpu, cpu->data.SP + 2, SLOW_READ);
+                } else {
+                    ok &= plain(cpu, cpu->data.SP, SLOW_WRITE) && plain(cpu, cpu->data.SP - 1, SLOW_WRITE);
+                }
+            }
+            if (!ok) {
+                g->pc = pc;
+                g->cycle -= op->cycles;
+                scalar_op(g, op);
+                break;
+            }
+            if (kind == L_RET) {
+                FOR_LANES(g, l, m) {
+                    Cpu *cpu = g->cpu[l];
+                    addr[l] = cpu->data._Bytes[cpu->data.SP + 1] | (cpu->data._Bytes[cpu->data.SP + 2] << 8);
+                    cpu->data.SP += 2;
+                }
+                split_pcs(g, addr);
+                break;
+            }
+            FOR_LANES(g, l, m) {
+                Cpu *cpu = g->cpu[l];
+                store(cpu, cpu->data.SP--, g->pc >> 8);
+                store(cpu, cpu->data.SP--, g->pc & 0xff);
+            }
+            g->pc = kind == L_CALL ? op->k : g->pc + op->k;
+            break;
+        }
+        }
+    }
+}
+
+// Runs boards that share a flash in lockstep for as long as at least two
+// of them are at the same pc and cycle, running normally. Only boards that
+// start out with the first one take part. Each board is left ready for
+// cpu_run() to carry on alone: split off, halted, asleep or stopped.
+void cpu_lockstep(Cpu **cpus, int count)
+{
+    assert(count <= LOCKSTEP_LANES);
+    Group *g;
+    if (posix_memalign((void **)&g, LOCKSTEP_LANES, sizeof(Group)) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    memset(g, 0, sizeof(Group));
+    const Cpu *first = cpus[0];
+    g->pc = first->pc;
+    g->cycle = first->cycle;
+    g->decoded = first->flash->decoded[DECODE_PLAIN];
+    int l;
+    LaneMask m;
+    for (l = 0; l < count; l++) {
+        Cpu *cpu = cpus[l];
+        if (cpu->flash == first->flash && cpu->pc == g->pc && cpu->cycle == g->cycle && cpu->state == CPU_RUN) {
+            g->cpu[l] = cpu;
+            // skips in the handlers look at the next instruction
+            g->saved[l] = cpu->decoded;
+            cpu->decoded = g->decoded;
+            g->active |= 1ULL << l;
+            g->ones[l] = 1;
+            sync_in(g, l);
+        }
+    }
+    find_nextevent(g);
+    run_group(g);
+    FOR_LANES(g, l, m) {
+        sync_out(g, l);
+        leave(g, l);
+    }
+    free(g);
+}
+
+void lockstep_init()
+{
+    int i, j;
+    for (i = 0; i < InstructionCount; i++) {
+        for (j = 0; j < LENGTHOF(LockNames); j++) {
+            if (strcmp(Instructions[i].name, LockNames[j].name) == 0) {
+                LockKind[i] = LockNames[j].kind;
+                LockPtr[i] = LockNames[j].ptr;
+                LockMode[i] = LockNames[j].mode;
+            }
+        }
+    }
+}
@@ -0,0 +1,817 @@
+/*
+ * Multi-board network for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "network.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "loader.h"
+
+#include "core.h"
+
+#define MAX_LINE        1024
+#define DEFAULT_QUANTUM 10000
+#define BARRIER_SPINS   1000    // before giving the CPU away
+#define NEVER_QUANTUM   (~(u64)0)
+
+// Boards run a quantum of cycles at a time, all of them in step, and
+// nothing one board does can reach another until the next quantum. A
+// byte sent or pin changed on cycle t arrives on cycle t + quantum, so
+// the result is the same however the boards are spread over threads.
+//
+// Each thread keeps a run queue of its boards. One that is asleep, or
+// polling the USART with nothing to read, until past the next quantum is
+// parked in an idle set instead, and costs nothing until a message is
+// sent to it or the quantum of its next event comes round. A parked
+// board's clock stands still and catches up when it runs again: asleep,
+// it skips straight to the next event just as it would have a quantum
+// at a time, and polling, the cycles count as skipped.
+
+#define MSG_SERIAL  0   // a byte from the USART
+#define MSG_PIN     1   // an output pin changing
+
+typedef struct {
+    u64 when;           // cycle it was sent on, or is to be delivered on
+    u32 seq;            // arrival order, for ones due on the same cycle
+    u8 kind;            // MSG_*
+    u8 pin;
+    u8 value;           // byte, or pin state
+} Message;
+
+typedef struct {
+    Message *msgs;
+    int count;
+    int size;
+    u64 quantum;        // they were sent in
+} MessageList;
+
+typedef struct {
+    int from;
+    int to;
+    int kind;           // MSG_*
+    int frompin;
+    int topin;
+} Link;
+
+typedef struct {
+    char *name;
+    char *image;
+    Flash *flash;
+    bool shared;                // flash belongs to an earlier board on the same image
+    char *input;                // or NULL
+    char *output;               // or NULL
+    Cpu *cpu;
+    int inf;
+    FILE *out;
+    bool serialout;             // has a serial link from it
+    MessageList sent[2];        // by the parity of the quantum they were sent in
+    MessageList *sending;       // sent[] for this quantum
+    MessageList pending;        // received and not yet delivered
+    u32 seq;
+    u64 overruns;               // bytes that arrived to a full receive buffer
+    u64 halted;                 // quantum it halted in plus one, or 0
+    int *in;                    // links to it
+    int incount;
+    int *to;                    // boards it has links to
+    int tocount;
+    int worker;                 // thread it runs on
+    bool idle;                  // polling the USART with nothing to read
+    bool parked;
+    u64 wake;                   // quantum a parked board runs again in, or NEVER_QUANTUM
+    int woken[2];               // on its worker's woken list, by quantum parity
+} Board;
+
+typedef struct {
+    u64 quantum;
+    int board;
+} Alarm;
+
+typedef struct {
+    int *run;                   // boards to run in the next quantum
+    int runcount;
+    int *woken[2];              // boards sent something, by the parity of the quantum
+    int wokencount[2];
+    Alarm *alarms;              // heap of parked boards by the quantum they wake in
+    int alarmcount;
+    int alarmsize;
+    int boards;
+    int parked;
+    u64 switches;               // board quanta run
+    u64 parkedquanta;
+    u64 busyns;                 // in quanta, not waiting for the others
+    u64 runningns;              // of that, inside cpu_run()
+} Worker;
+
+static Board *Boards;
+static int BoardCount;
+static Link *Links;
+static int LinkCount;
+static u64 Quantum = DEFAULT_QUANTUM;
+static u64 Limit;               // cycles, or 0 to run until every board halts
+static bool SkipIdle = true;    // park boards polling for input
+static int ThreadCount;
+static Worker *Workers;
+static int HaltCount;
+static int Dormant;             // parked with nothing but a message to wake them
+static u64 FinishCycle;         // end of the last quantum
+
+static struct {
+    int arrived;
+    int phase;
+    bool done;                  // decided by the last to arrive
+} Barrier;
+
+static void append(MessageList *list, const Message *m)
+{
+    if (list->count == list->size) {
+        list->size = list->size > 0 ? 2 * list->size : 64;
+        list->msgs = realloc(list->msgs, list->size * sizeof(Message));
+        if (list->msgs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    list->msgs[list->count++] = *m;
+}
+
+static int find_board(const char *name, const char *fn, int line)
+{
+    int i;
+    for (i = 0; i < BoardCount; i++) {
+        if (strcmp(Boards[i].name, name) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "%s:%d: no board %s\n", fn, line, name);
+    exit(1);
+}
+
+// PB0..PD7
+static int parse_pin(const char *s, const char *fn, int line)
+{
+    int port = toupper((unsigned char)s[1]) - 'B';
+    if (toupper((unsigned char)s[0]) != 'P' || port < 0 || port > 2
+     || s[2] < '0' || s[2] > '7' || s[3] != 0) {
+        fprintf(stderr, "%s:%d: bad pin %s\n", fn, line, s);
+        exit(1);
+    }
+    return PIN_PORTB + 8*port + s[2] - '0';
+}
+
+static void add_link(int from, int to, int kind, int frompin, int topin)
+{
+    Links = realloc(Links, (LinkCount + 1) * sizeof(Link));
+    Board *dest = &Boards[to];
+    dest->in = realloc(dest->in, (dest->incount + 1) * sizeof(int));
+    Board *src = &Boards[from];
+    src->to = realloc(src->to, (src->tocount + 1) * sizeof(int));
+    if (Links == NULL || dest->in == NULL || src->to == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    Link *l = &Links[LinkCount];
+    l->from = from;
+    l->to = to;
+    l->kind = kind;
+    l->frompin = frompin;
+    l->topin = topin;
+    dest->in[dest->incount++] = LinkCount++;
+    int i;
+    for (i = 0; i < src->tocount && src->to[i] != to; i++) {
+    }
+    if (i == src->tocount) {
+        src->to[src->tocount++] = to;
+    }
+}
+
+static void add_board(const char *name, const char *image, const char *input, const char *output,
+    const char *fn, int line)
+{
+    int i;
+    for (i = 0; i < BoardCount; i++) {
+        if (strcmp(Boards[i].name, name) == 0) {
+            fprintf(stderr, "%s:%d: board %s already defined\n", fn, line, name);
+            exit(1);
+        }
+    }
+    Boards = realloc(Boards, (BoardCount + 1) * sizeof(Board));
+    if (Boards == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    Board *bd = &Boards[BoardCount++];
+    memset(bd, 0, sizeof(Board));
+    bd->name = strdup(name);
+    bd->image = strdup(image);
+    // boards running the same image share it
+    for (i = 0; i < BoardCount - 1; i++) {
+        if (strcmp(Boards[i].image, image) == 0) {
+            bd->flash = Boards[i].flash;
+            bd->shared = true;
+            break;
+        }
+    }
+    if (bd->flash == NULL) {
+        bd->flash = load_flash(image);
+    }
+    bd->input = input != NULL && strcmp(input, "-") != 0 ? strdup(input) : NULL;
+    bd->output = output != NULL && strcmp(output, "-") != 0 ? strdup(output) : NULL;
+}
+
+// One statement per line, and # starts a comment:
+//   board name image [input [output]]
+//   boards name n image [input]    n boards, name0 to name<n-1>
+//   serial from to             from's USART output to to's input
+//   pin from PB5 to PD2        from's output pin to to's input pin
+//   quantum cycles
+//   cycles n                   stop after n cycles
+//   idle skip|spin             park boards polling for input (the default),
+//                              or keep running them
+static void read_topology(const char *fn)
+{
+    FILE *f = fopen(fn, "r");
+    if (f == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    char s[MAX_LINE];
+    int line = 0;
+    while (fgets(s, sizeof(s), f)) {
+        line++;
+        char *hash = strchr(s, '#');
+        if (hash != NULL) {
+            *hash = 0;
+        }
+        char word[MAX_LINE], a[MAX_LINE], b[MAX_LINE], c[MAX_LINE], d[MAX_LINE];
+        int n = sscanf(s, "%s %s %s %s %s", word, a, b, c, d);
+        if (n <= 0) {
+            continue;
+        }
+        if (strcmp(word, "board") == 0 && n >= 3) {
+            add_board(a, b, n >= 4 ? c : NULL, n >= 5 ? d : NULL, fn, line);
+        } else if (strcmp(word, "boards") == 0 && (n == 4 || n == 5) && atoi(b) > 0) {
+            int count = atoi(b);
+            int i;
+            for (i = 0; i < count; i++) {
+                char name[MAX_LINE + 16];
+                snprintf(name, sizeof(name), "%s%d", a, i);
+                add_board(name, c, n >= 5 ? d : NULL, NULL, fn, line);
+            }
+        } else if (strcmp(word, "serial") == 0 && n == 3) {
+            int from = find_board(a, fn, line);
+            add_link(from, find_board(b, fn, line), MSG_SERIAL, 0, 0);
+            Boards[from].serialout = true;
+        } else if (strcmp(word, "pin") == 0 && n == 5) {
+            add_link(find_board(a, fn, line), find_board(c, fn, line), MSG_PIN,
+                parse_pin(b, fn, line), parse_pin(d, fn, line));
+        } else if (strcmp(word, "quantum") == 0 && n == 2 && strtoull(a, NULL, 0) > 0) {
+            Quantum = strtoull(a, NULL, 0);
+        } else if (strcmp(word, "cycles") == 0 && n == 2) {
+            Limit = strtoull(a, NULL, 0);
+        } else if (strcmp(word, "idle") == 0 && n == 2 && (strcmp(a, "skip") == 0 || strcmp(a, "spin") == 0)) {
+            SkipIdle = strcmp(a, "skip") == 0;
+        } else {
+            fprintf(stderr, "%s:%d: expected board, boards, serial, pin, quantum, cycles or idle\n", fn, line);
+            exit(1);
+        }
+    }
+    fclose(f);
+    if (BoardCount == 0) {
+        fprintf(stderr, "%s: no boards\n", fn);
+        exit(1);
+    }
+}
+
+static void send(Cpu *cpu, int kind, int pin, u8 value)
+{
+    Board *bd = cpu_get_context(cpu);
+    Message m = {cpu_get_cycles(cpu), 0, kind, pin, value};
+    append(bd->sending, &m);
+}
+
+static void serial_out(Cpu *cpu, u8 c)
+{
+    Board *bd = cpu_get_context(cpu);
+    if (bd->out != NULL) {
+        fputc(c, bd->out);
+    }
+    if (bd->serialout) {
+        send(cpu, MSG_SERIAL, 0, c);
+    }
+}
+
+static void pin_out(Cpu *cpu, int pin, bool state)
+{
+    send(cpu, MSG_PIN, pin, state);
+}
+
+static int compare_messages(const void *a, const void *b)
+{
+    const Message *x = a, *y = b;
+    if (x->when != y->when) {
+        return x->when < y->when ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Picks up what was sent to the board in the last quantum.
+static void receive(int i, u64 quantum)
+{
+    Board *bd = &Boards[i];
+    int before = bd->pending.count;
+    int l;
+    for (l = 0; l < bd->incount; l++) {
+        Link *link = &Links[bd->in[l]];
+        const MessageList *sent = &Boards[link->from].sent[(quantum - 1) & 1];
+        if (sent->quantum != quantum - 1) {
+            // left from before the sender was parked
+            continue;
+        }
+        int j;
+        for (j = 0; j < sent->count; j++) {
+            const Message *m = &sent->msgs[j];
+            if (m->kind == link->kind && (m->kind == MSG_SERIAL || m->pin == link->frompin)) {
+                Message r = *m;
+                r.when += Quantum;
+                r.seq = bd->seq++;
+                r.pin = link->topin;
+                append(&bd->pending, &r);
+            }
+        }
+    }
+    if (bd->pending.count > before) {
+        qsort(bd->pending.msgs, bd->pending.count, sizeof(Message), compare_messages);
+    }
+}
+
+// Hands the board everything due by its current cycle.
+static void deliver(Board *bd)
+{
+    u64 cycle = cpu_get_cycles(bd->cpu);
+    int n = 0;
+    while (n < bd->pending.count && bd->pending.msgs[n].when <= cycle) {
+        const Message *m = &bd->pending.msgs[n++];
+        if (m->kind == MSG_PIN) {
+            cpu_set_pin(bd->cpu, m->pin, m->value);
+        } else if (cpu_usart_receive(bd->cpu, &m->value, 1) == 0) {
+            bd->overruns++;
+        }
+    }
+    if (n > 0) {
+        bd->pending.count -= n;
+        memmove(bd->pending.msgs, bd->pending.msgs + n, bd->pending.count * sizeof(Message));
+    }
+}
+
+static u64 now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void push_alarm(Worker *w, u64 quantum, int board)
+{
+    if (w->alarmcount == w->alarmsize) {
+        w->alarmsize = w->alarmsize > 0 ? 2 * w->alarmsize : 64;
+        w->alarms = realloc(w->alarms, w->alarmsize * sizeof(Alarm));
+        if (w->alarms == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    int i = w->alarmcount++;
+    while (i > 0 && w->alarms[(i - 1) / 2].quantum > quantum) {
+        w->alarms[i] = w->alarms[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->alarms[i].quantum = quantum;
+    w->alarms[i].board = board;
+}
+
+static Alarm pop_alarm(Worker *w)
+{
+    Alarm top = w->alarms[0];
+    Alarm last = w->alarms[--w->alarmcount];
+    int i = 0;
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= w->alarmcount) {
+            break;
+        }
+        if (c + 1 < w->alarmcount && w->alarms[c + 1].quantum < w->alarms[c].quantum) {
+            c++;
+        }
+        if (last.quantum <= w->alarms[c].quantum) {
+            break;
+        }
+        w->alarms[i] = w->alarms[c];
+        i = c;
+    }
+    w->alarms[i] = last;
+    return top;
+}
+
+// Puts the board in the idle set until the quantum wake.
+static void park(Worker *w, int i, u64 wake)
+{
+    Board *bd = &Boards[i];
+    bd->parked = true;
+    bd->wake = wake;
+    w->parked++;
+    if (wake == NEVER_QUANTUM) {
+        __atomic_add_fetch(&Dormant, 1, __ATOMIC_RELAXED);
+    } else {
+        push_alarm(w, wake, i);
+    }
+}
+
+static void unpark(Worker *w, int i)
+{
+    Board *bd = &Boards[i];
+    if (!bd->parked) {
+        return;
+    }
+    bd->parked = false;
+    w->parked--;
+    if (bd->wake == NEVER_QUANTUM) {
+        __atomic_sub_fetch(&Dormant, 1, __ATOMIC_RELAXED);
+    }
+    w->run[w->runcount++] = i;
+}
+
+// Makes sure the board runs in the quantum after this one, to pick up
+// what has been sent to it. Called from any thread.
+static void wake(int i, u64 quantum)
+{
+    Board *bd = &Boards[i];
+    int p = quantum & 1;
+    if (__atomic_exchange_n(&bd->woken[p], 1, __ATOMIC_RELAXED) == 0) {
+        Worker *w = &Workers[bd->worker];
+        w->woken[p][__atomic_fetch_add(&w->wokencount[p], 1, __ATOMIC_RELAXED)] = i;
+    }
+}
+
+// Brings back the parked boards that have something to do in the quantum.
+static void wake_boards(Worker *w, u64 quantum)
+{
+    int p = (quantum - 1) & 1;
+    int n = __atomic_load_n(&w->wokencount[p], __ATOMIC_RELAXED);
+    int k;
+    for (k = 0; k < n; k++) {
+        int i = w->woken[p][k];
+        __atomic_store_n(&Boards[i].woken[p], 0, __ATOMIC_RELAXED);
+        unpark(w, i);
+    }
+    __atomic_store_n(&w->wokencount[p], 0, __ATOMIC_RELAXED);
+    while (w->alarmcount > 0 && w->alarms[0].quantum <= quantum) {
+        Alarm a = pop_alarm(w);
+        // one woken early by a message may have parked again since
+        if (Boards[a.board].parked && Boards[a.board].wake == a.quantum) {
+            unpark(w, a.board);
+        }
+    }
+}
+
+// The cycle the quantum ends at, cut short by the limit in the last one.
+static u64 quantum_end(u64 quantum)
+{
+    u64 end = (quantum + 1) * Quantum;
+    return Limit > 0 && end > Limit ? Limit : end;
+}
+
+// Runs the board for the quantum, and returns whether it is to run in the
+// next one too rather than having halted or been parked.
+static bool run_quantum(Worker *w, int i, u64 quantum)
+{
+    Board *bd = &Boards[i];
+    Cpu *cpu = bd->cpu;
+    bd->sending = &bd->sent[quantum & 1];
+    bd->sending->count = 0;
+    bd->sending->quantum = quantum;
+    if (quantum > 0) {
+        receive(i, quantum);
+    }
+    u64 end = quantum_end(quantum);
+    u64 start = now_ns();
+    int state = cpu_get_state(cpu);
+    while (state != CPU_HALT && state != CPU_FAULT) {
+        deliver(bd);
+        if (cpu_get_cycles(cpu) >= end) {
+            break;
+        }
+        u64 next = bd->pending.count > 0 && bd->pending.msgs[0].when < end ? bd->pending.msgs[0].when : end;
+        cpu_stop_at(cpu, next);
+        do {
+            state = cpu_run(cpu);
+        } while (state == CPU_RUN || state == CPU_SLEEP);
+        // stopping early means polling for input, and nothing happens
+        // until the next message or event
+        bd->idle = state == CPU_STOP && cpu_get_cycles(cpu) < next;
+        if (bd->idle) {
+            cpu_idle_until(cpu, next);
+        }
+    }
+    w->runningns += now_ns() - start;
+    w->switches++;
+    if (bd->sending->count > 0) {
+        int k;
+        for (k = 0; k < bd->tocount; k++) {
+            wake(bd->to[k], quantum);
+        }
+    }
+    if (state == CPU_HALT || state == CPU_FAULT) {
+        __atomic_store_n(&bd->halted, quantum + 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&HaltCount, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    // input from a file turns up whenever it does, so only boards without
+    // one can wait unseen
+    if (bd->inf < 0 && (bd->idle || cpu_is_asleep(cpu))) {
+        u64 next = cpu_next_event(cpu);
+        if (bd->pending.count > 0 && bd->pending.msgs[0].when < next) {
+            next = bd->pending.msgs[0].when;
+        }
+        u64 wake = next != ~(u64)0 ? next / Quantum : NEVER_QUANTUM;
+        if (wake > quantum + 1) {
+            park(w, i, wake);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether the network is done after the quantum: past the cycle limit, or
+// every board halted or parked with nothing in flight to wake it. Only
+// called while every thread is waiting at the barrier.
+static bool finished(u64 quantum)
+{
+    if (Limit > 0 && (quantum + 1) * Quantum >= Limit) {
+        return true;
+    }
+    int halted = __atomic_load_n(&HaltCount, __ATOMIC_RELAXED);
+    int dormant = __atomic_load_n(&Dormant, __ATOMIC_RELAXED);
+    if (halted + dormant < BoardCount) {
+        return false;
+    }
+    int t;
+    for (t = 0; t < ThreadCount; t++) {
+        if (__atomic_load_n(&Workers[t].wokencount[quantum & 1], __ATOMIC_RELAXED) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Waits for every thread to finish the quantum, spinning for a while
+// first since the others are usually not far behind, and returns whether
+// the network is finished.
+static bool barrier_wait(u64 quantum)
+{
+    int phase = __atomic_load_n(&Barrier.phase, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&Barrier.arrived, 1, __ATOMIC_ACQ_REL) == ThreadCount) {
+        Barrier.done = finished(quantum);
+        if (Barrier.done) {
+            FinishCycle = quantum_end(quantum);
+        }
+        __atomic_store_n(&Barrier.arrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&Barrier.phase, phase + 1, __ATOMIC_RELEASE);
+        return Barrier.done;
+    }
+    int spins = 0;
+    while (__atomic_load_n(&Barrier.phase, __ATOMIC_ACQUIRE) == phase) {
+        if (++spins == BARRIER_SPINS) {
+            sched_yield();
+            spins = 0;
+        }
+    }
+    return Barrier.done;
+}
+
+static void *worker(void *arg)
+{
+    Worker *w = &Workers[(long)arg];
+    u64 quantum;
+    for (quantum = 0; ; quantum++) {
+        u64 start = now_ns();
+        if (quantum > 0) {
+            wake_boards(w, quantum);
+        }
+        int n = 0;
+        int k;
+        for (k = 0; k < w->runcount; k++) {
+            int i = w->run[k];
+            if (run_quantum(w, i, quantum)) {
+                w->run[n++] = i;
+            }
+        }
+        w->runcount = n;
+        w->parkedquanta += w->parked;
+        w->busyns += now_ns() - start;
+        if (barrier_wait(quantum)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static u64 now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long resident_bytes()
+{
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%*d %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Runs the boards in the topology file wired together, on threads
+// threads (0 for one per CPU) with the given engine, until every board
+// halts or waits for input that can never come, or the cycle limit is
+// reached. Returns the number of boards that didn't halt cleanly.
+int network_run(const char *topology, int threads, int engine)
+{
+    if (engine != CPU_ENGINE_INTERP && !jit_available()) {
+        fprintf(stderr, "JIT engine not available on this platform\n");
+        exit(1);
+    }
+    read_topology(topology);
+    long before = resident_bytes();
+    int i;
+    for (i = 0; i < BoardCount; i++) {
+        Board *bd = &Boards[i];
+        bd->cpu = cpu_new(bd->flash);
+        cpu_set_engine(bd->cpu, engine);
+        cpu_set_context(bd->cpu, bd);
+        bd->inf = -1;
+        if (bd->input != NULL) {
+            bd->inf = open(bd->input, O_RDONLY);
+            if (bd->inf < 0) {
+                perror(bd->input);
+                exit(1);
+            }
+        }
+        cpu_usart_set_input(bd->cpu, bd->inf);
+        cpu_usart_stop_idle(bd->cpu, SkipIdle && bd->inf < 0);
+        if (bd->output != NULL) {
+            bd->out = fopen(bd->output, "wb");
+            if (bd->out == NULL) {
+                perror(bd->output);
+                exit(1);
+            }
+        }
+        cpu_usart_callback(bd->cpu, serial_out);
+    }
+    for (i = 0; i < LinkCount; i++) {
+        if (Links[i].kind == MSG_PIN) {
+            cpu_pin_callback(Boards[Links[i].from].cpu, Links[i].frompin, pin_out);
+        }
+    }
+    long perboard = BoardCount > 0 ? (resident_bytes() - before) / BoardCount : 0;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > BoardCount) {
+        threads = BoardCount;
+    }
+    ThreadCount = threads;
+    Workers = calloc(threads, sizeof(Worker));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (Workers == NULL || tids == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < BoardCount; i++) {
+        Boards[i].worker = i % threads;
+        Workers[i % threads].boards++;
+    }
+    for (i = 0; i < threads; i++) {
+        Worker *w = &Workers[i];
+        w->run = malloc(w->boards * sizeof(int));
+        w->woken[0] = malloc(w->boards * sizeof(int));
+        w->woken[1] = malloc(w->boards * sizeof(int));
+        if (w->run == NULL || w->woken[0] == NULL || w->woken[1] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    for (i = 0; i < BoardCount; i++) {
+        Worker *w = &Workers[Boards[i].worker];
+        w->run[w->runcount++] = i;
+    }
+
+    u64 start = now_us();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, worker, (void *)(long)i) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    u64 wallus = now_us() - start;
+
+    int failed = 0;
+    u64 total = 0;
+    for (i = 0; i < BoardCount; i++) {
+        Board *bd = &Boards[i];
+        if (bd->parked) {
+            // catch up with the others
+            cpu_stop_at(bd->cpu, FinishCycle);
+            if (cpu_is_asleep(bd->cpu)) {
+                cpu_run(bd->cpu);
+            } else {
+                cpu_idle_until(bd->cpu, FinishCycle);
+            }
+        }
+        u64 cycles = cpu_get_cycles(bd->cpu);
+        total += cycles;
+        int state = cpu_get_state(bd->cpu);
+        fprintf(stderr, "%s: %s at cycle %llu", bd->name,
+            state == CPU_FAULT ? cpu_get_fault(bd->cpu) : bd->halted ? "halted"
+            : bd->parked && bd->wake == NEVER_QUANTUM ? "idle" : "running", cycles);
+        if (bd->overruns > 0) {
+            fprintf(stderr, ", %llu bytes overrun", bd->overruns);
+        }
+        fprintf(stderr, "\n");
+        if (!bd->halted || state == CPU_FAULT) {
+            failed++;
+        }
+        cpu_free(bd->cpu);
+        if (bd->inf >= 0) {
+            close(bd->inf);
+        }
+        if (bd->out != NULL) {
+            fclose(bd->out);
+        }
+        if (!bd->shared) {
+            flash_release(bd->flash);
+        }
+        free(bd->sent[0].msgs);
+        free(bd->sent[1].msgs);
+        free(bd->pending.msgs);
+        free(bd->in);
+        free(bd->to);
+        free(bd->name);
+        free(bd->image);
+        free(bd->input);
+        free(bd->output);
+    }
+    fprintf(stderr, "network: %d boards, %d threads, quantum %llu, %.3f s, %.1f Mcycles/s\n",
+        BoardCount, threads, Quantum, wallus / 1e6, wallus > 0 ? (double)total / wallus : 0.0);
+    u64 switches = 0, parked = 0, overheadns = 0;
+    for (i = 0; i < threads; i++) {
+        Worker *w = &Workers[i];
+        switches += w->switches;
+        parked += w->parkedquanta;
+        overheadns += w->busyns - w->runningns;
+        free(w->run);
+        free(w->woken[0]);
+        free(w->woken[1]);
+        free(w->alarms);
+    }
+    fprintf(stderr, "network: %llu board quanta run, %llu parked, %.0f ns a switch, %ld bytes a board\n",
+        switches, parked, switches > 0 ? (double)overheadns / switches : 0.0, perboard);
+    free(Workers);
+    free(Boards);
+    free(Links);
+    free(tids);
+    return failed;
+}
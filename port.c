@@ -22,7 +22,7 @@
 
 #include <stdio.h>
 
-#include "cpu.h"
+#include "core.h"
 
 #define PORT_BASE   0x23
 
@@ -30,73 +30,69 @@
 #define INDEX_DDR   1
 #define INDEX_PORT  2
 
-u8 PIN[3];
-u8 DDR[3];
-u8 PORT[3];
-
 inline int port(u16 addr)
 {
     return (addr - PORT_BASE) / 3;
 }
 
-u8 port_pin_read(u16 addr)
+u8 port_pin_read(Cpu *cpu, u16 addr)
 {
     int p = port(addr);
-    return (PIN[p] & ~DDR[p]) | (PORT[p] & DDR[p]);
+    return (cpu->port.pin[p] & ~cpu->port.ddr[p]) | (cpu->port.port[p] & cpu->port.ddr[p]);
 }
 
-void port_pin_write(u16 addr, u8 value)
+void port_pin_write(Cpu *cpu, u16 addr, u8 value)
 {
     int p = port(addr);
-    PORT[p] ^= value;
+    cpu->port.port[p] ^= value;
 }
 
-u8 port_ddr_read(u16 addr)
+u8 port_ddr_read(Cpu *cpu, u16 addr)
 {
     int p = port(addr);
-    return DDR[p];
+    return cpu->port.ddr[p];
 }
 
-void port_ddr_write(u16 addr, u8 value)
+void port_ddr_write(Cpu *cpu, u16 addr, u8 value)
 {
     int p = port(addr);
-    DDR[p] = value;
+    cpu->port.ddr[p] = value;
 }
 
-u8 port_data_read(u16 addr)
+u8 port_data_read(Cpu *cpu, u16 addr)
 {
     int p = port(addr);
-    return PORT[p];
+    return cpu->port.port[p];
 }
 
-void port_data_write(u16 addr, u8 value)
+void port_data_write(Cpu *cpu, u16 addr, u8 value)
 {
     int p = port(addr);
-    u8 prev = PORT[p];
-    PORT[p] = value;
-    u8 diff = (prev ^ PORT[p]) & DDR[p];
+    u8 prev = cpu->port.port[p];
+    cpu->port.port[p] = value;
+    u8 diff = (prev ^ cpu->port.port[p]) & cpu->port.ddr[p];
     int pin = 7;
     u8 bit;
     for (bit = 0x80; bit != 0; bit >>= 1, pin--) {
         if (diff & bit) {
-            out_pin(PIN_PORTB+8*p+pin, (PORT[p] & bit) != 0);
+            out_pin(cpu, PIN_PORTB+8*p+pin, (cpu->port.port[p] & bit) != 0);
         }
     }
 }
 
-void port_pin(int pin, bool state)
+void port_pin(Cpu *cpu, int pin, bool state)
 {
     if (pin >= PIN_PORTB && pin < PIN_PORTB+8) {
         int p = pin - PIN_PORTB;
-        PIN[0] = (PIN[0] & ~BIT(p)) | ((state ? 1 : 0) << p);
+        cpu->port.pin[0] = (cpu->port.pin[0] & ~BIT(p)) | ((state ? 1 : 0) << p);
     }
     if (pin >= PIN_PORTC && pin < PIN_PORTC+8) {
         int p = pin - PIN_PORTC;
-        PIN[1] = (PIN[1] & ~BIT(p)) | ((state ? 1 : 0) << p);
+        cpu->port.pin[1] = (cpu->port.pin[1] & ~BIT(p)) | ((state ? 1 : 0) << p);
     }
     if (pin >= PIN_PORTD && pin < PIN_PORTD+8) {
         int p = pin - PIN_PORTD;
-        PIN[2] = (PIN[2] & ~BIT(p)) | ((state ? 1 : 0) << p);
+        cpu->port.pin[2] = (cpu->port.pin[2] & ~BIT(p)) | ((state ? 1 : 0) << p);
     }
 }
 
@@ -18,7 +18,18 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "util.h"
+#ifndef __PORT_H
+#define __PORT_H
+
+#include "cpu.h"
+
+typedef struct {
+    u8 pin[3];
+    u8 ddr[3];
+    u8 port[3];
+} PortState;
 
 void port_init();
-void port_pin(int pin, bool state);
+void port_pin(Cpu *cpu, int pin, bool state);
+
+#endif // __PORT_H
@@ -0,0 +1,195 @@
+/*
+ * Machine state files for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "state.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "core.h"
+
+#define STATE_MAGIC     "emulino"
+#define STATE_VERSION   1
+
+// A state file is this struct as it sits in memory, so loading one is a
+// matter of mapping it and checking the header. Fields are ordered by
+// size to leave no padding; size catches a file written by a build that
+// lays the struct out differently.
+typedef struct {
+    char magic[8];
+    u64 version;
+    u64 size;
+    u64 flashhash;              // Flash.hash of the program it was running
+    u64 cycle;
+    u64 skippedcycles;
+    u64 sleepcycles;
+    u64 pendingirq;
+    u64 eventwhen[MAX_EVENTS];
+    u16 pc;
+    u16 eear;
+    u8 eventid[MAX_EVENTS];     // by event_id()
+    u8 eventcount;
+    u8 state;
+    u8 eecr;
+    u8 eedr;
+    u8 ucsra;
+    u8 ucsrb;
+    LazyFlags lazy;
+    PortState port;
+    u8 data[DATA_SIZE_BYTES];
+    u8 eeprom[EEPROM_SIZE];
+} StateFile;
+
+void state_save(Cpu *cpu, const char *fn)
+{
+    Snapshot *snap = cpu_snapshot(cpu);
+    StateFile *sf = calloc(1, sizeof(StateFile));
+    if (sf == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memcpy(sf->magic, STATE_MAGIC, sizeof(sf->magic));
+    sf->version = STATE_VERSION;
+    sf->size = sizeof(StateFile);
+    sf->flashhash = snap->flash->hash;
+    sf->cycle = snap->cycle;
+    sf->skippedcycles = snap->skippedcycles;
+    sf->sleepcycles = snap->sleepcycles;
+    sf->pendingirq = snap->pendingirq;
+    int i;
+    for (i = 0; i < snap->eventcount; i++) {
+        int id = event_id(snap->events[i].f);
+        if (id < 0) {
+            fprintf(stderr, "emulino: %s: pending event was not registered\n", fn);
+            exit(1);
+        }
+        sf->eventwhen[i] = snap->events[i].when;
+        sf->eventid[i] = id;
+    }
+    sf->eventcount = snap->eventcount;
+    sf->pc = snap->pc;
+    sf->state = snap->state;
+    sf->lazy = snap->lazy;
+    sf->port = snap->port;
+    sf->eecr = snap->eeprom.eecr;
+    sf->eedr = snap->eeprom.eedr;
+    sf->eear = snap->eeprom.eear;
+    sf->ucsra = snap->ucsra;
+    sf->ucsrb = snap->ucsrb;
+    memcpy(sf->data, snap->data._Bytes, DATA_SIZE_BYTES);
+    memcpy(sf->eeprom, snap->eeprom.eeprom, EEPROM_SIZE);
+    snapshot_free(snap);
+
+    FILE *f = fopen(fn, "wb");
+    if (f == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    if (fwrite(sf, sizeof(StateFile), 1, f) != 1 || fclose(f) != 0) {
+        perror(fn);
+        exit(1);
+    }
+    free(sf);
+}
+
+static void bad_state(const char *fn, const char *why)
+{
+    fprintf(stderr, "emulino: %s: %s\n", fn, why);
+    exit(1);
+}
+
+void state_load(Cpu *cpu, const char *fn)
+{
+    fprintf(stderr, "emulino: Loading state: %s\n", fn);
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        perror(fn);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(fn);
+        exit(1);
+    }
+    if (st.st_size != sizeof(StateFile)) {
+        bad_state(fn, "not a state file for this build");
+    }
+    const StateFile *sf = mmap(NULL, sizeof(StateFile), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (sf == MAP_FAILED) {
+        perror(fn);
+        exit(1);
+    }
+    close(fd);
+    if (memcmp(sf->magic, STATE_MAGIC, sizeof(sf->magic)) != 0) {
+        bad_state(fn, "not a state file");
+    }
+    if (sf->version != STATE_VERSION || sf->size != sizeof(StateFile)) {
+        bad_state(fn, "not a state file for this build");
+    }
+    if (sf->flashhash != cpu->flash->hash) {
+        bad_state(fn, "saved from a different program");
+    }
+    if (sf->eventcount > MAX_EVENTS) {
+        bad_state(fn, "corrupt event list");
+    }
+
+    // the snapshot is never one the board has seen (serial 0), so
+    // cpu_restore() copies all of it
+    Snapshot *snap = calloc(1, sizeof(Snapshot));
+    if (snap == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    snap->flash = cpu->flash;
+    int i;
+    for (i = 0; i < sf->eventcount; i++) {
+        snap->events[i].when = sf->eventwhen[i];
+        snap->events[i].f = event_function(sf->eventid[i]);
+        if (snap->events[i].f == NULL) {
+            bad_state(fn, "corrupt event list");
+        }
+    }
+    snap->eventcount = sf->eventcount;
+    snap->cycle = sf->cycle;
+    snap->skippedcycles = sf->skippedcycles;
+    snap->sleepcycles = sf->sleepcycles;
+    snap->pendingirq = sf->pendingirq;
+    snap->pc = sf->pc;
+    snap->state = sf->state;
+    snap->lazy = sf->lazy;
+    snap->port = sf->port;
+    snap->eeprom.eecr = sf->eecr;
+    snap->eeprom.eedr = sf->eedr;
+    snap->eeprom.eear = sf->eear;
+    snap->ucsra = sf->ucsra;
+    snap->ucsrb = sf->ucsrb;
+    memcpy(snap->data._Bytes, sf->data, DATA_SIZE_BYTES);
+    memcpy(snap->eeprom.eeprom, sf->eeprom, EEPROM_SIZE);
+    munmap((void *)sf, sizeof(StateFile));
+    cpu_restore(cpu, snap);
+    snapshot_free(snap);
+}
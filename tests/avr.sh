@@ -0,0 +1,77 @@
+# Encoders for the AVR instructions the tests use, sourced by them. Each
+# prints its instruction as little endian hex, so a program is the string
+# of them run together. Registers are plain numbers, and branch offsets are
+# in words from the next instruction, as in the instruction set manual.
+
+w() { printf '%02x%02x' $(($1 & 0xff)) $(($1 >> 8 & 0xff)); }
+words() { echo $((${#1} / 4)); }
+image() { printf "$(echo "$2" | sed 's/../\\x&/g')" > "$1"; }
+
+rr() { w $(($1 | ($3 & 0x10) << 5 | $2 << 4 | ($3 & 0xf))); }
+ADD() { rr 0x0c00 $1 $2; }
+ADC() { rr 0x1c00 $1 $2; }
+SUB() { rr 0x1800 $1 $2; }
+SBC() { rr 0x0800 $1 $2; }
+CP() { rr 0x1400 $1 $2; }
+CPC() { rr 0x0400 $1 $2; }
+AND() { rr 0x2000 $1 $2; }
+OR() { rr 0x2800 $1 $2; }
+EOR() { rr 0x2400 $1 $2; }
+MOV() { rr 0x2c00 $1 $2; }
+
+ri() { w $(($1 | ($3 & 0xf0) << 4 | ($2 - 16) << 4 | ($3 & 0xf))); }
+LDI() { ri 0xe000 $1 $2; }
+CPI() { ri 0x3000 $1 $2; }
+SUBI() { ri 0x5000 $1 $2; }
+SBCI() { ri 0x4000 $1 $2; }
+ANDI() { ri 0x7000 $1 $2; }
+ORI() { ri 0x6000 $1 $2; }
+
+INC() { w $((0x9403 | $1 << 4)); }
+DEC() { w $((0x940a | $1 << 4)); }
+PUSH() { w $((0x920f | $1 << 4)); }
+POP() { w $((0x900f | $1 << 4)); }
+ADIW() { w $((0x9600 | ($2 & 0x30) << 2 | ($1 - 24) / 2 << 4 | ($2 & 0xf))); }
+SBIW() { w $((0x9700 | ($2 & 0x30) << 2 | ($1 - 24) / 2 << 4 | ($2 & 0xf))); }
+IN() { w $((0xb000 | ($2 & 0x30) << 5 | $1 << 4 | ($2 & 0xf))); }
+OUT() { w $((0xb800 | ($1 & 0x30) << 5 | $2 << 4 | ($1 & 0xf))); }
+LDS() { w $((0x9000 | $1 << 4)); w $2; }
+STS() { w $((0x9200 | $2 << 4)); w $1; }
+# ld Rd,X+ and st X+,Rr
+LDX() { w $((0x900d | $1 << 4)); }
+STX() { w $((0x920d | $1 << 4)); }
+
+BRBS() { w $((0xf000 | ($2 & 0x7f) << 3 | $1)); }
+BRBC() { w $((0xf400 | ($2 & 0x7f) << 3 | $1)); }
+BREQ() { BRBS 1 $1; }
+BRNE() { BRBC 1 $1; }
+RJMP() { w $((0xc000 | ($1 & 0xfff))); }
+JMP() { w 0x940c; w $1; }
+CALL() { w 0x940e; w $1; }
+
+NOP() { w 0x0000; }
+SEI() { w 0x9478; }
+CLI() { w 0x94f8; }
+RET() { w 0x9508; }
+RETI() { w 0x9518; }
+# emulino faults on a break
+BREAK() { w 0x9598; }
+# emulino stops at a jump to itself
+HALT() { CLI; RJMP -1; }
+
+SREG=0x3f
+UDR0=0xc6
+
+# jmp main, the timer overflow vector jumping to isr if there is one, and
+# reti for every other vector, filling the table up to word 0x28
+vectors() {
+    JMP $1
+    local v
+    for v in $(seq 2 2 38); do
+        if [ $v = 32 ] && [ -n "$2" ]; then
+            JMP $2
+        else
+            RETI; RETI
+        fi
+    done
+}
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Checks the countdown loops the interpreter runs arithmetically, SBIW/BRNE,
+# SUBI/SBCI/BRNE and DEC/BRNE, against the JIT engines, which run the plain
+# decoding and go round every time: the cycles and registers must come out
+# the same. The timer interrupt lands partway through the loops, sending
+# their counters, so skipping up to it must leave them where going round
+# would have.
+#
+# usage: tests/delay-loops.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+. "$(dirname "$0")/avr.sh"
+
+# isr: send the loop counters, and count in r31, with SREG saved on the stack
+ISR=$(PUSH 0; IN 0 $SREG; PUSH 0)
+for r in 24 25 20 21 22; do
+    ISR+=$(STS $UDR0 $r)
+done
+ISR+=$(INC 31; POP 0; OUT $SREG 0; POP 0; RETI)
+INIT=$(LDI 26 0; SEI)
+MAIN=$((0x28 + $(words $ISR)))
+LOOP=$((MAIN + $(words $INIT)))
+PROGRAM=$(vectors $MAIN 0x28)$ISR$INIT
+# the counts go up with r26 each time round
+PROGRAM+=$(MOV 24 26; LDI 25 1; SBIW 24 1; BRNE -2)
+PROGRAM+=$(MOV 20 26; LDI 21 2; SUBI 20 1; SBCI 21 0; BRNE -3)
+PROGRAM+=$(MOV 22 26; DEC 22; BRNE -2)
+PROGRAM+=$(IN 0 $SREG)
+for r in 0 24 25 20 21 22; do
+    PROGRAM+=$(STS $UDR0 $r)
+done
+# 256 times round, then send the interrupt count and halt
+PROGRAM+=$(INC 26; BREQ 2; JMP $LOOP; STS $UDR0 31; HALT)
+image "$TMP/delay.bin" "$PROGRAM"
+
+status=0
+expected=
+for engine in interp jit diff; do
+    "$EMULINO" --engine=$engine --fusion-report "$TMP/delay.bin" < /dev/null > "$TMP/$engine.out" 2> "$TMP/$engine.err"
+    result="$(grep '^cycles:' "$TMP/$engine.err") output $(md5sum < "$TMP/$engine.out" | cut -c1-16)"
+    echo "$engine $result, $(wc -c < "$TMP/$engine.out") bytes"
+    if [ -z "$expected" ]; then
+        expected=$result
+    elif [ "$result" != "$expected" ]; then
+        status=1
+    fi
+done
+# and the interpreter did skip them
+for loop in SBIW/BRNE SUBI/SBCI DEC/BRNE; do
+    executed=$(awk -v f=$loop '$1 == f && $2 == "loop" { print $4 }' "$TMP/interp.err")
+    echo "$loop loop executed ${executed:-0} times"
+    if [ "${executed:-0}" = 0 ]; then
+        status=1
+    fi
+done
+grep '^skipped in delay loops:' "$TMP/interp.err" || status=1
+[ $status = 0 ] && echo ok || echo FAILED
+exit $status
@@ -0,0 +1,71 @@
+#!/bin/bash
+# Checks that the superinstructions the interpreter fuses at load time do
+# what the instructions they stand for do: the JIT engines run the plain
+# decoding, so every engine must send the same output and take the same
+# cycles. The loop's length against the timer period puts the interrupt
+# inside each fused sequence on the way round.
+#
+# usage: tests/fusion.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+. "$(dirname "$0")/avr.sh"
+
+# isr: send the registers the loop changes, so where in a fused sequence
+# it was taken shows, and count in r31, with SREG saved on the stack
+ISR=$(PUSH 0; IN 0 $SREG; PUSH 0)
+for r in 18 19 20 21 2 3 4 5 6 7 8 9 10 11; do
+    ISR+=$(STS $UDR0 $r)
+done
+ISR+=$(INC 31; POP 0; OUT $SREG 0; POP 0; RETI)
+INIT=$(LDI 20 0x5a; LDI 21 0xa5; LDI 26 0; LDI 27 0; SEI)
+MAIN=$((0x28 + $(words $ISR)))
+LOOP=$((MAIN + $(words $INIT)))
+PROGRAM=$(vectors $MAIN 0x28)$ISR$INIT
+# LDI/LDI
+BODY=$(LDI 18 0x37; LDI 19 0xc5)
+# SUBI/SBCI
+BODY+=$(SUBI 20 0x13; SBCI 21 0x02)
+# ADD/ADC, with one and with three ADCs
+BODY+=$(ADD 2 20; ADC 3 21)
+BODY+=$(ADD 2 20; ADC 3 21; ADC 4 18; ADC 5 19)
+# CP/CPC/BRNE, with one and with three CPCs
+BODY+=$(CP 20 2; CPC 21 3; BRNE 1; INC 6)
+BODY+=$(CP 2 20; CPC 3 21; CPC 4 18; CPC 5 19; BRNE 1; INC 7)
+BODY+=$(CP 26 26; CPC 27 27; BRNE 1; INC 12)
+# PUSH/PUSH and POP/POP
+BODY+=$(PUSH 2; PUSH 3; PUSH 4; PUSH 5; POP 8; POP 9; POP 10; POP 11)
+BODY+=$(IN 0 $SREG)
+for r in 0 2 3 4 5 6 7 8 9 10 11 12 20 21; do
+    BODY+=$(STS $UDR0 $r)
+done
+# and change the LDI/LDI registers, so a split between them shows
+BODY+=$(MOV 18 2; MOV 19 3)
+PROGRAM+=$BODY
+# 16384 times round, then send the interrupt count and halt
+PROGRAM+=$(ADIW 26 1; CPI 27 0x40; BREQ 2; JMP $LOOP; STS $UDR0 31; HALT)
+image "$TMP/fusion.bin" "$PROGRAM"
+
+status=0
+expected=
+for engine in interp jit diff; do
+    "$EMULINO" --engine=$engine --fusion-report "$TMP/fusion.bin" < /dev/null > "$TMP/$engine.out" 2> "$TMP/$engine.err"
+    result="$(grep '^cycles:' "$TMP/$engine.err") output $(md5sum < "$TMP/$engine.out" | cut -c1-16)"
+    echo "$engine $result, $(wc -c < "$TMP/$engine.out") bytes"
+    if [ -z "$expected" ]; then
+        expected=$result
+    elif [ "$result" != "$expected" ]; then
+        status=1
+    fi
+done
+# and the interpreter did run them fused
+for fusion in LDI/LDI SUBI/SBCI ADD/ADC CP/CPC/BRNE PUSH/PUSH POP/POP; do
+    executed=$(awk -v f=$fusion '$1 == f && NF == 3 { print $3 }' "$TMP/interp.err")
+    echo "$fusion executed ${executed:-0} times"
+    if [ "${executed:-0}" = 0 ]; then
+        status=1
+    fi
+done
+[ $status = 0 ] && echo ok || echo FAILED
+exit $status
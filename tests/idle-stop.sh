@@ -0,0 +1,28 @@
+#!/bin/bash
+# Checks that stopping a board wherever it polls for input and carrying on,
+# as networks and the fuzzer do, leaves its cycle count as it was.
+#
+# usage: tests/idle-stop.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# jmp main, reti at the timer vector and everywhere else up to main
+VECTORS=0c942800$(printf '1895%.0s' $(seq 38))
+# main: sei, then 4096 times round adiw r26,1; cpi r27,0x10; breq out;
+# lds r24,UCSR0A; rjmp, and cli and halt
+MAIN=78941196b03119f08091c000facff894ffcf
+printf "$(echo $VECTORS$MAIN | sed 's/../\\x&/g')" > "$TMP/poll.bin"
+
+status=0
+for engine in interp jit diff; do
+    plain=$("$EMULINO" --engine=$engine "$TMP/poll.bin" < /dev/null 2>&1 | grep '^cycles:')
+    stopped=$("$EMULINO" --engine=$engine --stop-idle "$TMP/poll.bin" 2>&1 | grep '^cycles:')
+    echo "$engine $plain, with --stop-idle $stopped"
+    if [ -z "$plain" ] || [ "$plain" != "$stopped" ]; then
+        status=1
+    fi
+done
+[ $status = 0 ] && echo ok || echo FAILED
+exit $status
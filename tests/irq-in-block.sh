@@ -0,0 +1,35 @@
+#!/bin/bash
+# Checks that an interrupt taken in the middle of a block, by a write to
+# SREG setting I while the timer interrupt is pending, costs the same
+# cycles in every engine.
+#
+# usage: tests/irq-in-block.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# jmp main, reti at the timer vector and everywhere else up to main
+VECTORS=0c942800$(printf '1895%.0s' $(seq 38))
+# main: cli, a delay loop past the first timer overflow, ldi r16,0x80
+MAIN=f89484ec99e00197f1f700e8
+# then 30 nops, cli and halt
+TAIL=$(printf '0000%.0s' $(seq 30))f894ffcf
+
+status=0
+for store in "out 0fbf" "sts 00935f00" "st afe5b0e00c93"; do
+    set -- $store
+    printf "$(echo $VECTORS$MAIN$2$TAIL | sed 's/../\\x&/g')" > "$TMP/$1.bin"
+    expected=
+    for engine in interp jit diff; do
+        cycles=$("$EMULINO" --engine=$engine "$TMP/$1.bin" < /dev/null 2>&1 | grep '^cycles:')
+        echo "$1 $engine $cycles"
+        if [ -z "$expected" ]; then
+            expected=$cycles
+        elif [ "$cycles" != "$expected" ]; then
+            status=1
+        fi
+    done
+done
+[ $status = 0 ] && echo ok || echo FAILED
+exit $status
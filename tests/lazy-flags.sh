@@ -0,0 +1,78 @@
+#!/bin/bash
+# Checks the flags the interpreter evaluates lazily against the JIT, which
+# works them out as it goes: arithmetic and logic instructions, alone and
+# in pairs, each followed by a branch on every flag, an IN of SREG, and a
+# load of SREG from data memory pushed and popped, with the timer interrupt
+# saving and restoring SREG wherever it lands. Every engine must send the
+# same output and take the same cycles.
+#
+# usage: tests/lazy-flags.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+. "$(dirname "$0")/avr.sh"
+
+ISR=0x28
+MAIN=0x30
+LOOP=0x36
+
+# r24 = r16 op r17 and r25 = r17 op r16, from SREG = r22
+setup() {
+    MOV 24 16; MOV 25 17; OUT $SREG 22
+    $1; $2
+}
+
+# each flag, branched on, then SREG read both ways, then the results
+body() {
+    setup "$1" "$2"
+    local f regs=(18 19 20 21 23 28)
+    for f in 0 1 2 3 4 5; do
+        LDI ${regs[f]} 1; BRBS $f 1; LDI ${regs[f]} 0
+    done
+    for f in 0 1 2 3 4 5; do
+        STS $UDR0 ${regs[f]}
+    done
+    setup "$1" "$2"
+    IN 0 $SREG; STS $UDR0 0
+    setup "$1" "$2"
+    LDS 1 0x5f; PUSH 1; POP 2; STS $UDR0 2
+    STS $UDR0 24; STS $UDR0 25
+}
+
+PROGRAM=$(vectors $MAIN $ISR)
+# isr: count in r31, with SREG saved on the stack
+PROGRAM+=$(PUSH 0; IN 0 $SREG; PUSH 0; INC 31; POP 0; OUT $SREG 0; POP 0; RETI)
+# main: r16 and r17 walk through operands, and r22 through the flags
+# going in with I set
+PROGRAM+=$(LDI 16 0; LDI 17 0; LDI 22 0x80; LDI 26 0; LDI 27 0; SEI)
+for ops in "ADD 24 17" "ADC 24 17" "SUB 24 17" "SBC 24 17" "CP 24 17" "CPC 24 17" \
+           "AND 24 17" "OR 24 17" "EOR 24 17" "SUBI 24 0x5a" "SBCI 24 0x5a" "CPI 24 0x5a" \
+           "ANDI 24 0x5a" "ORI 24 0x5a" \
+           "ADD 24 17,AND 25 16" "ADD 24 17,ADC 25 16" "SUB 24 17,EOR 25 16" \
+           "SBC 24 17,AND 25 16" "ADC 24 17,CPC 25 16" "CP 24 17,CPC 25 16" \
+           "CPC 24 17,OR 25 16" "AND 24 17,SBC 25 16" "EOR 24 17,ADC 25 16"; do
+    op1=${ops%%,*}
+    op2=NOP
+    [ "$op1" != "$ops" ] && op2=${ops#*,}
+    PROGRAM+=$(body "$op1" "$op2")
+done
+# 1024 times round, then send the interrupt count and halt
+PROGRAM+=$(INC 16; BRNE 1; SUBI 17 0x11; SUBI 17 0xdb; INC 22; ANDI 22 0x3f; ORI 22 0x80)
+PROGRAM+=$(ADIW 26 1; CPI 27 4; BREQ 2; JMP $LOOP; STS $UDR0 31; HALT)
+image "$TMP/lazy.bin" "$PROGRAM"
+
+status=0
+expected=
+for engine in interp jit diff; do
+    "$EMULINO" --engine=$engine "$TMP/lazy.bin" < /dev/null > "$TMP/$engine.out" 2> "$TMP/$engine.err"
+    result="$(grep '^cycles:' "$TMP/$engine.err") output $(md5sum < "$TMP/$engine.out" | cut -c1-16)"
+    echo "$engine $result, $(wc -c < "$TMP/$engine.out") bytes"
+    if [ -z "$expected" ]; then
+        expected=$result
+    elif [ "$result" != "$expected" ]; then
+        status=1
+    fi
+done
+[ $status = 0 ] && echo ok || echo FAILED
+exit $status
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Checks that going back to a snapshot puts data memory back as it was,
+# copying only the pages written since, through the fuzzer, which takes
+# one where the board first waits for input and restores it before every
+# run. The firmware fills memory with a pattern at boot, checks all of it
+# on the first byte of each run, and then writes a run of bytes across
+# page boundaries and pushes across another, so a restore that misses any
+# of it faults the next run. So does the stack pointer not going back to
+# the top, and its count of bytes read, in registers, going past what one
+# run can send, so registers and I/O must go back too.
+#
+# usage: tests/restore.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+. "$(dirname "$0")/avr.sh"
+
+MAIN=0x28
+# fill 0x100-0x8ff with the low byte of each address xor the high byte,
+# with r1 = 0, r18 = 0x5a and the count of bytes read in Y
+BOOT=$(EOR 1 1; LDI 18 0x5a; LDI 28 0; LDI 29 0; LDI 26 0; LDI 27 1)
+BOOT+=$(MOV 16 26; EOR 16 27; STX 16; CPI 27 9; BRNE -5)
+WAIT=$((MAIN + $(words $BOOT)))
+# wait for a byte into r25
+READ=$(LDS 24 0xc0; ANDI 24 0x80; BREQ -4; LDS 25 $UDR0)
+# the first of a run: check the stack pointer and the pattern
+CHECK=$(IN 16 0x3d; CPI 16 0xff; BREQ 1; BREAK; LDI 26 0; LDI 27 1; MOV 16 26; EOR 16 27; LDX 17; CP 16 17; BREQ 1; BREAK; CPI 27 9; BRNE -8)
+READ+=$(CP 28 1; CPC 29 1; BRNE $(words $CHECK))$CHECK
+READ+=$(ADIW 28 1; CPI 29 2; BRNE 1; BREAK)
+# write 256 bytes from 0x3c0 plus the byte read, none matching the pattern
+WRITE=$(LDI 26 0xc0; LDI 27 3; ADD 26 25; ADC 27 1; LDI 19 0)
+WRITE+=$(MOV 16 26; EOR 16 27; EOR 16 18; STX 16; DEC 19; BRNE -6)
+# push 72 bytes of 0x5a onto the stack and pop all but one of them
+WRITE+=$(LDI 19 72; PUSH 18; DEC 19; BRNE -3; LDI 19 71; POP 21; DEC 19; BRNE -3)
+PROGRAM=$(vectors $MAIN)$BOOT$READ$WRITE$(JMP $WAIT)
+image "$TMP/restore.bin" "$PROGRAM"
+
+mkdir "$TMP/corpus" "$TMP/crashes"
+printf 'x' > "$TMP/corpus/x"
+if "$EMULINO" --fuzz "$TMP/corpus" --crashes "$TMP/crashes" --runs 500 "$TMP/restore.bin" 2> "$TMP/fuzz.err"; then
+    tail -1 "$TMP/fuzz.err"
+    echo ok
+else
+    cat "$TMP/fuzz.err"
+    echo FAILED
+    exit 1
+fi
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Checks that the timer overflows exactly every period: an overflow runs
+# after the instruction that reaches it, which can go past it by up to
+# three cycles, and the next must still be a period on from where this
+# one was due. The main loop is calls and returns of four cycles each,
+# and the interrupt's length puts each overflow partway through one, so a
+# timer that counted from where it ran would fall behind by a period in a
+# few thousand and the count of interrupts taken come up short.
+#
+# usage: tests/timer.sh [path to emulino]
+
+EMULINO=${1:-./emulino}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+. "$(dirname "$0")/avr.sh"
+
+PERIOD=10001
+
+# isr: count in Z, with SREG saved on the stack
+ISR=$(PUSH 0; IN 0 $SREG; PUSH 0; ADIW 30 1; NOP; POP 0; OUT $SREG 0; POP 0; RETI)
+SUB=$((0x28 + $(words $ISR)))
+INIT=$(LDI 28 0; LDI 30 0; LDI 31 0; SEI)
+MAIN=$((SUB + 1))
+LOOP=$((MAIN + $(words $INIT)))
+PROGRAM=$(vectors $MAIN 0x28)$ISR$(RET)$INIT
+# 65536 times round eight calls, 24 times, then send the count and halt
+BODY=$(CALL $SUB; CALL $SUB; CALL $SUB; CALL $SUB; CALL $SUB; CALL $SUB; CALL $SUB; CALL $SUB)
+PROGRAM+=$(LDI 26 0; LDI 27 0)$BODY$(ADIW 26 1; BRNE $((-2 - $(words $BODY))))
+PROGRAM+=$(INC 28; CPI 28 24; BREQ 2; JMP $LOOP; STS $UDR0 30; STS $UDR0 31; HALT)
+image "$TMP/timer.bin" "$PROGRAM"
+
+status=0
+for engine in interp jit; do
+    "$EMULINO" --engine=$engine "$TMP/timer.bin" < /dev/null > "$TMP/$engine.out" 2> "$TMP/$engine.err"
+    cycles=$(awk '$1 == "cycles:" { print $2 }' "$TMP/$engine.err")
+    taken=$(od -An -tu2 "$TMP/$engine.out" | tr -d ' ')
+    echo "$engine cycles: $cycles, $taken overflows taken, $((cycles / PERIOD)) due"
+    if [ -z "$cycles" ] || [ "$taken" != $((cycles / PERIOD)) ]; then
+        status=1
+    fi
+done
+[ $status = 0 ] && echo ok || echo FAILED
+exit $status
@@ -0,0 +1,543 @@
+/*
+ * Threaded-code interpreter core for emulino
+ * Copyright 2009 Greg Hewgill
+ *
+ * This file is part of Emulino.
+ *
+ * Emulino is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Emulino is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The same interpreter as the loop in cpu_run(), but written as a single
+ * function that dispatches with computed goto. PC, cycle and SREG live in
+ * locals and are only written back to the Cpu when calling a do_* handler
+ * (which covers every hooked I/O access) and when returning for a poll.
+ * Flags are computed eagerly here; any lazy flags a handler leaves
+ * behind are synced before SREG is picked up again.
+ * Register-only instructions, and loads and stores of plain memory, are
+ * implemented here directly and must match their do_* handlers in cpu.c
+ * exactly.
+ */
+
+#include <string.h>
+
+#include "util.h"
+
+#include "core.h"
+
+#ifdef THREADED
+
+// SREG bits
+#define F_C BIT(0)
+#define F_Z BIT(1)
+#define F_N BIT(2)
+#define F_V BIT(3)
+#define F_S BIT(4)
+#define F_H BIT(5)
+#define F_T BIT(6)
+
+static inline u8 add_flags(u8 d, u8 r, u8 x)
+{
+    u8 c = (d & r) | (r & ~x) | (~x & d);
+    u8 v = (((d & r & ~x) | (~d & ~r & x)) >> 7) & 1;
+    u8 n = x >> 7;
+    return ((c >> 3) & 1) * F_H | (n ^ v) * F_S | v * F_V | n * F_N | (x == 0) * F_Z | (c >> 7) * F_C;
+}
+
+static inline u8 sub_flags(u8 d, u8 r, u8 x)
+{
+    u8 c = (~d & r) | (r & x) | (x & ~d);
+    u8 v = (((d & ~r & ~x) | (~d & r & x)) >> 7) & 1;
+    u8 n = x >> 7;
+    return ((c >> 3) & 1) * F_H | (n ^ v) * F_S | v * F_V | n * F_N | (x == 0) * F_Z | (c >> 7) * F_C;
+}
+
+static inline u8 logic_flags(u8 x)
+{
+    u8 n = x >> 7;
+    return n * F_S | n * F_N | (x == 0) * F_Z;
+}
+
+#define ARITH   (F_H|F_S|F_V|F_N|F_Z|F_C)
+#define LOGIC   (F_S|F_V|F_N|F_Z)
+
+int threaded_run(Cpu *cpu)
+{
+    static const struct {
+        const char *name;
+        const void *label;
+    } Inline[] = {
+        {"ADC", &&ADC}, {"ADD", &&ADD}, {"ADIW", &&ADIW}, {"AND", &&AND}, {"ANDI", &&ANDI},
+        {"ASR", &&ASR}, {"BCLR", &&BCLR}, {"BLD", &&BLD}, {"BRBC", &&BRBC}, {"BRBS", &&BRBS},
+        {"BSET", &&BSET}, {"BST", &&BST}, {"COM", &&COM}, {"CP", &&CP}, {"CPC", &&CPC},
+        {"CPI", &&CPI}, {"CPSE", &&CPSE}, {"DEC", &&DEC}, {"EOR", &&EOR}, {"INC", &&INC},
+        {"LDI", &&LDI}, {"LSR", &&LSR}, {"MOV", &&MOV}, {"MOVW", &&MOVW}, {"MUL", &&MUL},
+        {"NEG", &&NEG}, {"NOP", &&NOP}, {"OR", &&OR}, {"ORI", &&ORI}, {"RJMP", &&RJMP},
+        {"ROR", &&ROR}, {"SBC", &&SBC}, {"SBCI", &&SBCI}, {"SBIW", &&SBIW}, {"SBRC", &&SBRC},
+        {"SBRS", &&SBRS}, {"SUB", &&SUB}, {"SUBI", &&SUBI}, {"SWAP", &&SWAP},
+        {"LD_X1", &&LD_X1}, {"LD_X2", &&LD_X2}, {"LD_X3", &&LD_X3}, {"LD_Y2", &&LD_Y2},
+        {"LD_Y3", &&LD_Y3}, {"LD_Y4", &&LD_Y4}, {"LD_Z2", &&LD_Z2}, {"LD_Z3", &&LD_Z3},
+        {"LD_Z4", &&LD_Z4}, {"LDS", &&LDS}, {"POP", &&POP},
+        {"ST_X1", &&ST_X1}, {"ST_X2", &&ST_X2}, {"ST_X3", &&ST_X3}, {"ST_Y2", &&ST_Y2},
+        {"ST_Y3", &&ST_Y3}, {"ST_Y4", &&ST_Y4}, {"ST_Z2", &&ST_Z2}, {"ST_Z3", &&ST_Z3},
+        {"ST_Z4", &&ST_Z4}, {"STS", &&STS}, {"PUSH", &&PUSH},
+    };
+    static const void *Labels[256];
+
+    // cpu_init() calls this once with no cpu to fill in Labels before any
+    // boards can be running
+    if (cpu == NULL) {
+        int i, j;
+        for (i = 0; i < LENGTHOF(Labels); i++) {
+            Labels[i] = &&call;
+        }
+        for (i = 0; i < InstructionCount; i++) {
+            for (j = 0; j < LENGTHOF(Inline); j++) {
+                if (strcmp(Instructions[i].name, Inline[j].name) == 0) {
+                    Labels[i] = Inline[j].label;
+                }
+            }
+        }
+        // PUSH and POP runs go through their handlers
+        Labels[InstructionCount + FUSE_LDI_LDI] = &&LDI_LDI;
+        Labels[InstructionCount + FUSE_SUBI_SBCI] = &&SUBI_SBCI;
+        Labels[InstructionCount + FUSE_ADD_ADC] = &&ADD_ADC;
+        Labels[InstructionCount + FUSE_CP_CPC_BRNE] = &&CP_CPC_BRNE;
+        return 0;
+    }
+
+    if (cpu->state != CPU_RUN) {
+        return cpu->state;
+    }
+
+    sreg_sync(cpu);
+    u8 *const reg = cpu->data.Reg;
+    u8 *const bytes = cpu->data._Bytes;
+    const Op *const decoded = cpu->decoded;
+    const Block *blocks = cpu->blocks;
+    const u8 *access = cpu->access;
+    u16 pc = cpu->pc;
+    u64 cycle = cpu->cycle;
+    u8 sreg = cpu->data.SREG.bits;
+    u64 nextevent = cpu->nextevent;
+    u64 dirty = 0;      // pages stored to since the last write back
+    const Op *op;
+    const Block *b;
+    int remaining = 0;  // ops left to run in the current block
+    u8 x;
+    u16 w;
+    int n;
+
+    #define DISPATCH() \
+        op = &decoded[pc]; \
+        pc += op->length; \
+        goto *Labels[op->id]
+    #define NEXT() \
+        if (--remaining > 0) { \
+            DISPATCH(); \
+        } \
+        goto block
+    #define SKIP() { \
+        u8 n = decoded[pc].length; \
+        pc += n; \
+        cycle += n; \
+    }
+
+    // superinstructions continue with the next Op without dispatching;
+    // they always end a block so cycle is exact here
+    #define FOLLOW() \
+        if (cycle >= nextevent) goto poll; \
+        op = &decoded[pc]; \
+        pc += op->length; \
+        cycle += op->cycles
+
+    // loads and stores go straight to memory unless the address is a hooked
+    // I/O location or watched, in which case the handler does the whole thing
+    #define LOAD(addr, update) \
+        w = addr; \
+        if (access[w] & SLOW_READ) goto call; \
+        update; \
+        reg[op->d] = bytes[w]; \
+        NEXT()
+    #define STORE(addr, update, value) \
+        w = addr; \
+        if (access[w] & SLOW_WRITE) goto call; \
+        update; \
+        bytes[w] = value; \
+        dirty |= 1ULL << (w >> DIRTY_SHIFT); \
+        NEXT()
+
+    #define DO_ADC() { \
+        x = reg[op->d] + reg[op->r] + (sreg & F_C); \
+        sreg = (sreg & ~ARITH) | add_flags(reg[op->d], reg[op->r], x); \
+        reg[op->d] = x; \
+    }
+    #define DO_ADD() { \
+        x = reg[op->d] + reg[op->r]; \
+        sreg = (sreg & ~ARITH) | add_flags(reg[op->d], reg[op->r], x); \
+        reg[op->d] = x; \
+    }
+    #define DO_BRBC() { \
+        if ((sreg & (1 << op->b)) == 0) { \
+            pc += op->k; \
+            cycle++; \
+        } \
+    }
+    #define DO_CP() { \
+        x = reg[op->d] - reg[op->r]; \
+        sreg = (sreg & ~ARITH) | sub_flags(reg[op->d], reg[op->r], x); \
+    }
+    #define DO_CPC() { \
+        x = reg[op->d] - reg[op->r] - (sreg & F_C); \
+        sreg = (sreg & ~ARITH) | (sub_flags(reg[op->d], reg[op->r], x) & (sreg | ~F_Z)); \
+    }
+    #define DO_LDI() reg[op->d] = op->k
+    #define DO_SBCI() { \
+        x = reg[op->d] - op->k - (sreg & F_C); \
+        sreg = (sreg & ~ARITH) | (sub_flags(reg[op->d], op->k, x) & (sreg | ~F_Z)); \
+        reg[op->d] = x; \
+    }
+    #define DO_SUBI() { \
+        x = reg[op->d] - op->k; \
+        sreg = (sreg & ~ARITH) | sub_flags(reg[op->d], op->k, x); \
+        reg[op->d] = x; \
+    }
+
+    goto enter;
+
+block:
+    if (cycle >= nextevent) goto poll;
+enter:
+    // add the static cost of the block up front unless it could reach
+    // the next event, in which case go one instruction at a time
+    b = &blocks[pc];
+    if (cycle + b->cycles < nextevent) {
+        cycle += b->cycles;
+        remaining = b->count;
+    } else {
+        cycle += decoded[pc].cycles;
+        remaining = 1;
+    }
+    DISPATCH();
+
+call:
+    cpu->pc = pc;
+    cpu->cycle = cycle;
+    cpu->data.SREG.bits = sreg;
+    cpu->dirty |= dirty;
+    op->handler(cpu, op);
+    if (cpu->state != CPU_RUN) {
+        cpu_block_refund(cpu, remaining - 1);
+        cpu_poll(cpu);
+        return cpu->state;
+    }
+    sreg_sync(cpu);
+    pc = cpu->pc;
+    cycle = cpu->cycle;
+    sreg = cpu->data.SREG.bits;
+    nextevent = cpu->nextevent;
+    // a watch callback can add or remove watchpoints
+    blocks = cpu->blocks;
+    access = cpu->access;
+    NEXT();
+
+poll:
+    cpu->pc = pc;
+    cpu->cycle = cycle;
+    cpu->data.SREG.bits = sreg;
+    cpu->dirty |= dirty;
+    cpu_poll(cpu);
+    return cpu->state;
+
+ADC:
+    DO_ADC();
+    NEXT();
+ADD:
+    DO_ADD();
+    NEXT();
+ADIW:
+    w = cpu->data.RegW[op->d] + op->k;
+    {
+        u8 v = ((~cpu->data.RegW[op->d] & w) >> 15) & 1;
+        u8 n = w >> 15;
+        sreg = (sreg & ~(F_S|F_V|F_N|F_Z|F_C)) | (n ^ v) * F_S | v * F_V | n * F_N | (w == 0) * F_Z
+             | (((~w & cpu->data.RegW[op->d]) >> 15) & 1) * F_C;
+    }
+    cpu->data.RegW[op->d] = w;
+    NEXT();
+AND:
+    x = reg[op->d] &= reg[op->r];
+    sreg = (sreg & ~LOGIC) | logic_flags(x);
+    NEXT();
+ANDI:
+    x = reg[op->d] &= op->k;
+    sreg = (sreg & ~LOGIC) | logic_flags(x);
+    NEXT();
+ASR:
+    {
+        u8 c = reg[op->d] & 0x01;
+        x = reg[op->d] = (s8)reg[op->d] >> 1;
+        u8 n = x >> 7;
+        u8 v = n ^ c;
+        sreg = (sreg & ~(F_S|F_V|F_N|F_Z|F_C)) | (n ^ v) * F_S | v * F_V | n * F_N | (x == 0) * F_Z | c * F_C;
+    }
+    NEXT();
+BCLR:
+    sreg &= ~(1 << op->b);
+    NEXT();
+BLD:
+    reg[op->d] = (reg[op->d] & ~(1 << op->b)) | (((sreg & F_T) ? 1 : 0) << op->b);
+    NEXT();
+BRBC:
+    DO_BRBC();
+    NEXT();
+BRBS:
+    if (sreg & (1 << op->b)) {
+        pc += op->k;
+        cycle++;
+    }
+    NEXT();
+BSET:
+    sreg |= 1 << op->b;
+    NEXT();
+BST:
+    sreg = (reg[op->d] & (1 << op->b)) ? sreg | F_T : sreg & ~F_T;
+    NEXT();
+COM:
+    x = reg[op->d] = ~reg[op->d];
+    sreg = (sreg & ~(LOGIC|F_C)) | logic_flags(x) | F_C;
+    NEXT();
+CP:
+    DO_CP();
+    NEXT();
+CPC:
+    DO_CPC();
+    NEXT();
+CPI:
+    x = reg[op->d] - op->k;
+    sreg = (sreg & ~ARITH) | sub_flags(reg[op->d], op->k, x);
+    NEXT();
+CPSE:
+    if (reg[op->d] == reg[op->r]) SKIP();
+    NEXT();
+DEC:
+    x = --reg[op->d];
+    {
+        u8 v = x == 0x7f;
+        u8 n = x >> 7;
+        sreg = (sreg & ~LOGIC) | (n ^ v) * F_S | v * F_V | n * F_N | (x == 0) * F_Z;
+    }
+    NEXT();
+EOR:
+    x = reg[op->d] ^= reg[op->r];
+    sreg = (sreg & ~LOGIC) | logic_flags(x);
+    NEXT();
+INC:
+    x = ++reg[op->d];
+    {
+        u8 v = x == 0x80;
+        u8 n = x >> 7;
+        sreg = (sreg & ~LOGIC) | (n ^ v) * F_S | v * F_V | n * F_N | (x == 0) * F_Z;
+    }
+    NEXT();
+LD_X1:
+    LOAD(cpu->data.X, );
+LD_X2:
+    LOAD(cpu->data.X, cpu->data.X = w + 1);
+LD_X3:
+    LOAD(cpu->data.X - 1, cpu->data.X = w);
+LD_Y2:
+    LOAD(cpu->data.Y, cpu->data.Y = w + 1);
+LD_Y3:
+    LOAD(cpu->data.Y - 1, cpu->data.Y = w);
+LD_Y4:
+    LOAD(cpu->data.Y + op->k, );
+LD_Z2:
+    LOAD(cpu->data.Z, cpu->data.Z = w + 1);
+LD_Z3:
+    LOAD(cpu->data.Z - 1, cpu->data.Z = w);
+LD_Z4:
+    LOAD(cpu->data.Z + op->k, );
+LDI:
+    DO_LDI();
+    NEXT();
+LDS:
+    LOAD(op->k, );
+LSR:
+    {
+        u8 c = reg[op->d] & 0x01;
+        x = reg[op->d] >>= 1;
+        sreg = (sreg & ~(F_S|F_V|F_N|F_Z|F_C)) | c * F_S | c * F_V | (x == 0) * F_Z | c * F_C;
+    }
+    NEXT();
+MOV:
+    reg[op->d] = reg[op->r];
+    NEXT();
+MOVW:
+    reg[op->d] = reg[op->r];
+    reg[op->d+1] = reg[op->r+1];
+    NEXT();
+MUL:
+    w = reg[op->d] * reg[op->r];
+    reg[1] = w >> 8;
+    reg[0] = w & 0xff;
+    sreg = (sreg & ~(F_Z|F_C)) | (w == 0) * F_Z | (w >> 15) * F_C;
+    NEXT();
+NEG:
+    x = -reg[op->d];
+    {
+        u8 v = x == 0x80;
+        u8 n = x >> 7;
+        sreg = (sreg & ~ARITH) | (((x | reg[op->d]) >> 3) & 1) * F_H | (n ^ v) * F_S | v * F_V | n * F_N
+             | (x == 0) * F_Z | (x != 0) * F_C;
+    }
+    reg[op->d] = x;
+    NEXT();
+NOP:
+    NEXT();
+OR:
+    x = reg[op->d] |= reg[op->r];
+    sreg = (sreg & ~LOGIC) | logic_flags(x);
+    NEXT();
+ORI:
+    x = reg[op->d] |= op->k;
+    sreg = (sreg & ~LOGIC) | logic_flags(x);
+    NEXT();
+POP:
+    LOAD(cpu->data.SP + 1, cpu->data.SP = w);
+PUSH:
+    STORE(cpu->data.SP, cpu->data.SP = w - 1, reg[op->r]);
+RJMP:
+    if (op->handler != Instructions[op->id].handler) {
+        // jump-to-self halt
+        goto call;
+    }
+    pc += op->k;
+    NEXT();
+ROR:
+    {
+        u8 c = reg[op->d] & 0x01;
+        u8 oldc = sreg & F_C;
+        x = reg[op->d] = (reg[op->d] >> 1) | (oldc << 7);
+        u8 n = x >> 7;
+        u8 v = n ^ oldc;
+        sreg = (sreg & ~(F_S|F_V|F_N|F_Z|F_C)) | (n ^ v) * F_S | v * F_V | n * F_N | (x == 0) * F_Z | c * F_C;
+    }
+    NEXT();
+SBC:
+    x = reg[op->d] - reg[op->r] - (sreg & F_C);
+    sreg = (sreg & ~ARITH) | (sub_flags(reg[op->d], reg[op->r], x) & (sreg | ~F_Z));
+    reg[op->d] = x;
+    NEXT();
+SBCI:
+    DO_SBCI();
+    NEXT();
+SBIW:
+    w = cpu->data.RegW[op->d] - op->k;
+    {
+        u8 v = ((cpu->data.RegW[op->d] & ~w) >> 15) & 1;
+        u8 n = w >> 15;
+        sreg = (sreg & ~(F_S|F_V|F_N|F_Z|F_C)) | (n ^ v) * F_S | v * F_V | n * F_N | (w == 0) * F_Z
+             | (((w & ~cpu->data.RegW[op->d]) >> 15) & 1) * F_C;
+    }
+    cpu->data.RegW[op->d] = w;
+    NEXT();
+SBRC:
+    if ((reg[op->r] & (1 << op->b)) == 0) SKIP();
+    NEXT();
+SBRS:
+    if (reg[op->r] & (1 << op->b)) SKIP();
+    NEXT();
+ST_X1:
+    STORE(cpu->data.X, , reg[op->r]);
+ST_X2:
+    STORE(cpu->data.X, cpu->data.X = w + 1, reg[op->r]);
+ST_X3:
+    STORE(cpu->data.X - 1, cpu->data.X = w, reg[op->r]);
+ST_Y2:
+    STORE(cpu->data.Y, cpu->data.Y = w + 1, reg[op->r]);
+ST_Y3:
+    STORE(cpu->data.Y - 1, cpu->data.Y = w, reg[op->r]);
+ST_Y4:
+    STORE(cpu->data.Y + op->k, , reg[op->r]);
+ST_Z2:
+    STORE(cpu->data.Z, cpu->data.Z = w + 1, reg[op->r]);
+ST_Z3:
+    STORE(cpu->data.Z - 1, cpu->data.Z = w, reg[op->r]);
+ST_Z4:
+    STORE(cpu->data.Z + op->k, , reg[op->r]);
+STS:
+    STORE(op->k, , reg[op->d]);
+SUB:
+    x = reg[op->d] - reg[op->r];
+    sreg = (sreg & ~ARITH) | sub_flags(reg[op->d], reg[op->r], x);
+    reg[op->d] = x;
+    NEXT();
+SUBI:
+    DO_SUBI();
+    NEXT();
+SWAP:
+    reg[op->d] = (reg[op->d] << 4) | (reg[op->d] >> 4);
+    NEXT();
+
+LDI_LDI:
+    cpu->fusionexecuted[FUSE_LDI_LDI]++;
+    DO_LDI();
+    FOLLOW();
+    DO_LDI();
+    NEXT();
+SUBI_SBCI:
+    cpu->fusionexecuted[FUSE_SUBI_SBCI]++;
+    DO_SUBI();
+    FOLLOW();
+    DO_SBCI();
+    NEXT();
+ADD_ADC:
+    cpu->fusionexecuted[FUSE_ADD_ADC]++;
+    n = op->b;
+    DO_ADD();
+    while (n-- > 0) {
+        FOLLOW();
+        DO_ADC();
+    }
+    NEXT();
+CP_CPC_BRNE:
+    cpu->fusionexecuted[FUSE_CP_CPC_BRNE]++;
+    n = op->b;
+    DO_CP();
+    while (n-- > 0) {
+        FOLLOW();
+        DO_CPC();
+    }
+    FOLLOW();
+    DO_BRBC();
+    NEXT();
+
+    #undef DISPATCH
+    #undef NEXT
+    #undef SKIP
+    #undef FOLLOW
+    #undef LOAD
+    #undef STORE
+    #undef DO_ADC
+    #undef DO_ADD
+    #undef DO_BRBC
+    #undef DO_CP
+    #undef DO_CPC
+    #undef DO_LDI
+    #undef DO_SBCI
+    #undef DO_SUBI
+}
+
+#endif // THREADED
@@ -22,14 +22,24 @@
 
 #include "cpu.h"
 
-#define TIMER_IRQ   17
+#define TIMER_IRQ       17
+#define TIMER_PERIOD    10001   // cycles between overflow interrupts
 
-void timer_poll()
+// The next overflow is a period on from this one's deadline, not from the
+// cycle it ran on, so the period doesn't stretch by however far the
+// instruction that reached it went past.
+static void timer_overflow(Cpu *cpu, u64 when)
 {
-    irq(TIMER_IRQ);
+    irq(cpu, TIMER_IRQ);
+    schedule_event(cpu, when + TIMER_PERIOD, timer_overflow);
 }
 
 void timer_init()
 {
-    register_poll(timer_poll);
+    register_event(timer_overflow);
+}
+
+void timer_attach(Cpu *cpu)
+{
+    schedule_event(cpu, cpu_get_cycles(cpu) + TIMER_PERIOD, timer_overflow);
 }
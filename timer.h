@@ -18,4 +18,12 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include "cpu.h"
+
 void timer_init();
+void timer_attach(Cpu *cpu);
+
+#endif // __TIMER_H
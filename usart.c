@@ -20,11 +20,13 @@
 
 #include "usart.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/select.h>
 #include <unistd.h>
 
-#include "cpu.h"
+#include "core.h"
 
 #define USART_UCSR0A    0xc0
 #define USART_UCSR0B    0xc1
@@ -38,62 +40,161 @@
 
 #define USART_IRQ   19
 
-static int output = 0; // stdout
-static int input = 1;  // stdin
-
-u8 UCSRA;
-u8 UCSRB;
-
-u8 usart_read_ucsra(u16 addr)
+u8 usart_read_ucsra(Cpu *cpu, u16 addr)
 {
-    return UCSRA | USART_UCSRA_UDRE;
+    UsartState *usart = &cpu->usart;
+    // a loop waiting to send sees UDRE at once, so only one waiting for
+    // input reads UCSRA over and over from the same place with nothing in
+    // between; a main loop that does other work and checks for input on
+    // the way round isn't idle
+    if (usart->stopidle && usart->input < 0 && (usart->ucsra & USART_UCSRA_RXC) == 0) {
+        if (cpu->pc == usart->idlepc && cpu->cycle - usart->idlecycle <= USART_IDLE_LOOP) {
+            usart->idlepolls++;
+        } else {
+            usart->idlepolls = 1;
+        }
+        usart->idlepc = cpu->pc;
+        usart->idlecycle = cpu->cycle;
+        if (usart->idlepolls >= USART_IDLE_POLLS) {
+            usart->idlepolls = 0;
+            cpu->resume = CPU_RUN;
+            cpu->state = CPU_STOP;
+        }
+    }
+    return usart->ucsra | USART_UCSRA_UDRE;
 }
 
-void usart_write_ucsra(u16 addr, u8 value)
+void usart_write_ucsra(Cpu *cpu, u16 addr, u8 value)
 {
-    UCSRA &= ~(value & (USART_UCSRA_TXC));
+    cpu->usart.ucsra &= ~(value & (USART_UCSRA_TXC));
 }
 
-u8 usart_read_ucsrb(u16 addr)
+u8 usart_read_ucsrb(Cpu *cpu, u16 addr)
 {
-    return UCSRB;
+    return cpu->usart.ucsrb;
 }
 
-void usart_write_ucsrb(u16 addr, u8 value)
+void usart_write_ucsrb(Cpu *cpu, u16 addr, u8 value)
 {
-    UCSRB = value;
-    if (UCSRB & USART_UCSRB_RXCIE) {
+    cpu->usart.ucsrb = value;
+    if (cpu->usart.ucsrb & USART_UCSRB_RXCIE) {
     }
 }
 
-u8 usart_read_udr(u16 addr)
+u8 usart_read_udr(Cpu *cpu, u16 addr)
 {
-    if (UCSRA & USART_UCSRA_RXC) {
-        UCSRA &= ~USART_UCSRA_RXC;
-        u8 c;
-        read(input, &c, 1);
+    UsartState *usart = &cpu->usart;
+    usart->idlepolls = 0;
+    if (usart->rxcount > 0) {
+        u8 c = usart->rx[usart->rxhead];
+        usart->rxhead = (usart->rxhead + 1) % USART_RX_SIZE;
+        if (--usart->rxcount == 0) {
+            usart->ucsra &= ~USART_UCSRA_RXC;
+        }
+        return c;
+    }
+    if (usart->ucsra & USART_UCSRA_RXC) {
+        usart->ucsra &= ~USART_UCSRA_RXC;
+        if (usart->incount == 0) {
+            // at the end of the input
+            return 0;
+        }
+        u8 c = usart->in[usart->inhead++];
+        usart->incount--;
         return c;
     } else {
         return 0;
     }
 }
 
-void usart_write_udr(u16 addr, u8 value)
+void usart_write_udr(Cpu *cpu, u16 addr, u8 value)
 {
-    write(output, &value, 1);
+    UsartState *usart = &cpu->usart;
+    usart->idlepolls = 0;
+    if (usart->callback != NULL) {
+        usart->callback(cpu, value);
+        return;
+    }
+    if (usart->tx == NULL) {
+        usart->tx = malloc(USART_TX_SIZE);
+        if (usart->tx == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    usart->tx[usart->txcount++] = value;
+    if (usart->txcount == USART_TX_SIZE || (usart->linebuffered && value == '\n')) {
+        usart_flush(cpu);
+    }
 }
 
-void usart_poll()
+// Writes out the output held back so far. cpu_run() calls this before
+// it returns, so nothing is held for longer than it takes to get to the
+// next event.
+void usart_flush(Cpu *cpu)
 {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(input, &fds);
-    struct timeval timeout = {0, 0};
-    if (select(input+1, &fds, NULL, NULL, &timeout) > 0) {
-        UCSRA |= USART_UCSRA_RXC;
-        if (UCSRB & USART_UCSRB_RXCIE) {
-            irq(USART_IRQ);
+    UsartState *usart = &cpu->usart;
+    int done = 0;
+    while (done < usart->txcount) {
+        int n = write(usart->output, usart->tx + done, usart->txcount - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // a non-blocking fd that's full, so wait for room
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(usart->output, &fds);
+            select(usart->output+1, NULL, &fds, NULL, NULL);
+            continue;
+        }
+        if (n <= 0) {
+            perror("usart output");
+            exit(1);
+        }
+        done += n;
+    }
+    usart->txcount = 0;
+}
+
+void usart_poll(Cpu *cpu)
+{
+    if (cpu->usart.rxcount > 0) {
+        // still holding received bytes, so keep interrupting until they're read
+        if (cpu->usart.ucsrb & USART_UCSRB_RXCIE) {
+            irq(cpu, USART_IRQ);
+        }
+        return;
+    }
+    UsartState *usart = &cpu->usart;
+    int input = usart->input;
+    if (input < 0) {
+        return;
+    }
+    // input is taken from the fd as much at a time as there is, but still
+    // turns up a byte a poll
+    if (usart->incount == 0) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(input, &fds);
+        struct timeval timeout = {0, 0};
+        if (select(input+1, &fds, NULL, NULL, &timeout) <= 0) {
+            return;
         }
+        if (usart->in == NULL) {
+            usart->in = malloc(USART_IN_SIZE);
+            if (usart->in == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+        int n = read(input, usart->in, USART_IN_SIZE);
+        usart->inhead = 0;
+        usart->incount = n > 0 ? n : 0;
+    }
+    usart->ucsra |= USART_UCSRA_RXC;
+    if (usart->ucsrb & USART_UCSRB_RXCIE) {
+        irq(cpu, USART_IRQ);
     }
 }
 
@@ -105,12 +206,62 @@ void usart_init()
     register_poll(usart_poll);
 }
 
-void usart_set_output(int f)
+void usart_attach(Cpu *cpu)
+{
+    cpu->usart.output = 0; // stdout
+    cpu->usart.input = 1;  // stdin
+}
+
+void usart_set_output(Cpu *cpu, int f)
+{
+    usart_flush(cpu);
+    cpu->usart.output = f;
+}
+
+void usart_set_input(Cpu *cpu, int f)
+{
+    cpu->usart.input = f;
+    cpu->usart.incount = 0;
+}
+
+void usart_set_callback(Cpu *cpu, SerialFunction f)
 {
-    output = f;
+    usart_flush(cpu);
+    cpu->usart.callback = f;
+}
+
+void usart_set_line_buffered(Cpu *cpu, bool line)
+{
+    cpu->usart.linebuffered = line;
+}
+
+void usart_free(Cpu *cpu)
+{
+    usart_flush(cpu);
+    free(cpu->usart.tx);
+    free(cpu->usart.in);
+}
+
+// Queues bytes for the board to read from UDR, as if they had arrived on
+// the RX pin, and returns how many there was room for.
+int usart_receive(Cpu *cpu, const u8 *buf, int len)
+{
+    UsartState *usart = &cpu->usart;
+    int n = 0;
+    while (n < len && usart->rxcount < USART_RX_SIZE) {
+        usart->rx[(usart->rxhead + usart->rxcount++) % USART_RX_SIZE] = buf[n++];
+    }
+    if (usart->rxcount > 0) {
+        usart->ucsra |= USART_UCSRA_RXC;
+        if (usart->ucsrb & USART_UCSRB_RXCIE) {
+            irq(cpu, USART_IRQ);
+        }
+    }
+    return n;
 }
 
-void usart_set_input(int f)
+void usart_stop_idle(Cpu *cpu, bool stop)
 {
-    input = f;
+    cpu->usart.stopidle = stop;
+    cpu->usart.idlepolls = 0;
 }
@@ -18,6 +18,47 @@
  * along with Emulino.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __USART_H
+#define __USART_H
+
+#include "cpu.h"
+
+#define USART_RX_SIZE   256
+#define USART_IDLE_POLLS 8      // empty polls in a row before usart_stop_idle() stops
+#define USART_IDLE_LOOP 16      // most cycles between polls of a loop doing nothing else
+#define USART_TX_SIZE   4096    // output held back for one write()
+#define USART_IN_SIZE   4096    // input taken from the fd in one read()
+
+typedef struct {
+    int output;
+    int input;                  // or -1 for none
+    SerialFunction callback;    // takes the output instead of the fd when set
+    u8 *tx;                     // output not yet written, allocated by the first byte
+    int txcount;
+    bool linebuffered;          // write out at every newline
+    u8 *in;                     // read from the fd and not yet received, allocated by the first read
+    int inhead;
+    int incount;
+    u8 ucsra;
+    u8 ucsrb;
+    u8 rx[USART_RX_SIZE];       // from usart_receive(), read before the fd
+    int rxhead;
+    int rxcount;
+    bool stopidle;
+    int idlepolls;              // UCSRA reads with nothing received since the last transfer
+    u16 idlepc;                 // where the last of them was
+    u64 idlecycle;              // and when
+} UsartState;
+
 void usart_init();
-void usart_set_output(int fd);
-void usart_set_input(int fd);
+void usart_attach(Cpu *cpu);
+void usart_set_output(Cpu *cpu, int fd);
+void usart_set_input(Cpu *cpu, int fd);
+void usart_set_callback(Cpu *cpu, SerialFunction f);
+void usart_set_line_buffered(Cpu *cpu, bool line);
+void usart_flush(Cpu *cpu);
+void usart_free(Cpu *cpu);
+int usart_receive(Cpu *cpu, const u8 *buf, int len);
+void usart_stop_idle(Cpu *cpu, bool stop);
+
+#endif // __USART_H
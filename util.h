@@ -26,6 +26,7 @@ typedef unsigned char u8;
 typedef signed short s16;
 typedef unsigned short u16;
 typedef unsigned long u32;
+typedef unsigned long long u64;
 
 #ifndef __cplusplus
 typedef int bool;